@@ -0,0 +1,113 @@
+/*
+    Microbenchmark for the interleaving of planar decoded image components
+
+    Copyright (C) 2019 Ruven Pillay.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   Compares the SSE4.1 interleaving kernels used for JPEG2000 decoding against the scalar
+   loop for 1 to 4 channels at 8 and 16 bits per channel. The output of each kernel is first
+   checked against that of the scalar loop. Build with "make interleave" in this directory.
+
+   Usage: interleave [tile size] [iterations]
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include "Interleave.h"
+#include "Timer.h"
+
+using namespace std;
+
+
+
+int main( int argc, char** argv ){
+
+  unsigned int size = (argc > 1) ? atoi( argv[1] ) : 256;
+  unsigned int iterations = (argc > 2) ? atoi( argv[2] ) : 1000;
+  if( size == 0 || iterations == 0 ){
+    cerr << "Usage: " << argv[0] << " [tile size] [iterations]" << endl;
+    return 1;
+  }
+
+#ifndef SIMD_INTERLEAVE
+  cerr << "SSE4.1 interleaving kernels are not available on this platform" << endl;
+  return 1;
+#else
+
+  if( !__builtin_cpu_supports( "sse4.1" ) ){
+    cerr << "This CPU does not support SSE4.1" << endl;
+    return 1;
+  }
+
+  unsigned int n = size * size;
+
+  // Random planar data, including values outside of our output range which must be masked off
+  vector< vector<int32_t> > data( 4, vector<int32_t>( n ) );
+  srand( 1 );
+  for( unsigned int k=0; k<4; k++ ){
+    for( unsigned int i=0; i<n; i++ ) data[k][i] = rand() % 0x30000;
+  }
+  int32_t* planes[4] = { &data[0][0], &data[1][0], &data[2][0], &data[3][0] };
+
+  vector<unsigned char> scalar( n * 4 * 2 ), simd( n * 4 * 2 );
+  int status = 0;
+
+  cout << "Interleaving " << size << "x" << size << " pixels, " << iterations << " iterations" << endl
+       << "channels  bits    scalar (us)  sse4.1 (us)  speedup" << endl;
+
+  for( unsigned int obpc=8; obpc<=16; obpc+=8 ){
+    for( unsigned int channels=1; channels<=4; channels++ ){
+
+      size_t bytes = (size_t) n * channels * (obpc/8);
+
+      // Check our kernel, with the scalar loop handling any remainder, against the scalar loop alone
+      memset( &scalar[0], 0, bytes );
+      memset( &simd[0], 0xff, bytes );
+      interleave_scalar( planes, channels, 0, n, obpc, &scalar[0] );
+      unsigned int i = interleave_sse41( planes, channels, n, obpc, &simd[0] );
+      interleave_scalar( planes, channels, i, n, obpc, &simd[0] );
+      bool match = ( memcmp( &scalar[0], &simd[0], bytes ) == 0 );
+      if( !match ) status = 1;
+
+      Timer timer;
+      timer.start();
+      for( unsigned int r=0; r<iterations; r++ ) interleave_scalar( planes, channels, 0, n, obpc, &scalar[0] );
+      double scalar_time = (double) timer.getTime() / iterations;
+
+      timer.start();
+      for( unsigned int r=0; r<iterations; r++ ){
+	i = interleave_sse41( planes, channels, n, obpc, &simd[0] );
+	interleave_scalar( planes, channels, i, n, obpc, &simd[0] );
+      }
+      double simd_time = (double) timer.getTime() / iterations;
+
+      cout << setw(8) << channels << setw(6) << obpc
+	   << fixed << setprecision(1)
+	   << setw(15) << scalar_time << setw(13) << simd_time
+	   << setw(8) << setprecision(2) << ( simd_time > 0 ? scalar_time / simd_time : 0.0 ) << "x"
+	   << ( match ? "" : "  MISMATCH" ) << endl;
+    }
+  }
+
+  return status;
+
+#endif
+}
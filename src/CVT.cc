@@ -26,6 +26,15 @@
 
 //#define CHUNKED 1
 
+// Height in pixels of the strips we compress and send
+#define STRIP_HEIGHT 128
+
+// Exports with at least this many bytes of output data are streamed in bands (64MB)
+#define STREAMING_THRESHOLD 67108864
+
+// Approximate number of source rows in each streamed band
+#define STREAMING_BAND_HEIGHT 1024
+
 using namespace std;
 
 
@@ -51,6 +60,10 @@ void CVT::send( Session* session ){
   Compressor *compressor = NULL;
   if( session->view->output_format == JPEG ) compressor = session->jpeg;
   else if( session->view->output_format == PNG ) compressor = session->png;
+#ifdef HAVE_WEBP
+  else if( session->view->output_format == WEBP ) compressor = session->webp;
+#endif
+  else if( session->view->output_format == BIGTIFF ) compressor = session->tiff;
   else return;
 
 
@@ -165,6 +178,7 @@ void CVT::send( Session* session ){
 	    "X-Powered-By: IIPImage\r\n"
 	    "%s\r\n"
 	    "Last-Modified: %s\r\n"
+	    "%s"
 	    "Content-Type: %s\r\n"
 	    "Content-Disposition: inline;filename=\"%s.%s\"\r\n"
 #ifdef CHUNKED
@@ -172,7 +186,7 @@ void CVT::send( Session* session ){
 #endif
 	    "\r\n",
 	    VERSION, session->response->getCacheControl().c_str(),
-	    (*session->image)->getTimestamp().c_str(),
+	    (*session->image)->getTimestamp().c_str(), session->response->getETagHeader().c_str(),
 	    compressor->getMimeType(), basename.c_str(), compressor->getSuffix() );
 
   if( session->out->putS( (const char*) str ) == -1 ){
@@ -186,6 +200,7 @@ void CVT::send( Session* session ){
 
   // Set up our TileManager object
   TileManager tilemanager( session->tileCache, *session->image, session->watermark, compressor, session->logfile, session->loglevel );
+  tilemanager.setThreads( session->codecOptions["REGION_THREADS"] );
 
 
   // First calculate histogram if we have asked for either binarization,
@@ -216,18 +231,264 @@ void CVT::send( Session* session ){
 
 
 
-  // Retrieve image region
-  RawTile complete_image = tilemanager.getRegion( requested_res,
-						  session->view->xangle, session->view->yangle,
-						  session->view->getLayers(),
-						  view_left, view_top, view_width, view_height );
+  // Only decode the channels that contribute to our output
+  (*session->image)->setChannelSubset( session->view->getChannelSubset( (*session->image)->getNumChannels() ) );
+
+
+  // Image types able to scale while decoding can directly produce a downscaled region with
+  // bilinear quality or better, avoiding both the full size intermediate and our resize pass
+  unsigned int scaled_width = 0, scaled_height = 0;
+  if( (*session->image)->scaledRegionDecoding() && Environment::getInterpolation() != 0 &&
+      resampled_width <= view_width && resampled_height <= view_height &&
+      ( (view_width!=resampled_width) || (view_height!=resampled_height) ) ){
+    scaled_width = resampled_width;
+    scaled_height = resampled_height;
+  }
+
+
+  // Large exports are decoded, processed, compressed and sent in horizontal bands, limiting our memory
+  // use and sending data as soon as the first band is ready. This is possible if every stage of our
+  // pipeline works row by row and our output format can be encoded incrementally. TIFF exports,
+  // which may be very large, are always streamed where possible
+  bool streaming = ( scaled_width == 0 && session->view->getRotation() == 0.0 && session->view->flip != 2 &&
+		     ( compressor == session->tiff ||
+		       ( (compressor == session->jpeg || compressor == session->png) &&
+			 (unsigned long long) resampled_width * resampled_height * (*session->image)->getNumChannels() >= STREAMING_THRESHOLD ) ) );
+
+  // TIFF exports may have been allowed a larger size on the basis that they are streamed. Those
+  // we cannot stream are rendered in full in memory, so must remain within our normal limit
+  int max_CVT = (int) session->codecOptions["MAX_CVT"];
+  if( compressor == session->tiff && !streaming && max_CVT > 0 &&
+      ( resampled_width > (unsigned int) max_CVT || resampled_height > (unsigned int) max_CVT ) ){
+    throw invalid_argument( "CVT :: TIFF exports larger than MAX_CVT cannot be rotated, flipped or scaled" );
+  }
+
+  // Our band height in output rows, corresponding to a whole number of source tile rows
+  bool resize = (view_width != resampled_width) || (view_height != resampled_height);
+  float yscale = (float) view_height / (float) resampled_height;
+  unsigned int band_height = resampled_height;
+  if( streaming ){
+    unsigned int th = (*session->image)->getTileHeight();
+    unsigned int source_rows = (STREAMING_BAND_HEIGHT > th) ? (STREAMING_BAND_HEIGHT / th) * th : th;
+    band_height = (unsigned int) ( source_rows / yscale );
+    band_height = (band_height < 16) ? 16 : band_height - (band_height % 16);
+  }
+  int bands = (resampled_height / band_height) + (resampled_height % band_height == 0 ? 0 : 1);
+
+  if( session->loglevel >= 3 && streaming ){
+    *(session->logfile) << "CVT :: Streaming output in " << bands << " bands of " << band_height << " rows" << endl;
+  }
+
 
+  // Make a copy of our max and min as we may change these
+  vector <float> min = (*session->image)->min;
+  vector <float> max = (*session->image)->max;
 
+  unsigned char* output = NULL;
+  unsigned int channels = 0;
+
+  for( int b=0; b<bands; b++ ){
+
+    // Output rows in this band
+    unsigned int first_row = b * band_height;
+    unsigned int rows = (first_row + band_height > resampled_height) ? resampled_height - first_row : band_height;
+
+    // Source rows needed for these. Bilinear interpolation uses the row below and, at the right edge, the
+    // first pixel of the row after that
+    unsigned int source_top = 0, source_rows = view_height;
+    if( streaming ){
+      source_top = resize ? (unsigned int) floor( first_row * yscale ) : first_row;
+      unsigned int source_bottom = resize ? (unsigned int) floor( (first_row+rows-1) * yscale ) + 2 : first_row + rows - 1;
+      if( source_bottom > view_height - 1 ) source_bottom = view_height - 1;
+      source_rows = source_bottom - source_top + 1;
+    }
+
+    // Retrieve image region
+    RawTile image = tilemanager.getRegion( requested_res,
+					   session->view->xangle, session->view->yangle,
+					   session->view->getLayers(),
+					   view_left, view_top + source_top, view_width, source_rows,
+					   scaled_width, scaled_height );
+
+    // Apply our processing and resizing
+    this->process( image, min, max, resampled_width, resampled_height,
+		   streaming ? view_height : image.height, source_top, first_row, rows );
+
+
+    // Apply rotation - can apply this safely after gamma and contrast adjustment
+    if( session->view->getRotation() != 0.0 ){
+
+      if( session->loglevel >= 5 ) function_timer.start();
+
+      float rotation = session->view->getRotation();
+      session->processor->rotate( image, rotation );
+
+      // For 90 and 270 rotation swap width and height
+      resampled_width = image.width;
+      resampled_height = image.height;
+
+      if( session->loglevel >= 5 ){
+	*(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
+			    << function_timer.getTime() << " microseconds" << endl;
+      }
+    }
+
+
+    // Set up our compressor and send out our header once we have our first band
+    if( b == 0 ){
+      this->setupCompressor( compressor, im_width, im_height );
+
+      // Large JPEG and PNG images can be encoded in parallel using the same number of threads as for region decoding.
+      // When streaming, our image is not available in its entirety, so must be encoded serially
+      unsigned int encoding_threads = streaming ? 1 : session->codecOptions["REGION_THREADS"];
+      if( compressor == session->jpeg ) session->jpeg->setThreads( encoding_threads );
+      else if( compressor == session->png ) session->png->setThreads( encoding_threads );
+
+      // Initialise our output compression object. When streaming, this only needs our output dimensions
+      RawTile layout( 0, requested_res, session->view->xangle, session->view->yangle,
+		      resampled_width, resampled_height, image.channels, image.bpc );
+      compressor->InitCompression( streaming ? layout : image, resampled_height );
+
+      len = compressor->getHeaderSize();
+
+#ifdef CHUNKED
+      snprintf( str, 1024, "%X\r\n", len );
+      if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Output Header Chunk : " << str;
+      session->out->putS( str );
+#endif
+
+      if( session->out->putStr( (const char*) compressor->getHeader(), len ) != len ){
+	if( session->loglevel >= 1 ){
+	  *(session->logfile) << "CVT :: Error writing header" << endl;
+	}
+      }
+
+#ifdef CHUNKED
+      session->out->putStr( "\r\n", 2 );
+#endif
+
+      // Flush our block of data
+      if( session->out->flush() == -1 ) {
+	if( session->loglevel >= 1 ){
+	  *(session->logfile) << "CVT :: Error flushing output data" << endl;
+	}
+      }
+
+      // Allocate enough memory for a strip plus an extra 64k for instances where compressed
+      // data is greater than uncompressed
+      channels = image.channels;
+      output = new unsigned char[resampled_width*channels*STRIP_HEIGHT+65536];
+    }
+
+
+    // Send out the data per strip of fixed height.
+    unsigned int strip_height = STRIP_HEIGHT;
+    int strips = (image.height/strip_height) + (image.height%strip_height == 0 ? 0 : 1);
+
+    for( int n=0; n<strips; n++ ){
+
+      // Get the starting index for this strip of data
+      unsigned char* input = &((unsigned char*)image.data)[(size_t)n*strip_height*resampled_width*channels];
+
+      // The last strip may have a different height
+      if( (n==strips-1) && (image.height%strip_height!=0) ) strip_height = image.height % strip_height;
+
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: About to compress strip with height " << strip_height << endl;
+      }
+
+      // Compress the strip
+      len = compressor->CompressStrip( input, output, strip_height );
+
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
+      }
+
+#ifdef CHUNKED
+      // Send chunk length in hex
+      snprintf( str, 1024, "%X\r\n", len );
+      if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
+      session->out->putS( str );
+#endif
+
+      // Send this strip out to the client
+      if( len != session->out->putStr( (const char*) output, len ) ){
+	if( session->loglevel >= 1 ){
+	  *(session->logfile) << "CVT :: Error writing strip: " << len << endl;
+	}
+      }
+
+#ifdef CHUNKED
+      // Send closing chunk CRLF
+      session->out->putStr( "\r\n", 2 );
+#endif
+
+      // Flush our block of data
+      if( session->out->flush() == -1 ) {
+	if( session->loglevel >= 1 ){
+	  *(session->logfile) << "CVT :: Error flushing data" << endl;
+	}
+      }
+
+    }
+  }
+
+  // Finish off the image compression
+  len = compressor->Finish( output );
+
+#ifdef CHUNKED
+  snprintf( str, 1024, "%X\r\n", len );
+  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Final Data Chunk : " << str << endl;
+  session->out->putS( str );
+#endif
+
+  if( session->out->putStr( (const char*) output, len ) != len ){
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "CVT :: Error writing output" << endl;
+    }
+  }
+
+  delete[] output;
+
+
+#ifdef CHUNKED
+  // Send closing chunk CRLF
+  session->out->putStr( "\r\n", 2 );
+  // Send closing blank chunk
+  session->out->putS( "0\r\n\r\n" );
+#endif
+
+  if( session->out->flush()  == -1 ) {
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "CVT :: Error flushing output" << endl;
+    }
+  }
+
+  // Inform our response object that we have sent something to the client
+  session->response->setImageSent();
+
+
+
+  // Total CVT response time
+  if( session->loglevel >= 2 ){
+    *(session->logfile) << "CVT :: Total command time " << command_timer.getTime() << " microseconds" << endl;
+  }
+
+
+}
+
+
+
+void CVT::process( RawTile& image, vector<float>& min, vector<float>& max,
+		   unsigned int resampled_width, unsigned int resampled_height, unsigned int source_height,
+		   unsigned int source_top, unsigned int first_row, unsigned int rows ){
+
+  Timer function_timer;
 
   // Convert CIELAB to sRGB
   if( (*session->image)->getColourSpace() == CIELAB ){
     if( session->loglevel >= 5 ) function_timer.start();
-    session->processor->LAB2sRGB( complete_image );
+    session->processor->LAB2sRGB( image );
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Converting from CIELAB->sRGB in "
 			  << function_timer.getTime() << " microseconds" << endl;
@@ -236,12 +497,8 @@ void CVT::send( Session* session ){
 
 
   // Only use our floating point pipeline if necessary
-  if( complete_image.bpc > 8 || session->view->floatProcessing() ){
-
+  if( image.bpc > 8 || session->view->floatProcessing() ){
 
-    // Make a copy of our max and min as we may change these
-    vector <float> min = (*session->image)->min;
-    vector <float> max = (*session->image)->max;
 
     // Change our image max and min if we have asked for a contrast stretch
     if( session->view->contrast == -1 ){
@@ -255,13 +512,13 @@ void CVT::send( Session* session ){
       while( (*session->image)->histogram[n1] == 0 ) --n1;
 
       // Histogram has been calculated using 8 bits, so scale up to native bit depth
-      if( complete_image.bpc > 8 && complete_image.sampleType == FIXEDPOINT ){
-	n0 = n0 << (complete_image.bpc-8);
-	n1 = n1 << (complete_image.bpc-8);
+      if( image.bpc > 8 && image.sampleType == FIXEDPOINT ){
+	n0 = n0 << (image.bpc-8);
+	n1 = n1 << (image.bpc-8);
       }
 
-      min.assign( complete_image.bpc, (float)n0 );
-      max.assign( complete_image.bpc, (float)n1 );
+      min.assign( image.bpc, (float)n0 );
+      max.assign( image.bpc, (float)n1 );
 
       // Reset our contrast
       session->view->contrast = 1.0;
@@ -276,7 +533,7 @@ void CVT::send( Session* session ){
     // Apply normalization and perform float conversion
     {
       if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->normalize( complete_image, max, min );
+      session->processor->normalize( image, max, min );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Converting to floating point and normalizing in "
 			    << function_timer.getTime() << " microseconds" << endl;
@@ -287,7 +544,7 @@ void CVT::send( Session* session ){
     // Apply hill shading if requested
     if( session->view->shaded ){
       if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->shade( complete_image, session->view->shade[0], session->view->shade[1] );
+      session->processor->shade( image, session->view->shade[0], session->view->shade[1] );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying hill-shading in " << function_timer.getTime() << " microseconds" << endl;
       }
@@ -297,7 +554,7 @@ void CVT::send( Session* session ){
     // Apply color twist if requested
     if( session->view->ctw.size() ){
       if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->twist( complete_image, session->view->ctw );
+      session->processor->twist( image, session->view->ctw );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying color twist in " << function_timer.getTime() << " microseconds" << endl;
       }
@@ -310,8 +567,8 @@ void CVT::send( Session* session ){
       if( session->loglevel >= 5 ) function_timer.start();
 
       // Check whether we have asked for logarithm
-      if( gamma == -1 ) session->processor->log( complete_image );
-      else session->processor->gamma( complete_image, gamma );
+      if( gamma == -1 ) session->processor->log( image );
+      else session->processor->gamma( image, gamma );
 
       if( session->loglevel >= 5 ){
 	if( gamma == -1 ) *(session->logfile) << "CVT :: Applying logarithm transform in ";
@@ -324,7 +581,7 @@ void CVT::send( Session* session ){
     // Apply inversion if requested
     if( session->view->inverted ){
       if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->inv( complete_image );
+      session->processor->inv( image );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying inversion in " << function_timer.getTime() << " microseconds" << endl;
       }
@@ -334,7 +591,7 @@ void CVT::send( Session* session ){
     // Apply color mapping if requested
     if( session->view->cmapped ){
       if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->cmap( complete_image, session->view->cmap );
+      session->processor->cmap( image, session->view->cmap );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying color map in " << function_timer.getTime() << " microseconds" << endl;
       }
@@ -345,7 +602,7 @@ void CVT::send( Session* session ){
     // Apply any contrast adjustments and scale to 8 bit quantization
     {
       if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->contrast( complete_image, session->view->contrast );
+      session->processor->contrast( image, session->view->contrast );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying contrast of " << session->view->contrast
 			    << " and converting to 8bit in " << function_timer.getTime() << " microseconds" << endl;
@@ -356,7 +613,7 @@ void CVT::send( Session* session ){
 
   // Resize our image as requested. Use the interpolation method requested in the server configuration.
   //  - Use bilinear interpolation by default
-  if( (view_width!=resampled_width) || (view_height!=resampled_height) ){
+  if( (image.width!=resampled_width) || (source_height!=resampled_height) ){
 
     string interpolation_type;
     if( session->loglevel >= 5 ) function_timer.start();
@@ -365,11 +622,13 @@ void CVT::send( Session* session ){
     switch( interpolation ){
      case 0:
       interpolation_type = "nearest neighbour";
-      session->processor->interpolate_nearestneighbour( complete_image, resampled_width, resampled_height );
+      session->processor->interpolate_nearestneighbour( image, resampled_width, resampled_height,
+							 source_height, source_top, first_row, rows );
       break;
      default:
       interpolation_type = "bilinear";
-      session->processor->interpolate_bilinear( complete_image, resampled_width, resampled_height );
+      session->processor->interpolate_bilinear( image, resampled_width, resampled_height,
+						 source_height, source_top, first_row, rows );
       break;
     }
 
@@ -381,14 +640,15 @@ void CVT::send( Session* session ){
 
 
   // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image and have requested a JPEG tile
-  // For PNG, strip extra bands if we have more than 4 present
-  if( ( (session->view->output_format == JPEG) && (complete_image.channels == 2 || complete_image.channels > 3) ) ||
-      ( (session->view->output_format == PNG) && (complete_image.channels > 4) ) ){
+  // For PNG, WebP and TIFF, strip extra bands if we have more than 4 present
+  if( ( (session->view->output_format == JPEG) && (image.channels == 2 || image.channels > 3) ) ||
+      ( (session->view->output_format == PNG || session->view->output_format == WEBP ||
+	 session->view->output_format == BIGTIFF) && (image.channels > 4) ) ){
 
-    int output_channels = (complete_image.channels==2)? 1 : 3;
+    int output_channels = (image.channels==2)? 1 : 3;
     if( session->loglevel >= 5 ) function_timer.start();
 
-    session->processor->flatten( complete_image, output_channels );
+    session->processor->flatten( image, output_channels );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Flattening to " << output_channels << " channel"
@@ -403,7 +663,7 @@ void CVT::send( Session* session ){
 
     if( session->loglevel >= 5 ) function_timer.start();
 
-    session->processor->greyscale( complete_image );
+    session->processor->greyscale( image );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Converting to greyscale in "
@@ -421,7 +681,7 @@ void CVT::send( Session* session ){
     unsigned char threshold = session->processor->threshold( (*session->image)->histogram );
 
     // Apply threshold to create binary (bi-level) image
-    session->processor->binary( complete_image, threshold );
+    session->processor->binary( image, threshold );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Converting to binary with threshold " << (unsigned int) threshold
@@ -436,7 +696,7 @@ void CVT::send( Session* session ){
     if( session->loglevel >= 5 ) function_timer.start();
 
     // Perform histogram equalization
-    session->processor->equalize( complete_image, (*session->image)->histogram );
+    session->processor->equalize( image, (*session->image)->histogram );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Histogram equalization applied in "
@@ -450,7 +710,7 @@ void CVT::send( Session* session ){
 
     if( session->loglevel >= 5 ) function_timer.start();
 
-    session->processor->flip( complete_image, session->view->flip  );
+    session->processor->flip( image, session->view->flip  );
 
     if( session->loglevel >= 5 ){
       string direction = session->view->flip==1 ? "horizontally" : "vertically";
@@ -458,26 +718,11 @@ void CVT::send( Session* session ){
 			  << function_timer.getTime() << " microseconds" << endl;
     }
   }
+}
 
 
-  // Apply rotation - can apply this safely after gamma and contrast adjustment
-  if( session->view->getRotation() != 0.0 ){
-
-    if( session->loglevel >= 5 ) function_timer.start();
-
-    float rotation = session->view->getRotation();
-    session->processor->rotate( complete_image, rotation );
-
-    // For 90 and 270 rotation swap width and height
-    resampled_width = complete_image.width;
-    resampled_height = complete_image.height;
-
-    if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
-			  << function_timer.getTime() << " microseconds" << endl;
-    }
-  }
 
+void CVT::setupCompressor( Compressor* compressor, unsigned int im_width, unsigned int im_height ){
 
   // Set the physical output resolution for this particular view and zoom level
   if( (*session->image)->dpi_x > 0 && (*session->image)->dpi_y > 0 ){
@@ -515,134 +760,4 @@ void CVT::send( Session* session ){
     }
     compressor->setXMPMetadata( (*session->image)->getMetadata("xmp") );
   }
-
-
-  // Initialise our output compression object
-  compressor->InitCompression( complete_image, resampled_height );
-
-
-  len = compressor->getHeaderSize();
-
-#ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Output Header Chunk : " << str;
-  session->out->putS( str );
-#endif
-
-  if( session->out->putStr( (const char*) compressor->getHeader(), len ) != len ){
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing header" << endl;
-    }
-  }
-
-#ifdef CHUNKED
-  session->out->putStr( "\r\n", 2 );
-#endif
-
-  // Flush our block of data
-  if( session->out->flush() == -1 ) {
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error flushing output data" << endl;
-    }
-  }
-
-
-  // Send out the data per strip of fixed height.
-  // Allocate enough memory for this plus an extra 64k for instances where compressed
-  // data is greater than uncompressed
-  unsigned int strip_height = 128;
-  unsigned int channels = complete_image.channels;
-  unsigned char* output = new unsigned char[resampled_width*channels*strip_height+65536];
-  int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
-
-  for( int n=0; n<strips; n++ ){
-
-    // Get the starting index for this strip of data
-    unsigned char* input = &((unsigned char*)complete_image.data)[n*strip_height*resampled_width*channels];
-
-    // The last strip may have a different height
-    if( (n==strips-1) && (resampled_height%strip_height!=0) ) strip_height = resampled_height % strip_height;
-
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: About to compress strip with height " << strip_height << endl;
-    }
-
-    // Compress the strip
-    len = compressor->CompressStrip( input, output, strip_height );
-
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
-    }
-
-#ifdef CHUNKED
-    // Send chunk length in hex
-    snprintf( str, 1024, "%X\r\n", len );
-    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
-    session->out->putS( str );
-#endif
-
-    // Send this strip out to the client
-    if( len != session->out->putStr( (const char*) output, len ) ){
-      if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error writing strip: " << len << endl;
-      }
-    }
-
-#ifdef CHUNKED
-    // Send closing chunk CRLF
-    session->out->putStr( "\r\n", 2 );
-#endif
-
-    // Flush our block of data
-    if( session->out->flush() == -1 ) {
-      if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error flushing data" << endl;
-      }
-    }
-
-  }
-
-  // Finish off the image compression
-  len = compressor->Finish( output );
-
-#ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Final Data Chunk : " << str << endl;
-  session->out->putS( str );
-#endif
-
-  if( session->out->putStr( (const char*) output, len ) != len ){
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing output" << endl;
-    }
-  }
-
-  delete[] output;
-
-
-#ifdef CHUNKED
-  // Send closing chunk CRLF
-  session->out->putStr( "\r\n", 2 );
-  // Send closing blank chunk
-  session->out->putS( "0\r\n\r\n" );
-#endif
-
-  if( session->out->flush()  == -1 ) {
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error flushing output" << endl;
-    }
-  }
-
-  // Inform our response object that we have sent something to the client
-  session->response->setImageSent();
-
-
-
-  // Total CVT response time
-  if( session->loglevel >= 2 ){
-    *(session->logfile) << "CVT :: Total command time " << command_timer.getTime() << " microseconds" << endl;
-  }
-
-
 }
-
@@ -1,4 +1,4 @@
-/*  Generic compressor class - extended by JPEG and PNG Compressor classes
+/*  Generic compressor class - extended by JPEG, PNG and WebP Compressor classes
 
     Copyright (C) 2017-2020 Ruven Pillay
 
@@ -61,6 +61,13 @@ class Compressor {
   /// Write XMP metadata
   virtual void writeXMPMetadata() {};
 
+  /// Copy our output resolution and metadata to another compressor
+  /** @param c compressor to which our settings are copied */
+  void copySettings( Compressor* c ) const {
+    c->dpi_x = dpi_x; c->dpi_y = dpi_y; c->dpi_units = dpi_units;
+    c->icc = icc; c->xmp = xmp;
+  };
+
 
  public:
 
@@ -147,6 +154,13 @@ class Compressor {
   /** @return compressionType */
   virtual CompressionType getCompressionType(){ return UNCOMPRESSED; };
 
+
+  /// Create an independent compressor with the same settings
+  /** Compressors hold their encoding state, so each thread encoding tiles in parallel needs its own
+      @return new compressor to be deleted by the caller or NULL if this is not supported
+   */
+  virtual Compressor* duplicate() { return NULL; };
+
 };
 
 #endif
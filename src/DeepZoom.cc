@@ -70,6 +70,9 @@ void DeepZoom::run( Session* session, const std::string& argument ){
   FIF fif;
   fif.run( session, prefix );
 
+  // The client's copy is still valid: our 304 reply is sent by the main request loop
+  if( session->response->notModified() ) return;
+
 
   // Get the full image size and the total number of resolutions available
   unsigned int width = (*session->image)->getImageWidth();
@@ -79,6 +82,10 @@ void DeepZoom::run( Session* session, const std::string& argument ){
   unsigned int tw = (*session->image)->getTileWidth();
   unsigned int numResolutions = (*session->image)->getNumResolutions();
 
+  // The tile size advertised to our clients, which may differ from that of our image
+  unsigned int ts = session->codecOptions["DEEPZOOM_TILE_SIZE"];
+  if( ts == 0 ) ts = tw;
+
 
   // DeepZoom does not accept arbitrary numbers of resolutions. The number of levels
   // is calculated by rounding up the log_2 of the larger of image height and image width;
@@ -106,21 +113,33 @@ void DeepZoom::run( Session* session, const std::string& argument ){
     }
 
 
+    // Send our pre-serialised response if we have one
+    this->session = session;
+    string key = "dzi:" + (*session->image)->getImagePath();
+    if( sendCachedResponse( key, "xml" ) ) return;
+
     // Format our output
-    stringstream header;
-    header << session->response->createHTTPHeader( "xml", (*session->image)->getTimestamp() )
-	   << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
-	   << "TileSize=\"" << tw << "\" Overlap=\"0\" Format=\"jpg\">"
-	   << "<Size Width=\"" << width << "\" Height=\"" << height << "\"/>"
-	   << "</Image>";
+    stringstream body;
+    body << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+	 << "TileSize=\"" << ts << "\" Overlap=\"0\" Format=\"jpg\">"
+	 << "<Size Width=\"" << width << "\" Height=\"" << height << "\"/>"
+	 << "</Image>";
 
-    session->out->putStr( (const char*) header.str().c_str(), header.tellp() );
-    session->response->setImageSent();
+    sendResponse( key, "xml", body.str() );
 
     return;
   }
 
 
+  // Tiles may be requested explicitly as WebP, otherwise JPEG tiles may be replaced
+  // by WebP if the client accepts it
+#ifdef HAVE_WEBP
+  if( suffix == "webp" ) session->view->output_format = WEBP;
+#endif
+  this->session = session;
+  negotiateFormat();
+
+
   // Get the tile coordinates. DeepZoom requests are of the form $image_files/r/x_y.jpg
   // where r is the resolution number and x and y are the tile coordinates
 
@@ -162,13 +181,28 @@ void DeepZoom::run( Session* session, const std::string& argument ){
   unsigned int ntlx = (width / tw) + (rem_x == 0 ? 0 : 1);
 
 
-  // Calculate the tile index for this resolution from our x, y
-  unsigned int tile = y*ntlx + x;
+  JTL jtl;
 
+  if( ts == tw ){
+    // Calculate the tile index for this resolution from our x, y
+    unsigned int tile = y*ntlx + x;
 
-  // Simply pass this on to our JTL send command
-  JTL jtl;
-  jtl.send( session, resolution, tile );
+    // Simply pass this on to our JTL send command
+    jtl.send( session, resolution, tile );
+  }
+  else{
+    // Compose tiles of our advertised size from the tiles of our image
+    unsigned int left = x*ts;
+    unsigned int top = y*ts;
+    if( left >= width || top >= height ){
+      throw invalid_argument( "DeepZoom :: Tile coordinates out of range" );
+    }
+    unsigned int w = (left + ts < width) ? ts : width - left;
+    unsigned int h = (top + ts < height) ? ts : height - top;
+    unsigned int tile = (top / (*session->image)->getTileHeight()) * ntlx + left / tw;
+
+    jtl.send( session, resolution, tile, left, top, w, h );
+  }
 
 
   // Total DeepZoom response time
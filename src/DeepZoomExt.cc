@@ -34,6 +34,7 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -57,6 +58,7 @@ struct DZExtResponseData
   bool isLast;
   const vector<int> &invalidPathIndices;
   vector<CompressedTile> &compressedTiles;
+  vector<TileRequest> &tileRequests;
   JTL_Ext &jtl;
   const string &argument;
   Compressor *compressor;
@@ -67,6 +69,7 @@ struct DZExtResponseData
                     bool isLast,
                     const vector<int> &invalidPathIndices,
                     vector<CompressedTile> &compressedTiles,
+                    vector<TileRequest> &tileRequests,
                     JTL_Ext &jtl,
                     const string &argument,
                     Compressor *compressor) : initHeader(initHeader),
@@ -75,6 +78,7 @@ struct DZExtResponseData
                                               isLast(isLast),
                                               invalidPathIndices(invalidPathIndices),
                                               compressedTiles(compressedTiles),
+                                              tileRequests(tileRequests),
                                               jtl(jtl),
                                               argument(argument),
                                               compressor(compressor) {}
@@ -126,12 +130,26 @@ void DeepZoomExt::run(Session *session, const std::string &argument)
   {
     session->view->output_format = JPEG;
     compressor = session->jpeg;
+#ifdef HAVE_WEBP
+    // Serve WebP rather than JPEG if the client accepts it
+    this->session = session;
+    negotiateFormat();
+    if (session->view->output_format == WEBP)
+      compressor = session->webp;
+#endif
   }
   else if (format.rfind("png", 0) == 0)
   {
     session->view->output_format = PNG;
     compressor = session->png;
   }
+#ifdef HAVE_WEBP
+  else if (format.rfind("webp", 0) == 0)
+  {
+    session->view->output_format = WEBP;
+    compressor = session->webp;
+  }
+#endif
   else if (format.rfind("zip", 0) == 0)
   {
     //use PNG internally, let PNG
@@ -143,8 +161,17 @@ void DeepZoomExt::run(Session *session, const std::string &argument)
   // Get the image file paths from prefix
   vector<string> paths = Utils::split(prefix, ",");
 
+  // Our validators only describe a single image, so conditional requests are only supported for those
+  bool multiple = paths.size() > 1;
+  if (multiple)
+  {
+    session->headers.erase("HTTP_IF_NONE_MATCH");
+    session->headers.erase("HTTP_IF_MODIFIED_SINCE");
+  }
+
   vector<int> invalidPathIndices;
   vector<CompressedTile> compressedTiles;
+  vector<TileRequest> tileRequests;
   JTL_Ext jtl;
   stringstream initHeader;
   for (int i = 0; i < paths.size(); i++)
@@ -159,6 +186,12 @@ void DeepZoomExt::run(Session *session, const std::string &argument)
     else
     {
       fif.run(session, currentPath);
+
+      // The client's copy is still valid: our 304 reply is sent by the main request loop
+      if (session->response->notModified())
+        return;
+      if (multiple)
+        session->response->setETag("");
     }
 
     if (paths.size() == invalidPathIndices.size())
@@ -168,7 +201,7 @@ void DeepZoomExt::run(Session *session, const std::string &argument)
 
     DZExtResponseData data(initHeader, suffix,
                            i == 0, i == paths.size() - 1,
-                           invalidPathIndices, compressedTiles, jtl,
+                           invalidPathIndices, compressedTiles, tileRequests, jtl,
                            strippedArgument, compressor);
 
     if (!invalidPathIndices.empty() && invalidPathIndices.back() == i)
@@ -180,6 +213,14 @@ void DeepZoomExt::run(Session *session, const std::string &argument)
       sendExistingFileResponse(session, data, zip);
     }
   }
+
+  // Our tiles have been sent, so we no longer need the images of all but the last
+  // tile source, which is deleted along with our session
+  for (size_t i = 0; i < tileRequests.size(); i++)
+  {
+    if (tileRequests[i].image != *session->image)
+      delete tileRequests[i].image;
+  }
   if (session->loglevel >= 2)
   {
     *(session->logfile) << "DeepZoomExt :: Total command time " << command_timer.getTime() << " microseconds" << endl;
@@ -194,8 +235,9 @@ bool pathExists(const string &path)
   while ((n = decodedPath.find("../")) < decodedPath.length())
     decodedPath.erase(n, 3);
   string finalPath = Environment::getFileSystemPrefix() + decodedPath + Environment::getFileSystemSuffix();
-  std::ifstream file(finalPath);
-  return file.good();
+  // Only check that the file exists: FIF then uses our cached metadata without opening it
+  struct stat sb;
+  return stat(finalPath.c_str(), &sb) == 0;
 }
 
 void sendExistingFileResponse(Session *session, DZExtResponseData &data, bool zip)
@@ -305,12 +347,14 @@ void sendExistingFileResponse(Session *session, DZExtResponseData &data, bool zi
     // Calculate the tile index for this resolution from our x, y
     unsigned int tile = y * ntlx + x;
 
-    // Push tile from JTL.getTile() to our tiles vector
-    data.compressedTiles.push_back(data.jtl.getTile(session, resolution, tile));
+    // Queue up our tile so that the tiles for all images can be fetched together
+    TileRequest request = {*session->image, resolution, (int)tile, session->view->output_format};
+    data.tileRequests.push_back(request);
 
-    // Send appended tile(s) after processing all images
+    // Fetch and send appended tile(s) after processing all images
     if (data.isLast)
     {
+      data.compressedTiles = data.jtl.getTiles(session, data.tileRequests);
       if (zip) {
         data.jtl.sendZip(data.compressor, data.compressedTiles, data.invalidPathIndices);
       } else {
@@ -349,6 +393,7 @@ void sendMissingFileResponse(Session *session, DZExtResponseData data, bool zip)
   {
     if (data.isLast)
     {
+      data.compressedTiles = data.jtl.getTiles(session, data.tileRequests);
       if (zip) {
         data.jtl.sendZip(data.compressor, data.compressedTiles, data.invalidPathIndices);
       } else {
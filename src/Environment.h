@@ -29,8 +29,13 @@
 #define MAX_IMAGE_CACHE_SIZE 10.0
 #define FILENAME_PATTERN "_pyr_"
 #define JPEG_QUALITY 75
+#define JPEG_SUBSAMPLING 420
+#define JPEG_OPTIMIZE false
 #define PNG_QUALITY 1
+#define WEBP_QUALITY 75
+#define WEBP_NEGOTIATION false
 #define MAX_CVT 5000
+#define MAX_TIFF_CVT 0  // 0: use MAX_CVT
 #define MAX_LAYERS 0
 #define FILESYSTEM_PREFIX ""
 #define FILESYSTEM_SUFFIX ""
@@ -48,6 +53,11 @@
 #define EMBED_ICC true
 #define KAKADU_READMODE 0
 #define IIIF_VERSION 2
+#define DEEPZOOM_TILE_SIZE 0  // 0: use the tile size of each image
+#define REGION_THREADS 0  // 0: use the OpenMP default
+#define PREFETCH_TILES 0  // 0: prefetching disabled
+#define PREFETCH_TIME 20000  // microseconds
+#define CODEC_THREADS 0  // 0: use all available processors
 
 
 #include <string>
@@ -112,6 +122,25 @@ class Environment {
   }
 
 
+  static int getJPEGSubsampling(){
+    char* envpara = getenv( "JPEG_SUBSAMPLING" );
+    int subsampling = JPEG_SUBSAMPLING;
+    if( envpara ){
+      int s = atoi( envpara );
+      if( s == 444 || s == 422 || s == 420 ) subsampling = s;
+    }
+    return subsampling;
+  }
+
+
+  static bool getJPEGOptimize(){
+    char* envpara = getenv( "JPEG_OPTIMIZE" );
+    bool optimize = JPEG_OPTIMIZE;
+    if( envpara ) optimize = atoi( envpara ) != 0;
+    return optimize;
+  }
+
+
   static int getPNGQuality(){
     char* envpara = getenv( "PNG_QUALITY" );
     int quality;
@@ -126,6 +155,28 @@ class Environment {
   }
 
 
+  static int getWebPQuality(){
+    char* envpara = getenv( "WEBP_QUALITY" );
+    int quality;
+    if( envpara ){
+      quality = atoi( envpara );
+      if( quality > 100 ) quality = 100;
+      if( quality < 0 ) quality = 0;
+    }
+    else quality = WEBP_QUALITY;
+
+    return quality;
+  }
+
+
+  static bool getWebPNegotiation(){
+    char* envpara = getenv( "WEBP_NEGOTIATION" );
+    bool negotiation = WEBP_NEGOTIATION;
+    if( envpara ) negotiation = atoi( envpara ) != 0;
+    return negotiation;
+  }
+
+
   static int getMaxCVT(){
     char* envpara = getenv( "MAX_CVT" );
     int max_CVT;
@@ -142,6 +193,20 @@ class Environment {
   }
 
 
+  static int getMaxTIFFCVT(){
+    char* envpara = getenv( "MAX_TIFF_CVT" );
+    int max_TIFF;
+    if( envpara ){
+      max_TIFF = atoi( envpara );
+      // -1 indicates no maximum and zero that MAX_CVT should be used
+      if( max_TIFF < -1 ) max_TIFF = MAX_TIFF_CVT;
+    }
+    else max_TIFF = MAX_TIFF_CVT;
+
+    return max_TIFF;
+  }
+
+
   static int getMaxLayers(){
     char* envpara = getenv( "MAX_LAYERS" );
     int layers;
@@ -324,6 +389,66 @@ class Environment {
     else version = IIIF_VERSION;
     return version;
   }
+
+
+  static unsigned int getDeepZoomTileSize(){
+    int size;
+    char* envpara = getenv( "DEEPZOOM_TILE_SIZE" );
+    if( envpara ){
+      size = atoi( envpara );
+      if( size < 0 ) size = DEEPZOOM_TILE_SIZE;
+    }
+    else size = DEEPZOOM_TILE_SIZE;
+    return size;
+  }
+
+
+  static unsigned int getRegionThreads(){
+    int threads;
+    char* envpara = getenv( "REGION_THREADS" );
+    if( envpara ){
+      threads = atoi( envpara );
+      if( threads < 0 ) threads = REGION_THREADS;
+    }
+    else threads = REGION_THREADS;
+    return (unsigned int) threads;
+  }
+
+
+  static unsigned int getCodecThreads(){
+    int threads;
+    char* envpara = getenv( "CODEC_THREADS" );
+    if( envpara ){
+      threads = atoi( envpara );
+      if( threads < 0 ) threads = CODEC_THREADS;
+    }
+    else threads = CODEC_THREADS;
+    return (unsigned int) threads;
+  }
+
+
+  static unsigned int getPrefetchTiles(){
+    int tiles;
+    char* envpara = getenv( "PREFETCH_TILES" );
+    if( envpara ){
+      tiles = atoi( envpara );
+      if( tiles < 0 ) tiles = PREFETCH_TILES;
+    }
+    else tiles = PREFETCH_TILES;
+    return (unsigned int) tiles;
+  }
+
+
+  static unsigned int getPrefetchTime(){
+    int time;
+    char* envpara = getenv( "PREFETCH_TIME" );
+    if( envpara ){
+      time = atoi( envpara );
+      if( time < 0 ) time = PREFETCH_TIME;
+    }
+    else time = PREFETCH_TIME;
+    return (unsigned int) time;
+  }
 };
 
 
@@ -19,6 +19,8 @@
 */
 
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include "Task.h"
 #include "URL.h"
 #include "Environment.h"
@@ -36,6 +38,89 @@
 
 using namespace std;
 
+// Create a strong entity tag from our image path, its modification time and every request parameter
+// that affects the content of our reply. Any change to the file or to how it is rendered therefore
+// results in a different tag
+static string createETag(Session *session, const string &path, time_t timestamp)
+{
+  const char *fields[] = {"QUERY_STRING", "BASE_URL", "HTTP_HOST", "HTTPS", "HTTP_ACCEPT", "HTTP_X_IIIF_ID"};
+
+  // 64 bit FNV-1a hash with each field terminated by a null byte
+  unsigned long long hash = 14695981039346656037ULL;
+  string data = path + '\0' + VERSION + '\0';
+  for (unsigned int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+  {
+    map<const string, string>::const_iterator it = session->headers.find(fields[i]);
+    if (it != session->headers.end())
+      data += it->second;
+    data += '\0';
+  }
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+
+  char etag[64];
+  snprintf(etag, 64, "\"%llx-%016llx\"", (unsigned long long)timestamp, hash);
+  return string(etag);
+}
+
+// Check whether the client's cached copy is still valid. If-None-Match takes precedence over
+// If-Modified-Since and uses weak comparison, so any W/ prefix is ignored
+static bool isUnmodified(Session *session, const string &etag, time_t timestamp)
+{
+  map<const string, string>::const_iterator it = session->headers.find("HTTP_IF_NONE_MATCH");
+  if (it != session->headers.end())
+  {
+    const string &tags = it->second;
+    size_t start = 0;
+    while (start < tags.length())
+    {
+      size_t end = tags.find(',', start);
+      if (end == string::npos)
+        end = tags.length();
+      string tag = tags.substr(start, end - start);
+      tag.erase(0, tag.find_first_not_of(" \t"));
+      tag.erase(tag.find_last_not_of(" \t") + 1);
+      if (tag.compare(0, 2, "W/") == 0)
+        tag.erase(0, 2);
+      if (tag == "*" || tag == etag)
+        return true;
+      start = end + 1;
+    }
+    return false;
+  }
+
+  // Check whether we have had an if_modified_since header. If so, compare to our image timestamp
+  it = session->headers.find("HTTP_IF_MODIFIED_SINCE");
+  if (it != session->headers.end())
+  {
+
+    tm mod_t;
+    time_t t;
+
+    memset(&mod_t, 0, sizeof(mod_t));
+    strptime(it->second.c_str(), "%a, %d %b %Y %H:%M:%S %Z", &mod_t);
+
+    // Use POSIX cross-platform mktime() function to generate a timestamp.
+    // This needs UTC, but to avoid a slow TZ environment reset for each request, we set this once globally in Main.cc
+    t = mktime(&mod_t);
+    if ((session->loglevel >= 1) && (t == -1))
+      *(session->logfile) << "FIF :: Error creating timestamp" << endl;
+
+    if (t != -1 && timestamp <= t)
+      return true;
+
+    if (session->loglevel >= 2)
+    {
+      *(session->logfile) << "FIF :: Content modified since requested time" << endl;
+    }
+  }
+
+  return false;
+}
+
 void FIF::run(Session *session, const string &src)
 {
 
@@ -137,9 +222,13 @@ void FIF::run(Session *session, const string &src)
       if (session->loglevel >= 2)
         *(session->logfile) << "FIF :: JPEG2000 image detected" << endl;
 #if defined(HAVE_KAKADU)
-      *session->image = new KakaduImage(test);
+      KakaduImage *j2k = new KakaduImage(test);
+      j2k->setThreads(session->codecOptions["CODEC_THREADS"]);
+      *session->image = j2k;
 #elif defined(HAVE_OPENJPEG)
-      *session->image = new OpenJPEGImage(test);
+      OpenJPEGImage *j2k = new OpenJPEGImage(test);
+      j2k->setThreads(session->codecOptions["CODEC_THREADS"]);
+      *session->image = j2k;
 #endif
     }
 #endif
@@ -175,30 +264,68 @@ void FIF::run(Session *session, const string &src)
     }
     */
 
-    // Open image and update timestamp
-    (*session->image)->openImage();
+    // If we have cached metadata, only check the modification time of our file. The image itself is
+    // opened by our codec when the first tile or region is requested, so requests for metadata alone
+    // never need to open it
+    bool cached = false;
+    if (timestamp > 0 && (*session->image)->set())
+    {
+      (*session->image)->updateTimestamp((*session->image)->getFileName((*session->image)->currentX, (*session->image)->currentY));
+      cached = ((*session->image)->timestamp == timestamp);
+    }
+
+    // The modification time of our file is now known either from the check above or from the
+    // initialisation of a new image, so set our validators and evaluate any conditional request
+    // before our image is opened
+    session->response->setLastModified((*session->image)->getTimestamp());
+    session->response->setETag(createETag(session, argument, (*session->image)->timestamp));
+
+#ifdef HAVE_WEBP
+    // Tiles may be negotiated as WebP later on, so any 304 reply must already carry our Vary header
+    if (session->codecOptions["WEBP_NEGOTIATION"])
+      session->response->setVary("Accept");
+#endif
 
-    // Check timestamp consistency. If cached timestamp is older, update metadata
-    if (timestamp > 0 && (timestamp < (*session->image)->timestamp))
+    if (isUnmodified(session, session->response->getETag(), (*session->image)->timestamp))
     {
       if (session->loglevel >= 2)
       {
-        *(session->logfile) << "FIF :: Image timestamp changed: reloading metadata" << endl;
+        *(session->logfile) << "FIF :: Unmodified content" << endl;
+        *(session->logfile) << "FIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
       }
-      (*session->image)->loadImageInfo((*session->image)->currentX, (*session->image)->currentY);
+      session->response->setNotModified();
+      return;
     }
 
-    // Add this image to our cache, overwriting previous version if it exists
-    (*session->imageCache)[argument] = *(*session->image);
+    if (cached)
+    {
+      if (session->loglevel >= 3)
+        *(session->logfile) << "FIF :: Using cached metadata" << endl;
+    }
+    else
+    {
+      // Open image and update timestamp
+      (*session->image)->openImage();
+
+      // Check timestamp consistency. If our file has been modified, update metadata
+      if (timestamp > 0 && (timestamp != (*session->image)->timestamp))
+      {
+        if (session->loglevel >= 2)
+        {
+          *(session->logfile) << "FIF :: Image timestamp changed: reloading metadata" << endl;
+        }
+        (*session->image)->loadImageInfo((*session->image)->currentX, (*session->image)->currentY);
+      }
+
+      // Add this image to our cache, overwriting previous version if it exists
+      (*session->imageCache)[argument] = *(*session->image);
+    }
 
     if (session->loglevel >= 3)
     {
       *(session->logfile) << "FIF :: Created image" << endl;
     }
 
-    // Set the timestamp for the reply
-    session->response->setLastModified((*session->image)->getTimestamp());
-
     if (session->loglevel >= 2)
     {
       *(session->logfile) << "FIF :: Image dimensions are " << (*session->image)->getImageWidth()
@@ -219,39 +346,6 @@ void FIF::run(Session *session, const string &src)
     throw error;
   }
 
-  // Check whether we have had an if_modified_since header. If so, compare to our image timestamp
-  if (session->headers.find("HTTP_IF_MODIFIED_SINCE") != session->headers.end())
-  {
-
-    tm mod_t;
-    time_t t;
-
-    strptime((session->headers)["HTTP_IF_MODIFIED_SINCE"].c_str(), "%a, %d %b %Y %H:%M:%S %Z", &mod_t);
-
-    // Use POSIX cross-platform mktime() function to generate a timestamp.
-    // This needs UTC, but to avoid a slow TZ environment reset for each request, we set this once globally in Main.cc
-    t = mktime(&mod_t);
-    if ((session->loglevel >= 1) && (t == -1))
-      *(session->logfile) << "FIF :: Error creating timestamp" << endl;
-
-    if ((*session->image)->timestamp <= t)
-    {
-      if (session->loglevel >= 2)
-      {
-        *(session->logfile) << "FIF :: Unmodified content" << endl;
-        *(session->logfile) << "FIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
-      }
-      throw(304);
-    }
-    else
-    {
-      if (session->loglevel >= 2)
-      {
-        *(session->logfile) << "FIF :: Content modified since requested time" << endl;
-      }
-    }
-  }
-
   // Reset our angle values
   session->view->xangle = 0;
   session->view->yangle = 90;
@@ -45,6 +45,18 @@
 #endif
 
 
+// Additional output formats
+#ifdef HAVE_WEBP
+#define IIIF_EXTRA_FORMATS "\"tif\", \"webp\""
+#else
+#define IIIF_EXTRA_FORMATS "\"tif\""
+#endif
+
+
+// Maximum size in native tiles in each direction of unscaled requests served as composed tiles
+#define MAX_RETILE 4
+
+
 using namespace std;
 
 // The request is in the form {identifier}/{region}/{size}/{rotation}/{quality}{.format}
@@ -125,6 +137,9 @@ void IIIF::run( Session* session, const string& src )
   FIF fif;
   fif.run( session, filename );
 
+  // The client's copy is still valid: our 304 reply is sent by the main request loop
+  if( session->response->notModified() ) return;
+
   // Reload our filename
   filename = (*session->image)->getImagePath();
 
@@ -200,6 +215,17 @@ void IIIF::run( Session* session, const string& src )
       *(session->logfile) << "IIIF :: ID is set to " << iiif_id << endl;
     }
 
+    // Our info.json depends on our image, the IIIF version and our ID, which includes the base URL.
+    // Because of our ability to serve different versions and because of possible content-negotiation
+    // do not cache any info.json files via Memcached
+    this->session = session;
+    stringstream key;
+    key << "info.json:" << iiif_version << ":" << filename << ":" << iiif_id;
+    if ( sendCachedResponse( key.str(), "ld+json" ) ){
+      session->response->setCachability( false );
+      return;
+    }
+
     // Set the context URL string
     char iiif_context[48];
     snprintf( iiif_context, 48, IIIF_CONTEXT, iiif_version );
@@ -248,6 +274,7 @@ void IIIF::run( Session* session, const string& src )
 		       << "  \"profile\" : \"" << IIIF_PROFILE << "\"," << endl
 		       << "  \"maxWidth\" : " << max << "," << endl
 		       << "  \"maxHeight\" : " << max << "," << endl
+		       << "  \"extraFormats\": [" << IIIF_EXTRA_FORMATS << "]," << endl
 		       << "  \"extraQualities\": [\"color\",\"gray\",\"bitonal\"]," << endl
 		       << "  \"extraFeatures\": [\"regionByPct\",\"sizeByForcedWh\",\"sizeByWh\",\"sizeAboveFull\",\"sizeUpscaling\",\"rotationBy90s\",\"mirroring\"]" << endl
 		       << "}";
@@ -257,7 +284,7 @@ void IIIF::run( Session* session, const string& src )
       infoStringStream << "  \"@id\" : \"" << iiif_id << "\"," << endl
 		       << "  \"profile\" : [" << endl
 		       << "     \"" << IIIF_PROTOCOL << "/" << iiif_version << "/" << IIIF_PROFILE << "\"," << endl
-		       << "     { \"formats\" : [ \"jpg\", \"png\" ]," << endl
+		       << "     { \"formats\" : [ \"jpg\", \"png\", " << IIIF_EXTRA_FORMATS << " ]," << endl
 		       << "       \"qualities\" : [\"native\",\"color\",\"gray\",\"bitonal\"]," << endl
 		       << "       \"supports\" : [\"regionByPct\",\"regionSquare\",\"sizeByForcedWh\",\"sizeByWh\",\"sizeAboveFull\",\"sizeUpscaling\",\"rotationBy90s\",\"mirroring\"]," << endl
 		       << "       \"maxWidth\" : " << max << "," << endl
@@ -268,15 +295,7 @@ void IIIF::run( Session* session, const string& src )
 
 
     // Now output the HTTP header and info text
-    stringstream header;
-    header << session->response->createHTTPHeader( "ld+json", (*session->image)->getTimestamp() )
-	   << infoStringStream.str();
-
-    session->out->putStr( (const char*) header.str().c_str(), header.tellp() );
-    session->response->setImageSent();
-
-    // Because of our ability to serve different versions and because of possible content-negotiation
-    // do not cache any info.json files via Memcached
+    sendResponse( key.str(), "ld+json", infoStringStream.str() );
     session->response->setCachability( false );
 
     return;
@@ -288,6 +307,13 @@ void IIIF::run( Session* session, const string& src )
     // IIIF requests are / separated with no CGI style '&' separators
     Tokenizer izer( params, "/" );
 
+    // TIFF exports are streamed and can be allowed a larger size, which must be set before our size is parsed
+    string extension = suffix.substr( 0, suffix.find_first_of("?") );
+    if( extension.length() > 4 && extension.compare( extension.length() - 4, 4, ".tif" ) == 0 ){
+      int max_tiff = (int) session->codecOptions["MAX_TIFF_CVT"];
+      if( max_tiff != 0 ) session->view->setMaxSize( max_tiff );
+    }
+
     // Keep track of the number of parameters than have been given
     int numOfTokens = 0;
 
@@ -470,7 +496,7 @@ void IIIF::run( Session* session, const string& src )
       }
 
       // Limit our requested size to the maximum allowable size if necessary
-      if( requested_width > (int) max_size || requested_height > (int) max_size ){
+      if( (int) max_size > 0 && ( requested_width > (int) max_size || requested_height > (int) max_size ) ){
 	if( ratio > 1.0 ){
 	  requested_width = max_size;
 	  requested_height = session->view->maintain_aspect ? round(max_size*ratio) : max_size;
@@ -542,7 +568,7 @@ void IIIF::run( Session* session, const string& src )
       // Check for a format specifier
       pos = quality.find_last_of(".");
 
-      // Get requested output format: JPEG and PNG are currently supported
+      // Get requested output format: JPEG, PNG, WebP and TIFF are currently supported
       if ( pos != string::npos ){
         format = quality.substr( pos + 1, string::npos );
         quality.erase( pos, string::npos );
@@ -551,6 +577,10 @@ void IIIF::run( Session* session, const string& src )
 #ifdef HAVE_PNG
 	else if( format == "png" ) session->view->output_format = PNG;
 #endif
+#ifdef HAVE_WEBP
+	else if( format == "webp" ) session->view->output_format = WEBP;
+#endif
+	else if( format == "tif" ) session->view->output_format = BIGTIFF;
 	else throw invalid_argument( "IIIF :: unsupported output format" );
       }
 
@@ -623,31 +653,44 @@ void IIIF::run( Session* session, const string& src )
     view_top = 0;
   }
 
-  // Determine whether this is a tile request which coincides with our tile boundaries
-  if ( ( session->view->maintain_aspect && (requested_res > 0) &&
-         (requested_width == (int) tw) && (requested_height == (int) th) &&
-         (view_left % tw == 0) && (view_top % th == 0) &&
-         (session->view->getViewWidth() % tw == 0) && (session->view->getViewHeight() % th == 0) &&
-         (session->view->getViewWidth() < im_width) && (session->view->getViewHeight() < im_height) )
-       ||
-       ( session->view->maintain_aspect && (requested_res == 0) &&
-         ((unsigned int) requested_width == im_width) && ((unsigned int) requested_height == im_height) )
-     ){
+  unsigned int view_width = session->view->getViewWidth();
+  unsigned int view_height = session->view->getViewHeight();
 
-    // Get the width and height for last row and column tiles
-    unsigned int rem_x = im_width % tw;
+  // Requests at the native size of a resolution, which are those of IIIF tiled viewers whatever tile
+  // size they use, can be served from our tile cache. TIFF output is only available for regions
+  if ( session->view->output_format != BIGTIFF &&
+       ((unsigned int) requested_width == view_width) && ((unsigned int) requested_height == view_height) &&
+       (view_left + view_width <= im_width) && (view_top + view_height <= im_height) &&
+       (view_width <= MAX_RETILE * tw) && (view_height <= MAX_RETILE * th) ){
 
     // Calculate the number of tiles in each direction
-    unsigned int ntlx = (im_width / tw) + (rem_x == 0 ? 0 : 1);
+    unsigned int ntlx = (im_width / tw) + (im_width % tw == 0 ? 0 : 1);
 
-    // Calculate tile index
+    // Calculate the index of the tile containing the top left of our view
     unsigned int i = view_left / tw;
     unsigned int j = view_top / th;
     unsigned int tile = (j * ntlx) + i;
 
-    // Simply pass this on to our JTL send command
+    // Check whether our view coincides exactly with this tile, including partial tiles at the right and
+    // bottom edges. 180 degree rotations are excluded as JTL remaps these to the tile on the opposite side
+    bool native = (view_left % tw == 0) && (view_top % th == 0) &&
+      ( view_width == ((view_left + tw < im_width) ? tw : im_width - view_left) ) &&
+      ( view_height == ((view_top + th < im_height) ? th : im_height - view_top) ) &&
+      ( (int) session->view->getRotation() % 360 != 180 );
+
     JTL jtl;
-    jtl.send( session, requested_res, tile );
+    if ( native ){
+      // Simply pass this on to our JTL send command
+      jtl.send( session, requested_res, tile );
+    }
+    else{
+      // Otherwise compose a tile of the requested size from our own tiles
+      if ( session->loglevel >= 3 ){
+        *(session->logfile) << "IIIF :: Composing " << view_width << "x" << view_height << " tile at "
+                            << view_left << "," << view_top << " from resolution " << requested_res << endl;
+      }
+      jtl.send( session, requested_res, tile, view_left, view_top, view_width, view_height );
+    }
 
   }
   else{
@@ -51,6 +51,8 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
   std::swap( first.suffix, second.suffix );
   std::swap( first.virtual_levels, second.virtual_levels );
   std::swap( first.format, second.format );
+  std::swap( first.codestream_index, second.codestream_index );
+  std::swap( first.codestream_index_timestamp, second.codestream_index_timestamp );
   std::swap( first.fileSystemPrefix, second.fileSystemPrefix );
   std::swap( first.fileSystemSuffix, second.fileSystemSuffix );
   std::swap( first.fileNamePattern, second.fileNamePattern );
@@ -118,8 +120,9 @@ void IIPImage::testImageType()
     isFile = true;
     timestamp = sb.st_mtime;
 
-    // Magic file signature for JPEG2000
+    // Magic file signature for JPEG2000 family files (JP2, JPX and HTJ2K JPH) and raw codestreams (J2K, J2C and JHC)
     static const unsigned char j2k[10] = {0x00,0x00,0x00,0x0C,0x6A,0x50,0x20,0x20,0x0D,0x0A};
+    static const unsigned char j2c[4] = {0xFF,0x4F,0xFF,0x51};
 
     // Magic file signatures for TIFF (See http://www.garykessler.net/library/file_sigs.html)
     static const unsigned char stdtiff[3] = {0x49,0x20,0x49};       // TIFF
@@ -129,7 +132,7 @@ void IIPImage::testImageType()
     static const unsigned char bbigtiff[4] = {0x49,0x49,0x2B,0x00}; // Big Endian BigTIFF
 
     // Compare our header sequence to our magic byte signatures
-    if( memcmp( header, j2k, 10 ) == 0 ) format = JPEG2000;
+    if( memcmp( header, j2k, 10 ) == 0 || memcmp( header, j2c, 4 ) == 0 ) format = JPEG2000;
     else if( memcmp( header, stdtiff, 3 ) == 0
 	     || memcmp( header, lsbtiff, 4 ) == 0 || memcmp( header, msbtiff, 4 ) == 0
 	     || memcmp( header, lbigtiff, 4 ) == 0 || memcmp( header, bbigtiff, 4 ) == 0 ){
@@ -166,7 +169,8 @@ void IIPImage::testImageType()
     int len = tmp.length();
 
     suffix = tmp.substr( dot + 1, len );
-    if( suffix == "jp2" || suffix == "jpx" || suffix == "j2k" ) format = JPEG2000;
+    if( suffix == "jp2" || suffix == "jpx" || suffix == "j2k" || suffix == "jph" ||
+	suffix == "j2c" || suffix == "jhc" ) format = JPEG2000;
     else if( suffix == "tif" || suffix == "tiff" ) format = TIF;
     else format = UNSUPPORTED;
 
@@ -35,6 +35,7 @@
 #include <vector>
 #include <map>
 #include <stdexcept>
+#include <stdint.h>
 
 #include "RawTile.h"
 
@@ -108,6 +109,12 @@ class IIPImage {
   /// Return the image format e.g. tif
   ImageFormat format;
 
+  /// Byte offsets of the tile-parts within a JPEG2000 codestream, built by the codec on first access
+  std::vector <uint64_t> codestream_index;
+
+  /// Modification timestamp of the file from which our codestream index was built
+  time_t codestream_index_timestamp;
+
 
  public:
 
@@ -168,6 +175,7 @@ class IIPImage {
    : isFile( false ),
     virtual_levels( 0 ),
     format( UNSUPPORTED ),
+    codestream_index_timestamp( 0 ),
     tile_width( 0 ),
     tile_height( 0 ),
     colourspace( NONE ),
@@ -192,6 +200,7 @@ class IIPImage {
     isFile( false ),
     virtual_levels( 0 ),
     format( UNSUPPORTED ),
+    codestream_index_timestamp( 0 ),
     tile_width( 0 ),
     tile_height( 0 ),
     colourspace( NONE ),
@@ -223,6 +232,8 @@ class IIPImage {
     lut( image.lut ),
     virtual_levels( image.virtual_levels ),
     format( image.format ),
+    codestream_index( image.codestream_index ),
+    codestream_index_timestamp( image.codestream_index_timestamp ),
     image_widths( image.image_widths ),
     image_heights( image.image_heights ),
     tile_width( image.tile_width ),
@@ -346,6 +357,34 @@ class IIPImage {
   /// Return whether this image type directly handles region decoding
   virtual bool regionDecoding(){ return false; };
 
+  /// Return whether this image type can scale a region to an arbitrary size while decoding
+  virtual bool scaledRegionDecoding(){ return false; };
+
+  /// Create an independent copy of this image with its own decoder handle
+  /** Used for multi-threaded tile decoding, where each worker needs its own file handle.
+      Overloaded by child classes that support this.
+      @return new image object to be deleted by the caller or NULL if not supported
+   */
+  virtual IIPImage* duplicate(){ return NULL; };
+
+  /// Request that only a subset of channels be decoded
+  /** Overloaded by image types that store channels separately, which can then skip reading and
+      decoding the others. Channels outside the subset are returned as zero
+      @param c flag for each channel - an empty vector selects all channels
+   */
+  virtual void setChannelSubset( const std::vector<bool>& c ){};
+
+  /// Return the path with which tiles from this image are identified within the tile cache
+  /** Overloaded by image types for which tiles decoded with a channel subset differ from full tiles */
+  virtual std::string getCachePath(){ return imagePath; };
+
+  /// Whether tiles at a virtual resolution should be composed from tiles of the next resolution up
+  /** Such tiles are assembled by the TileManager from 2x2 blocks of cached tiles rather than decoded
+      from the image. Overloaded by child classes that generate virtual resolutions.
+      @param r resolution
+   */
+  virtual bool composedResolution( unsigned int r ){ return false; };
+
   /// Load the appropriate codec module for this image type
   /** Used only for dynamically loading codec modules. Overloaded by DSOImage class.
       @param module the codec module path
@@ -393,6 +432,27 @@ class IIPImage {
   */
   virtual RawTile getRegion( int ha, int va, unsigned int r, int layers, int x, int y, unsigned int w, unsigned int h ){ return RawTile(); };
 
+
+  /// Return a region for a given angle and resolution scaled to a given size
+  /** Return a RawTile object: Overloaded by child class. The returned region may differ slightly
+      from the requested size, in which case the caller is responsible for resizing it.
+      @param ha horizontal angle
+      @param va vertical angle
+      @param r resolution
+      @param layers number of layers to decode
+      @param x offset in x direction
+      @param y offset in y direction
+      @param w width of region
+      @param h height of region
+      @param ow output width
+      @param oh output height
+      @return RawTile image
+  */
+  virtual RawTile getScaledRegion( int ha, int va, unsigned int r, int layers, int x, int y, unsigned int w, unsigned int h,
+				   unsigned int ow, unsigned int oh ){
+    return getRegion( ha, va, r, layers, x, y, w, h );
+  };
+
   /// Assignment operator
   /** @param image IIPImage object */
   IIPImage& operator = ( IIPImage image ){
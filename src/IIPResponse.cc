@@ -34,10 +34,13 @@ IIPResponse::IIPResponse(){
   server = "Server: iipsrv/" + string(VERSION);
   powered = "X-Powered-By: IIPImage";
   modified = "";
+  etag = "";
   mimeType = "Content-Type: application/vnd.netfpx";
   cors = "";
+  vary = "";
   eof = "\r\n";
   _sent = false;
+  _notModified = false;
   _cachable = true;
 }
 
@@ -107,6 +110,7 @@ string IIPResponse::formatResponse(){
   }
   else{
     response = server + eof + powered + eof + cacheControl + eof + modified + eof + mimeType + eof;
+    if( !etag.empty() ) response += "ETag: " + etag + eof;
     if( !cors.empty() ) response += cors + eof;
     response += eof + protocol + eof + responseBody;
   }
@@ -116,6 +120,22 @@ string IIPResponse::formatResponse(){
 
 
 
+string IIPResponse::formatNotModified(){
+
+  // A 304 reply carries the same validators and caching headers as a full response, but no body
+  string response = "Status: 304 Not Modified" + eof + server + eof;
+  if( !cacheControl.empty() ) response += cacheControl + eof;
+  if( !modified.empty() ) response += modified + eof;
+  if( !etag.empty() ) response += "ETag: " + etag + eof;
+  if( !cors.empty() ) response += cors + eof;
+  if( !vary.empty() ) response += vary + eof;
+  response += eof;
+
+  return response;
+}
+
+
+
 string IIPResponse::getAdvert(){
 
   string advert = server + eof + "Content-Type: text/html" + eof;
@@ -142,11 +162,17 @@ string IIPResponse::createHTTPHeader( const string& mimeType, const string& time
          << "Last-Modified: " << timeStamp << eof
 	 << cacheControl << eof;
 
+  // Add our entity tag if we have one
+  if ( !etag.empty() ) header << "ETag: " << etag << eof;
+
   if( contentLength > 0 ) header << "Content-Length: " << contentLength << eof;
 
   // Add CORS header if we have one
   if ( !cors.empty() ) header << cors << eof;
 
+  // Add Vary header if our content has been negotiated
+  if ( !vary.empty() ) header << vary << eof;
+
   // Need extra EOF separator
   header << eof;
 
@@ -46,6 +46,7 @@ class IIPResponse{
   std::string server;              // Server header
   std::string powered;             // Powered By header
   std::string modified;            // Last modified header
+  std::string etag;                // Entity tag including its quotes
   std::string cacheControl;        // Cache control header
   std::string mimeType;            // Mime type header
   std::string eof;                 // End of response delimitter eg "\r\n"
@@ -53,9 +54,11 @@ class IIPResponse{
   std::string responseBody;        // The main response
   std::string error;               // Error message
   std::string cors;                // CORS (Cross-Origin Resource Sharing) setting
+  std::string vary;                // Vary header for content negotiated responses
   std::string status;              // HTTP status code
   bool _cachable;                  // Indicate whether response should be cached
   bool _sent;                      // Indicate whether a response has been sent
+  bool _notModified;               // Indicate whether the client's copy is still valid
 
 
  public:
@@ -74,6 +77,19 @@ class IIPResponse{
   void setLastModified( const std::string& m ) { modified = "Last-Modified: " + m; };
 
 
+  /// Set the entity tag for this response
+  /** @param e strong entity tag including its surrounding quotes */
+  void setETag( const std::string& e ) { etag = e; };
+
+
+  /// Get the entity tag for this response
+  std::string getETag() { return etag; };
+
+
+  /// Get the ETag header including its line ending or an empty string if no entity tag has been set
+  std::string getETagHeader() { return etag.empty() ? "" : "ETag: " + etag + eof; };
+
+
   /// Add a response string
   /** @param r response string */
   void addResponse( const std::string& r );
@@ -127,6 +143,11 @@ class IIPResponse{
   std::string getCORS(){ return cors; };
 
 
+  /// Set Vary header for responses whose content depends on request headers
+  /** @param v request header name(s) */
+  void setVary( const std::string& v ){ vary = "Vary: " + v; };
+
+
   /// Set Cache-Control value
   /** @param c Cache-Control setting */
   void setCacheControl( const std::string& c ){ cacheControl = "Cache-Control: " + c; };
@@ -177,6 +198,19 @@ class IIPResponse{
   bool imageSent() { return _sent; };
 
 
+  /// Indicate that the client's cached copy is still valid and that a 304 Not Modified should be sent
+  /** Such replies must never be cached by us */
+  void setNotModified() { _notModified = true; _cachable = false; };
+
+
+  /// Indicate whether a 304 Not Modified reply should be sent
+  bool notModified() { return _notModified; };
+
+
+  /// Get a formatted 304 Not Modified reply
+  std::string formatNotModified();
+
+
   /// Display our advertising banner ;-)
   /** @return HTML string */
   std::string getAdvert();
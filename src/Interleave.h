@@ -0,0 +1,179 @@
+/*
+    Interleaving of planar decoded image components
+
+    Copyright (C) 2019 Ruven Pillay.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _INTERLEAVE_H
+#define _INTERLEAVE_H
+
+#include <stdint.h>
+
+// Use SSE4.1 kernels with run-time CPU detection to interleave our decoded components
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <smmintrin.h>
+#define SIMD_INTERLEAVE 1
+#endif
+
+
+#ifdef SIMD_INTERLEAVE
+
+// Byte shuffle masks to interleave 3 planar registers of 8 or 16 bit samples into 3 registers of
+// RGB triplets: indexed by sample size in bytes - 1, output register and input channel
+struct ShuffleMasks {
+  unsigned char m[2][3][3][16];
+  ShuffleMasks(){
+    for( unsigned int e=1; e<=2; e++ ){
+      for( unsigned int r=0; r<3; r++ ){
+	for( unsigned int c=0; c<3; c++ ){
+	  for( unsigned int b=0; b<16; b++ ){
+	    unsigned int sample = (16*r + b) / e;
+	    m[e-1][r][c][b] = ( sample % 3 == c ) ? (sample/3)*e + (16*r + b) % e : 0x80;
+	  }
+	}
+      }
+    }
+  }
+};
+
+static const ShuffleMasks shuffle_masks;
+
+
+// Interleave 3 registers of planar data using our shuffle masks
+__attribute__((target("sse4.1")))
+static inline void interleave3( const __m128i* v, const unsigned char (*m)[3][16], unsigned char* o ){
+  for( unsigned int r=0; r<3; r++ ){
+    __m128i out = _mm_or_si128( _mm_or_si128(
+				  _mm_shuffle_epi8( v[0], _mm_loadu_si128( (const __m128i*) m[r][0] ) ),
+				  _mm_shuffle_epi8( v[1], _mm_loadu_si128( (const __m128i*) m[r][1] ) ) ),
+				_mm_shuffle_epi8( v[2], _mm_loadu_si128( (const __m128i*) m[r][2] ) ) );
+    _mm_storeu_si128( (__m128i*) (o + 16*r), out );
+  }
+}
+
+
+// Convert planar 32 bit components into interleaved 8 or 16 bit output for up to 4 channels.
+// Returns the number of pixels processed, the remainder being left for the scalar loop
+__attribute__((target("sse4.1")))
+static inline unsigned int interleave_sse41( int32_t* const* planes, unsigned int channels, unsigned int n,
+					     unsigned int obpc, void* out ){
+
+  if( channels > 4 ) return 0;
+
+  const unsigned int e = obpc / 8;       // Bytes per output sample
+  const unsigned int step = 16 / e;      // Pixels per 128 bit register
+  const __m128i mask = _mm_set1_epi32( (obpc == 16) ? 0xffff : 0xff );
+  unsigned char* o = (unsigned char*) out;
+  __m128i v[4];
+  unsigned int i = 0;
+
+  for( ; i + step <= n; i += step ){
+
+    // Mask off and pack each component with unsigned saturation, which is exact after masking
+    for( unsigned int k=0; k<channels; k++ ){
+      const __m128i* p = (const __m128i*) (planes[k] + i);
+      __m128i a = _mm_and_si128( _mm_loadu_si128( p ), mask );
+      __m128i b = _mm_and_si128( _mm_loadu_si128( p+1 ), mask );
+      if( e == 1 ){
+	__m128i c = _mm_and_si128( _mm_loadu_si128( p+2 ), mask );
+	__m128i d = _mm_and_si128( _mm_loadu_si128( p+3 ), mask );
+	v[k] = _mm_packus_epi16( _mm_packus_epi32( a, b ), _mm_packus_epi32( c, d ) );
+      }
+      else v[k] = _mm_packus_epi32( a, b );
+    }
+
+    switch( channels ){
+
+      case 1:
+	_mm_storeu_si128( (__m128i*) o, v[0] );
+	break;
+
+      case 2:
+	if( e == 1 ){
+	  _mm_storeu_si128( (__m128i*) o, _mm_unpacklo_epi8( v[0], v[1] ) );
+	  _mm_storeu_si128( (__m128i*) (o+16), _mm_unpackhi_epi8( v[0], v[1] ) );
+	}
+	else{
+	  _mm_storeu_si128( (__m128i*) o, _mm_unpacklo_epi16( v[0], v[1] ) );
+	  _mm_storeu_si128( (__m128i*) (o+16), _mm_unpackhi_epi16( v[0], v[1] ) );
+	}
+	break;
+
+      case 3:
+	interleave3( v, shuffle_masks.m[e-1], o );
+	break;
+
+      case 4:
+	{
+	  if( e == 1 ){
+	    __m128i rg_lo = _mm_unpacklo_epi8( v[0], v[1] ), rg_hi = _mm_unpackhi_epi8( v[0], v[1] );
+	    __m128i ba_lo = _mm_unpacklo_epi8( v[2], v[3] ), ba_hi = _mm_unpackhi_epi8( v[2], v[3] );
+	    _mm_storeu_si128( (__m128i*) o, _mm_unpacklo_epi16( rg_lo, ba_lo ) );
+	    _mm_storeu_si128( (__m128i*) (o+16), _mm_unpackhi_epi16( rg_lo, ba_lo ) );
+	    _mm_storeu_si128( (__m128i*) (o+32), _mm_unpacklo_epi16( rg_hi, ba_hi ) );
+	    _mm_storeu_si128( (__m128i*) (o+48), _mm_unpackhi_epi16( rg_hi, ba_hi ) );
+	  }
+	  else{
+	    __m128i rg_lo = _mm_unpacklo_epi16( v[0], v[1] ), rg_hi = _mm_unpackhi_epi16( v[0], v[1] );
+	    __m128i ba_lo = _mm_unpacklo_epi16( v[2], v[3] ), ba_hi = _mm_unpackhi_epi16( v[2], v[3] );
+	    _mm_storeu_si128( (__m128i*) o, _mm_unpacklo_epi32( rg_lo, ba_lo ) );
+	    _mm_storeu_si128( (__m128i*) (o+16), _mm_unpackhi_epi32( rg_lo, ba_lo ) );
+	    _mm_storeu_si128( (__m128i*) (o+32), _mm_unpacklo_epi32( rg_hi, ba_hi ) );
+	    _mm_storeu_si128( (__m128i*) (o+48), _mm_unpackhi_epi32( rg_hi, ba_hi ) );
+	  }
+	}
+	break;
+    }
+
+    o += 16 * channels;
+  }
+
+  return i;
+}
+
+#endif
+
+
+// Scalar conversion of pixels i to n-1 of planar 32 bit components into interleaved 8 or 16 bit output
+static inline void interleave_scalar( int32_t* const* planes, unsigned int channels, unsigned int i, unsigned int n,
+				      unsigned int obpc, void* out ){
+  unsigned int nk = i * channels;
+  for( ; i<n; i++ ){
+    for( unsigned int k=0; k<channels; k++ ){
+      if( obpc == 16 ) ((unsigned short*)out)[nk++] = planes[k][i] & 0x0000ffff;
+      else ((unsigned char*)out)[nk++] = planes[k][i] & 0x000000ff;
+    }
+  }
+}
+
+
+// Convert n pixels of planar 32 bit decoded components into interleaved 8 or 16 bit output,
+// keeping only the bottom 1 or 2 bytes of each sample
+static inline void interleave( int32_t* const* planes, unsigned int channels, unsigned int n, unsigned int obpc, void* out ){
+
+  unsigned int i = 0;
+
+#ifdef SIMD_INTERLEAVE
+  static const bool sse41 = __builtin_cpu_supports( "sse4.1" );
+  if( sse41 ) i = interleave_sse41( planes, channels, n, obpc, out );
+#endif
+
+  interleave_scalar( planes, channels, i, n, obpc, out );
+}
+
+
+#endif
@@ -22,6 +22,16 @@
 
 #include "JPEGCompressor.h"
 #include <iostream>
+#include <vector>
+#include <cstring>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 
@@ -59,6 +69,84 @@ inline double round(double r) { return (r > 0.0) ? floor(r + 0.5) : ceil(r - 0.5
 
 
 
+// Output buffers are pooled in power of two size classes between these limits (64kB - 64MB)
+#define MIN_POOL_CLASS 16
+#define MAX_POOL_CLASS 26
+
+// Maximum number of free buffers kept in each size class
+#define MAX_POOL_BUFFERS 2
+
+// Images of at least this many pixels are encoded in parallel bands (4 megapixels)
+#define MIN_PARALLEL_PIXELS 4194304
+
+// Minimum number of MCU rows in each parallel band
+#define MIN_BAND_MCU_ROWS 8
+
+
+
+/* Our libjpeg compression object, error handler and a pool of output buffers are kept alive for the lifetime
+   of each worker thread and shared by all JPEGCompressor instances used on that thread, avoiding the re-creation
+   of the compression object, its memory pools and tables as well as the allocation of a large output buffer for
+   each image. Tiles may be encoded concurrently on different threads, but each thread compresses one image at a
+   time, so no locking is needed.
+*/
+static thread_local struct jpeg_compress_struct worker_cinfo;
+static thread_local struct jpeg_error_mgr worker_jerr;
+static thread_local bool worker_created = false;
+
+// Settings for which our compression parameters and tables were last set up
+static thread_local int worker_quality = -1;
+static thread_local int worker_channels = -1;
+static thread_local int worker_subsampling = -1;
+static thread_local bool worker_optimize = false;
+
+#ifdef HAVE_TURBOJPEG
+// Our TurboJPEG compression handle, which is likewise kept for the lifetime of each thread.
+// libjpeg-turbo selects the fastest SIMD extensions available on the CPU at run time
+static thread_local tjhandle worker_tj = NULL;
+#endif
+
+// Buffers are always acquired and released on the same thread, so each thread keeps its own pool
+static thread_local vector<unsigned char*> buffer_pool[MAX_POOL_CLASS+1];
+
+
+
+// Size class of a buffer of a given size
+static unsigned int pool_class( size_t size )
+{
+  unsigned int c = MIN_POOL_CLASS;
+  while( ((size_t)1 << c) < size ) c++;
+  return c;
+}
+
+
+
+// Get a buffer of at least the requested size from our pool. Size is updated to the actual buffer size
+static unsigned char* acquire_buffer( size_t& size )
+{
+  unsigned int c = pool_class( size );
+  if( c > MAX_POOL_CLASS ) return new unsigned char[size];
+  size = (size_t)1 << c;
+  if( buffer_pool[c].empty() ) return new unsigned char[size];
+  unsigned char* buffer = buffer_pool[c].back();
+  buffer_pool[c].pop_back();
+  return buffer;
+}
+
+
+
+// Return a buffer obtained via acquire_buffer() to our pool
+static void release_buffer( unsigned char* buffer, size_t size )
+{
+  unsigned int c = pool_class( size );
+  if( c <= MAX_POOL_CLASS && ((size_t)1 << c) == size && buffer_pool[c].size() < MAX_POOL_BUFFERS ){
+    buffer_pool[c].push_back( buffer );
+  }
+  else delete[] buffer;
+}
+
+
+
 /* My version of the JPEG error_exit function. We want to pass control back
    to the program, so simply throw an exception
 */
@@ -70,8 +158,9 @@ METHODDEF(void) iip_error_exit( j_common_ptr cinfo )
   // Create the message
   (*cinfo->err->format_message) ( cinfo, buffer );
 
-  // Let the memory manager delete any temp files before we die
-  jpeg_destroy( cinfo );
+  // Let the memory manager delete any temp files and return our compression object to
+  // its idle state so that it can be re-used
+  jpeg_abort( cinfo );
 
   // Throw an exception rather than print out a message and exit
   throw string( buffer );
@@ -115,12 +204,20 @@ iip_empty_output_buffer( j_compress_ptr cinfo )
   iip_dest_ptr dest = (iip_dest_ptr) cinfo->dest;
 
   // If we reach here, our output tile buffer must be too small, so reallocate
-  unsigned int new_size = dest->source_size*2;
-  unsigned char *source = new unsigned char[new_size];
-  memcpy( source, dest->source, dest->source_size );
+  size_t new_size = dest->source_size*2;
+  unsigned char *source;
+  if( dest->pooled ){
+    source = acquire_buffer( new_size );
+    memcpy( source, dest->source, dest->source_size );
+    release_buffer( dest->source, dest->source_size );
+  }
+  else{
+    source = new unsigned char[new_size];
+    memcpy( source, dest->source, dest->source_size );
+    delete[] dest->source;
+  }
 
   // Swap buffers
-  delete[] dest->source;
   dest->source = source;
 
   // Reset the pointer to the beginning of the buffer
@@ -155,101 +252,143 @@ void iip_term_destination( j_compress_ptr cinfo )
 
 
 
-void JPEGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_height )
+void JPEGCompressor::setup( const RawTile& rawtile, unsigned int strip_height, unsigned char* output, size_t output_size, bool pooled )
 {
-  // Do some initialisation
-  dest = &dest_mgr;
-
   // Set up the correct width and height for this particular tile
   width = rawtile.width;
   height = rawtile.height;
   channels = rawtile.channels;
 
+  cinfo = &worker_cinfo;
 
-  // Make sure we only try to compress images with 1 or 3 channels
-  if( ! ( (channels==1) || (channels==3) )  ){
-    throw string( "JPEGCompressor: JPEG can only handle images of either 1 or 3 channels" );
-  }
-
-  // JPEG can only handle 8 bit data
-  if( rawtile.bpc != 8 ) throw string( "JPEGCompressor: JPEG can only handle 8 bit images" );
-
+  if( !worker_created ){
 
-  // We set up the normal JPEG error routines, then override error_exit.
-  cinfo.err = jpeg_std_error( &jerr );
+    // We set up the normal JPEG error routines, then override error_exit.
+    cinfo->err = jpeg_std_error( &worker_jerr );
 
+    // Override the error_exit function with our own.
+    // Hmmm, we have to do this assignment in C due to the strong type checking of C++
+    //  or something like that. So, we use an extern "C" function declared at the top
+    //  of this file and pass our arguments through this. I'm sure there's a better
+    //  way of doing this, but this seems to work :/
 
-  // Override the error_exit function with our own.
-  // Hmmm, we have to do this assignment in C due to the strong type checking of C++
-  //  or something like that. So, we use an extern "C" function declared at the top
-  //  of this file and pass our arguments through this. I'm sure there's a better
-  //  way of doing this, but this seems to work :/
+    //   cinfo.err.error_exit = iip_error_exit;
+    setup_error_functions( cinfo );
 
-  //   cinfo.err.error_exit = iip_error_exit;
-  setup_error_functions( &cinfo );
+    jpeg_create_compress( cinfo );
 
-  jpeg_create_compress( &cinfo );
+    /* The destination object is made permanent so that multiple JPEG images
+     * can be written without re-creating it.
+     */
+    cinfo->dest = ( struct jpeg_destination_mgr* )
+      ( *cinfo->mem->alloc_small )
+      ( (j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof( iip_destination_mgr ) );
 
-
-  /* The destination object is made permanent so that multiple JPEG images
-   * can be written to the same file without re-executing jpeg_stdio_dest.
-   * This makes it dangerous to use this manager and a different destination
-   * manager serially with the same JPEG object, because their private object
-   * sizes may be different.  Caveat programmer.
-   */
-  if( !cinfo.dest ){
-    // first time for this JPEG object?
-    cinfo.dest = ( struct jpeg_destination_mgr* )
-      ( *cinfo.mem->alloc_small )
-      ( (j_common_ptr) &cinfo, JPOOL_PERMANENT, sizeof( iip_destination_mgr ) );
+    worker_created = true;
   }
+  // Make sure our object is idle in case a previous compression was interrupted
+  else jpeg_abort_compress( cinfo );
 
 
-  dest = (iip_dest_ptr) cinfo.dest;
+  dest = (iip_dest_ptr) cinfo->dest;
   dest->pub.init_destination = iip_init_destination;
   dest->pub.empty_output_buffer = iip_empty_output_buffer;
   dest->pub.term_destination = iip_term_destination;
   dest->strip_height = strip_height;
-
-  // Calculate our metadata storage requirements
-  unsigned int metadata_size =
-    (icc.size()>0 ? (icc.size()+ICC_OVERHEAD_LEN) : 0) +
-    (xmp.size()>0 ? (xmp.size()+XMP_PREFIX_SIZE) : 0);
-
-  // Allocate enough memory for our header and metadata
-  unsigned long output_size = metadata_size + MX;
-  header = new unsigned char[output_size];
-  dest->source = header;
+  dest->source = output;
   dest->source_size = output_size;
+  dest->pooled = pooled;
 
-  cinfo.image_width = width;
-  cinfo.image_height = height;
-  cinfo.input_components = channels;
-  cinfo.in_color_space = ( channels == 3 ? JCS_RGB : JCS_GRAYSCALE );
-  jpeg_set_defaults( &cinfo );
+  // Set image information
+  cinfo->image_width = width;
+  cinfo->image_height = height;
+
+  // Our default parameters and quantization and Huffman tables only need to be set up
+  // again if our quality, number of channels or coding options have changed since our last image
+  if( worker_quality != Q || worker_channels != (int) channels ||
+      worker_subsampling != subsampling || worker_optimize != optimize ){
+    cinfo->input_components = channels;
+    cinfo->in_color_space = ( channels == 3 ? JCS_RGB : JCS_GRAYSCALE );
+    jpeg_set_defaults( cinfo );
+
+    // Set compression quality (fastest, but possibly slower depending
+    //  on hardware) - must do this after we've set the defaults!
+    cinfo->dct_method = JDCT_FASTEST;
+
+    jpeg_set_quality( cinfo, Q, TRUE );
+
+    // Set our chroma subsampling: libjpeg defaults to 4:2:0
+    if( channels == 3 ){
+      cinfo->comp_info[0].h_samp_factor = (subsampling == 444) ? 1 : 2;
+      cinfo->comp_info[0].v_samp_factor = (subsampling == 420) ? 2 : 1;
+    }
 
-  // Set our physical output resolution (JPEG only supports integers)
-  cinfo.X_density = round( dpi_x );
-  cinfo.Y_density = round( dpi_y );
-  cinfo.density_unit = dpi_units;
+    cinfo->optimize_coding = optimize ? TRUE : FALSE;
 
-  // Set compression point quality (highest, but possibly slower depending
-  //  on hardware) - must do this after we've set the defaults!
-  cinfo.dct_method = JDCT_FASTEST;
+    worker_quality = Q;
+    worker_channels = channels;
+    worker_subsampling = subsampling;
+    worker_optimize = optimize;
+  }
 
-  jpeg_set_quality( &cinfo, Q, TRUE );
+  // Set our physical output resolution (JPEG only supports integers)
+  cinfo->X_density = round( dpi_x );
+  cinfo->Y_density = round( dpi_y );
+  cinfo->density_unit = dpi_units;
 
-  jpeg_start_compress( &cinfo, TRUE );
+  // Our tables are left intact between images, so make sure they are all written out
+  jpeg_start_compress( cinfo, TRUE );
 
   // Add an identifying comment
-  jpeg_write_marker( &cinfo, JPEG_COM, (const JOCTET*) "Generated by IIPImage", 21 );
+  jpeg_write_marker( cinfo, JPEG_COM, (const JOCTET*) "Generated by IIPImage", 21 );
 
   // Embed ICC profile if one is supplied
   writeICCProfile();
 
   // Add XMP metadata
   writeXMPMetadata();
-  
+}
+
+
+
+
+void JPEGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_height )
+{
+  // Make sure we only try to compress images with 1 or 3 channels
+  if( ! ( (rawtile.channels==1) || (rawtile.channels==3) )  ){
+    throw string( "JPEGCompressor: JPEG can only handle images of either 1 or 3 channels" );
+  }
+
+  // JPEG can only handle 8 bit data
+  if( rawtile.bpc != 8 ) throw string( "JPEGCompressor: JPEG can only handle 8 bit images" );
+
+  parallel = false;
+
+#ifdef _OPENMP
+  // Encode large images in parallel bands. The whole encoded image is then returned as our header
+  int nthreads = (threads == 0) ? omp_get_max_threads() : threads;
+  if( nthreads > 1 && !optimize && (size_t) rawtile.width * rawtile.height >= MIN_PARALLEL_PIXELS ){
+    if( compressParallel( rawtile, nthreads ) ){
+      parallel = true;
+      return;
+    }
+  }
+#endif
+
+  // Calculate our metadata storage requirements
+  unsigned int metadata_size =
+    (icc.size()>0 ? (icc.size()+ICC_OVERHEAD_LEN) : 0) +
+    (xmp.size()>0 ? (xmp.size()+XMP_PREFIX_SIZE) : 0);
+
+  // Allocate enough memory for our header and metadata
+  unsigned long output_size = metadata_size + MX;
+  header = new unsigned char[output_size];
+
+  setup( rawtile, strip_height, header, output_size, false );
+
+  // Our header may have been re-allocated if it was larger than expected
+  header = dest->source;
+
   // Copy the encoded JPEG header data to a separate buffer
   size_t datacount = dest->source_size - dest->pub.free_in_buffer;
   header_size = datacount;
@@ -274,6 +413,9 @@ unsigned int JPEGCompressor::CompressStrip( unsigned char* input, unsigned char*
     header_size = 0;
   }
 
+  // Our image has already been fully encoded in parallel
+  if( parallel ) return 0;
+
   // Setup our destination manager
   dest->source = output;
   dest->source_size = tile_height*width*channels + MX;
@@ -281,12 +423,12 @@ unsigned int JPEGCompressor::CompressStrip( unsigned char* input, unsigned char*
   dest->pub.free_in_buffer = dest->source_size;
 
   // Reset our scanline index
-  cinfo.next_scanline = 0;
+  cinfo->next_scanline = 0;
 
   // Now write out our scanlines
-  while( cinfo.next_scanline < tile_height ) {
-    row[0] = &input[ cinfo.next_scanline * row_stride ];
-    jpeg_write_scanlines( &cinfo, row, 1 );
+  while( cinfo->next_scanline < tile_height ) {
+    row[0] = &input[ cinfo->next_scanline * row_stride ];
+    jpeg_write_scanlines( cinfo, row, 1 );
   }
 
   // Return the number of bytes written
@@ -299,23 +441,25 @@ unsigned int JPEGCompressor::CompressStrip( unsigned char* input, unsigned char*
 
 unsigned int JPEGCompressor::Finish( unsigned char* output )
 {
+  if( parallel ){
+    parallel = false;
+    return 0;
+  }
+
   // Reset pointers
   dest->source = output;
   dest->pub.next_output_byte = dest->source;
   dest->pub.free_in_buffer = dest->source_size;
 
   // Need to set the scanline to the end for jpeg_finish_compress() to work
-  cinfo.next_scanline = dest->strip_height;
+  cinfo->next_scanline = dest->strip_height;
 
-  // Terminate the compression
-  jpeg_finish_compress( &cinfo );
+  // Terminate the compression, which leaves our compression object ready for re-use
+  jpeg_finish_compress( cinfo );
 
-  // Calculate size of final data to be written before destroying our compression structures
+  // Calculate size of final data to be written
   unsigned long dataLength = dest->source_size - dest->pub.free_in_buffer;
 
-  // Destroy our compression structure
-  jpeg_destroy_compress( &cinfo );
-
   // Return number of bytes written
   return ( dataLength );
 }
@@ -325,145 +469,574 @@ unsigned int JPEGCompressor::Finish( unsigned char* output )
 
 unsigned int JPEGCompressor::Compress( RawTile& rawtile )
 {
-  // Do some initialisation
+  // Make sure we only try to compress images with 1 or 3 channels
+  if( ! ( (rawtile.channels==1) || (rawtile.channels==3) ) ){
+    throw string( "JPEGCompressor: JPEG can only handle images of either 1 or 3 channels" );
+  }
+
+  // JPEG can only handle 8 bit data
+  if( rawtile.bpc != 8 ) throw string( "JPEGCompressor: JPEG can only handle 8 bit images" );
+
   data = (unsigned char*) rawtile.data;
+
+#ifdef HAVE_TURBOJPEG
+  return CompressTurboJPEG( rawtile );
+#endif
+
+  // Calculate our metadata storage requirements
+  unsigned int metadata_size =
+    (icc.size()>0 ? (icc.size()+ICC_OVERHEAD_LEN) : 0) +
+    (xmp.size()>0 ? (xmp.size()+XMP_PREFIX_SIZE) : 0);
+
+  // Take an output buffer from our pool with enough memory for our compressed output data
+  // - compressed images at overly high quality factors can be larger than raw data
+  size_t output_size = (size_t)( rawtile.width*rawtile.height*rawtile.channels*1.5 ) + metadata_size;
+  unsigned char* output = acquire_buffer( output_size );
+  dest = NULL;
+
+  try{
+
+    setup( rawtile, 0, output, output_size, true );
+
+    // Send the tile data
+    int row_stride = width * channels;
+
+    // Compress the image line by line
+    JSAMPROW row[1];
+    while( cinfo->next_scanline < cinfo->image_height ){
+      row[0] = &data[ cinfo->next_scanline * row_stride ];
+      jpeg_write_scanlines( cinfo, row, 1 );
+    }
+
+    // Tidy up and get the compressed data size
+    jpeg_finish_compress( cinfo );
+
+  }
+  catch( ... ){
+    release_buffer( dest ? dest->source : output, dest ? dest->source_size : output_size );
+    throw;
+  }
+
+  // Check that we have enough memory in our Rawtile for the JPEG data.
+  // This can happen on small tiles with high quality factors. If so delete and reallocate memory.
+  unsigned long dataLength;
+  dataLength = dest->written;
+  if( dataLength > rawtile.dataLength ){
+    delete[] (unsigned char*) rawtile.data;
+    rawtile.data = new unsigned char[dataLength];
+  }
+
+  // Copy memory back to the tile and return our output buffer to our pool
+  memcpy( rawtile.data, dest->source, dataLength );
+  release_buffer( dest->source, dest->source_size );
+
+
+  // Set the tile compression parameters
+  rawtile.dataLength = dataLength;
+  rawtile.compressionType = JPEG;
+  rawtile.quality = Q;
+
+
+  // Return the size of the data we have compressed
+  return dataLength;
+
+}
+
+
+
+// Append a JPEG marker segment to a string of raw marker data
+static void append_marker( string& markers, int code, const string& prefix, const char* data, size_t length )
+{
+  size_t size = prefix.size() + length + 2;
+  markers += (char) 0xFF;
+  markers += (char) code;
+  markers += (char) ((size >> 8) & 0xFF);
+  markers += (char) (size & 0xFF);
+  markers += prefix;
+  markers.append( data, length );
+}
+
+
+
+// Offset of the next marker segment in a JPEG stream or 0 if there is none
+static size_t next_segment( const string& jpeg, size_t offset )
+{
+  if( offset + 4 > jpeg.size() || (unsigned char) jpeg[offset] != 0xFF ) return 0;
+  return offset + 2 + (((unsigned char) jpeg[offset+2] << 8) | (unsigned char) jpeg[offset+3]);
+}
+
+
+
+string JPEGCompressor::getMetadataSegments()
+{
+  string markers;
+  append_marker( markers, JPEG_COM, "", "Generated by IIPImage", 21 );
+
+  if( icc.size() > 0 ){
+    unsigned int num_markers = (icc.size() + MAX_DATA_BYTES_IN_MARKER - 1) / MAX_DATA_BYTES_IN_MARKER;
+    for( unsigned int n = 0; n < num_markers; n++ ){
+      size_t offset = (size_t) n * MAX_DATA_BYTES_IN_MARKER;
+      size_t chunk = icc.size() - offset;
+      if( chunk > MAX_DATA_BYTES_IN_MARKER ) chunk = MAX_DATA_BYTES_IN_MARKER;
+      string prefix( "ICC_PROFILE\0", 12 );
+      prefix += (char) (n + 1);
+      prefix += (char) num_markers;
+      append_marker( markers, ICC_MARKER, prefix, icc.data() + offset, chunk );
+    }
+  }
+
+  if( xmp.size() > 0 && xmp.size() <= (65533-XMP_PREFIX_SIZE) ){
+    append_marker( markers, JPEG_APP0+1, string( "http://ns.adobe.com/xap/1.0/\0", XMP_PREFIX_SIZE ), xmp.data(), xmp.size() );
+  }
+
+  return markers;
+}
+
+
+
+void JPEGCompressor::encodeBand( const unsigned char* input, unsigned int h, string& output )
+{
+  struct jpeg_compress_struct band;
   struct jpeg_error_mgr jerr;
-  iip_destination_mgr dest_mgr;
-  iip_dest_ptr dest = &dest_mgr;
+  iip_destination_mgr band_dest;
+
+  band.err = jpeg_std_error( &jerr );
+  setup_error_functions( &band );
+  jpeg_create_compress( &band );
+
+  // Our output buffers are taken from the pool of the thread encoding this band
+  band_dest.pub.init_destination = iip_init_destination;
+  band_dest.pub.empty_output_buffer = iip_empty_output_buffer;
+  band_dest.pub.term_destination = iip_term_destination;
+  band_dest.strip_height = 0;
+  band_dest.source_size = (size_t) width * h * channels / 4 + MX;
+  band_dest.source = acquire_buffer( band_dest.source_size );
+  band_dest.pooled = true;
+  band.dest = (struct jpeg_destination_mgr*) &band_dest;
+
+  try{
+    band.image_width = width;
+    band.image_height = h;
+    band.input_components = channels;
+    band.in_color_space = ( channels == 3 ? JCS_RGB : JCS_GRAYSCALE );
+    jpeg_set_defaults( &band );
+    band.dct_method = JDCT_FASTEST;
+    jpeg_set_quality( &band, Q, TRUE );
+    if( channels == 3 ){
+      band.comp_info[0].h_samp_factor = (subsampling == 444) ? 1 : 2;
+      band.comp_info[0].v_samp_factor = (subsampling == 420) ? 2 : 1;
+    }
+    band.X_density = round( dpi_x );
+    band.Y_density = round( dpi_y );
+    band.density_unit = dpi_units;
 
+    jpeg_start_compress( &band, TRUE );
 
-  // Set up the correct width and height for this particular tile
+    JSAMPROW row[1];
+    unsigned int row_stride = width * channels;
+    while( band.next_scanline < band.image_height ){
+      row[0] = (JSAMPROW) &input[ (size_t) band.next_scanline * row_stride ];
+      jpeg_write_scanlines( &band, row, 1 );
+    }
+    jpeg_finish_compress( &band );
+  }
+  catch( ... ){
+    release_buffer( band_dest.source, band_dest.source_size );
+    jpeg_destroy_compress( &band );
+    throw;
+  }
+
+  output.assign( (const char*) band_dest.source, band_dest.written );
+  release_buffer( band_dest.source, band_dest.source_size );
+  jpeg_destroy_compress( &band );
+}
+
+
+
+/*
+  Large images are split into horizontal bands whose height is a multiple of the MCU height. Each band
+  is encoded independently on its own thread and, as both the DC prediction and the entropy coder are reset
+  at a restart marker, the entropy coded data of the bands can simply be joined with RSTn markers. The header
+  is taken from the first band with its height set to that of the full image and a DRI marker giving the
+  number of MCUs in a band. All bands use the same standard tables, so optimized Huffman coding is not possible
+*/
+bool JPEGCompressor::compressParallel( const RawTile& rawtile, int nthreads )
+{
+#ifdef _OPENMP
   width = rawtile.width;
   height = rawtile.height;
   channels = rawtile.channels;
 
-
-  // Make sure we only try to compress images with 1 or 3 channels
-  if( ! ( (channels==1) || (channels==3) ) ){
-    throw string( "JPEGCompressor: JPEG can only handle images of either 1 or 3 channels" );
+  // MCU dimensions for our chroma subsampling
+  unsigned int mcu_width = (channels == 3 && subsampling != 444) ? 16 : 8;
+  unsigned int mcu_height = (channels == 3 && subsampling == 420) ? 16 : 8;
+  unsigned int mcus_per_row = (width + mcu_width - 1) / mcu_width;
+  unsigned int mcu_rows = (height + mcu_height - 1) / mcu_height;
+
+  // Divide our MCU rows evenly between our threads, but keep our restart interval within 16 bits
+  unsigned int band_mcu_rows = (mcu_rows + nthreads - 1) / nthreads;
+  if( band_mcu_rows < MIN_BAND_MCU_ROWS ) band_mcu_rows = MIN_BAND_MCU_ROWS;
+  if( band_mcu_rows * mcus_per_row > 65535 ) band_mcu_rows = 65535 / mcus_per_row;
+  if( band_mcu_rows == 0 || band_mcu_rows >= mcu_rows ) return false;
+
+  unsigned int band_height = band_mcu_rows * mcu_height;
+  int nbands = (height + band_height - 1) / band_height;
+
+  vector<string> bands( nbands );
+  const unsigned char* input = (const unsigned char*) rawtile.data;
+  string error;
+
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+  for( int n = 0; n < nbands; n++ ){
+    unsigned int y = n * band_height;
+    unsigned int h = (y + band_height > height) ? height - y : band_height;
+    try{
+      encodeBand( &input[ (size_t) y * width * channels ], h, bands[n] );
+    }
+    catch( const string& e ){
+#pragma omp critical(jpegband)
+      error = e;
+    }
   }
 
-  // JPEG can only handle 8 bit data
-  if( rawtile.bpc != 8 ) throw string( "JPEGCompressor: JPEG can only handle 8 bit images" );
+  if( !error.empty() ) throw error;
 
-  // We set up the normal JPEG error routines, then override error_exit.
-  cinfo.err = jpeg_std_error( &jerr );
 
+  // Find the scan header in each band: the entropy coded data follows it up to the final EOI marker
+  vector<size_t> scan( nbands );
+  for( int n = 0; n < nbands; n++ ){
+    size_t offset = 2;
+    while( offset && offset + 4 <= bands[n].size() && (unsigned char) bands[n][offset+1] != 0xDA ){
+      offset = next_segment( bands[n], offset );
+    }
+    scan[n] = next_segment( bands[n], offset );
+    if( !scan[n] || scan[n] + 2 > bands[n].size() ) throw string( "JPEGCompressor: Unable to parse encoded band" );
+  }
 
-  // Override the error_exit function with our own.
-  // Hmmm, we have to do this assignment in C due to the strong type checking of C++
-  //  or something like that. So, we use an extern "C" function declared at the top
-  //  of this file and pass our arguments through this. I'm sure there's a better
-  //  way of doing this, but this seems to work :/
 
-  //   cinfo.err.error_exit = iip_error_exit;
-  setup_error_functions( &cinfo );
+  // Build our header from that of our first band
+  const string& first = bands[0];
+  string output( first, 0, 2 );
+  size_t offset = 2;
+  bool metadata = false;
 
-  jpeg_create_compress( &cinfo );
+  while( offset < scan[0] ){
+    size_t next = next_segment( first, offset );
+    unsigned char marker = first[offset+1];
 
+    // Add our metadata after any JFIF marker
+    if( !metadata && marker != JPEG_APP0 ){
+      output += getMetadataSegments();
+      metadata = true;
+    }
 
-  /* The destination object is made permanent so that multiple JPEG images
-   * can be written to the same file without re-executing jpeg_stdio_dest.
-   * This makes it dangerous to use this manager and a different destination
-   * manager serially with the same JPEG object, because their private object
-   * sizes may be different.  Caveat programmer.
-   */
-  if( !cinfo.dest ){
+    // Insert our restart interval before the scan header
+    if( marker == 0xDA ){
+      string dri( "\xFF\xDD\x00\x04", 4 );
+      dri += (char) (((band_mcu_rows * mcus_per_row) >> 8) & 0xFF);
+      dri += (char) ((band_mcu_rows * mcus_per_row) & 0xFF);
+      output += dri;
+    }
 
-    // first time for this JPEG object?
-    cinfo.dest = ( struct jpeg_destination_mgr* )
-      ( *cinfo.mem->alloc_small )
-      ( (j_common_ptr) &cinfo, JPOOL_PERMANENT, sizeof( iip_destination_mgr ) );
-  }
+    size_t start = output.size();
+    output.append( first, offset, next - offset );
 
+    // Set the full image height in the frame header
+    if( marker == 0xC0 ){
+      output[start+5] = (char) ((height >> 8) & 0xFF);
+      output[start+6] = (char) (height & 0xFF);
+    }
 
-  dest = (iip_dest_ptr) cinfo.dest;
-  dest->pub.init_destination = iip_init_destination;
-  dest->pub.empty_output_buffer = iip_empty_output_buffer;
-  dest->pub.term_destination = iip_term_destination;
-  dest->strip_height = 0;
+    offset = next;
+  }
 
-  // Calculate our metadata storage requirements
-  unsigned int metadata_size =
-    (icc.size()>0 ? (icc.size()+ICC_OVERHEAD_LEN) : 0) +
-    (xmp.size()>0 ? (xmp.size()+XMP_PREFIX_SIZE) : 0);
+  // Join the entropy coded data of each band with restart markers
+  for( int n = 0; n < nbands; n++ ){
+    if( n > 0 ){
+      output += (char) 0xFF;
+      output += (char) (0xD0 + ((n-1) % 8));
+    }
+    output.append( bands[n], scan[n], bands[n].size() - scan[n] - 2 );
+    string().swap( bands[n] );
+  }
 
-  // Allocate enough memory for our compressed output data
-  // - compressed images at overly high quality factors can be larger than raw data
-  unsigned long output_size = (unsigned long)( (unsigned int)(width*height*channels*1.5) + metadata_size );
-  dest->source = new unsigned char[output_size]; // Add some extra buffering
-  dest->source_size = output_size;
+  output += (char) 0xFF;
+  output += (char) 0xD9;
 
-  // Set image information
-  cinfo.image_width = width;
-  cinfo.image_height = height;
-  cinfo.input_components = channels;
-  cinfo.in_color_space = ( channels == 3 ? JCS_RGB : JCS_GRAYSCALE );
-  jpeg_set_defaults( &cinfo );
+  header = new unsigned char[output.size()];
+  memcpy( header, output.data(), output.size() );
+  header_size = output.size();
 
-  // Set our physical output resolution (JPEG only supports integers)
-  cinfo.X_density = round( dpi_x );
-  cinfo.Y_density = round( dpi_y );
-  cinfo.density_unit = dpi_units;
-  
-  // Set compression quality (fastest, but possibly slower depending
-  //  on hardware) - must do this after we've set the defaults!
-  cinfo.dct_method = JDCT_FASTEST;
+  return true;
+#else
+  return false;
+#endif
+}
 
-  jpeg_set_quality( &cinfo, Q, TRUE );
 
-  jpeg_start_compress( &cinfo, TRUE );
-  
-  // Add an identifying comment
-  jpeg_write_marker( &cinfo, JPEG_COM, (const JOCTET*) "Generated by IIPImage", 21 );
 
-  // Embed ICC profile if one is supplied
-  writeICCProfile();
+#ifdef HAVE_TURBOJPEG
 
-  // Add XMP metadata
-  writeXMPMetadata();
+unsigned int JPEGCompressor::CompressTurboJPEG( RawTile& rawtile )
+{
+  width = rawtile.width;
+  height = rawtile.height;
+  channels = rawtile.channels;
 
-  // Send the tile data
-  int row_stride = width * channels;
+  if( !worker_tj ){
+    if( (worker_tj = tj3Init( TJINIT_COMPRESS )) == NULL ){
+      throw string( "JPEGCompressor: Unable to initialize TurboJPEG: " ) + tj3GetErrorStr( NULL );
+    }
+  }
 
-  // Compress the image line by line
-  JSAMPROW row[1];
-  while( cinfo.next_scanline < cinfo.image_height ){
-    row[0] = &data[ cinfo.next_scanline * row_stride ];
-    jpeg_write_scanlines( &cinfo, row, 1 );
+  int subsamp = TJSAMP_GRAY;
+  if( channels == 3 ) subsamp = (subsampling == 444) ? TJSAMP_444 : ( (subsampling == 422) ? TJSAMP_422 : TJSAMP_420 );
+
+  tj3Set( worker_tj, TJPARAM_QUALITY, (Q < 1) ? 1 : Q );
+  tj3Set( worker_tj, TJPARAM_SUBSAMP, subsamp );
+  tj3Set( worker_tj, TJPARAM_OPTIMIZE, optimize ? 1 : 0 );
+  tj3Set( worker_tj, TJPARAM_FASTDCT, 1 );
+  tj3Set( worker_tj, TJPARAM_XDENSITY, (int) round( dpi_x ) );
+  tj3Set( worker_tj, TJPARAM_YDENSITY, (int) round( dpi_y ) );
+  tj3Set( worker_tj, TJPARAM_DENSITYUNITS, dpi_units );
+
+  // Compress directly into a buffer from our pool, which is guaranteed to be large enough
+  tj3Set( worker_tj, TJPARAM_NOREALLOC, 1 );
+  size_t output_size = tj3JPEGBufSize( width, height, subsamp );
+  unsigned char* output = acquire_buffer( output_size );
+  size_t length = output_size;
+
+  if( tj3Compress8( worker_tj, data, width, 0, height, (channels == 3) ? TJPF_RGB : TJPF_GRAY, &output, &length ) == -1 ){
+    release_buffer( output, output_size );
+    throw string( "JPEGCompressor: " ) + tj3GetErrorStr( worker_tj );
   }
 
-  // Tidy up, get the compressed data size and de-allocate memory
-  jpeg_finish_compress( &cinfo );
+  // TurboJPEG cannot write our own markers, so build our comment, ICC and XMP segments separately
+  string markers = getMetadataSegments();
 
-  // Check that we have enough memory in our Rawtile for the JPEG data.
-  // This can happen on small tiles with high quality factors. If so delete and reallocate memory.
-  unsigned long dataLength;
-  dataLength = dest->written;
+  // Our segments are placed after the SOI and JFIF APP0 markers as with the libjpeg encoder
+  size_t position = 2;
+  if( length > 6 && output[2] == 0xFF && output[3] == JPEG_APP0 ){
+    position = 4 + ((output[4] << 8) | output[5]);
+  }
+
+  unsigned long dataLength = length + markers.size();
   if( dataLength > rawtile.dataLength ){
     delete[] (unsigned char*) rawtile.data;
     rawtile.data = new unsigned char[dataLength];
   }
-  
-  // Copy memory back to the tile
-  memcpy( rawtile.data, dest->source, dataLength );
-  delete[] dest->source;
-  jpeg_destroy_compress( &cinfo );
 
+  unsigned char* d = (unsigned char*) rawtile.data;
+  memcpy( d, output, position );
+  memcpy( d + position, markers.data(), markers.size() );
+  memcpy( d + position + markers.size(), output + position, length - position );
+  release_buffer( output, output_size );
 
   // Set the tile compression parameters
   rawtile.dataLength = dataLength;
   rawtile.compressionType = JPEG;
   rawtile.quality = Q;
 
-
-  // Return the size of the data we have compressed
   return dataLength;
+}
+
+#endif
+
+
+// Transform a single block of DCT coefficients: transposing a block transposes its coefficients, while
+// mirroring it inverts the sign of the coefficients with odd horizontal or vertical frequencies
+static void transform_block( const JCOEF* in, JCOEF* out, bool transpose, bool mirror_h, bool mirror_v )
+{
+  for( int v = 0; v < DCTSIZE; v++ ){
+    for( int u = 0; u < DCTSIZE; u++ ){
+      JCOEF c = transpose ? in[u*DCTSIZE+v] : in[v*DCTSIZE+u];
+      if( (mirror_h && (u & 1)) != (mirror_v && (v & 1)) ) c = -c;
+      out[v*DCTSIZE+u] = c;
+    }
+  }
+}
 
+
+
+/*
+  Any combination of flips and rotations by multiples of 90 degrees can be expressed as an optional
+  transposition followed by horizontal and/or vertical mirroring. These are carried out on the quantized
+  DCT coefficients in the same way as jpegtran, by moving blocks and transforming the coefficients within
+  each block. A partial MCU at the right or bottom edge of our tile cannot be moved to the left or top,
+  so we give up in that case and leave it to the caller to transform the decoded tile instead.
+  For greyscale output, the luminance component of a YCbCr JPEG is written on its own with its own
+  quantization table. Its blocks form single block MCUs, so only need to be moved in whole blocks
+*/
+bool JPEGCompressor::transform( RawTile& rawtile, int rotation, int flip, bool greyscale )
+{
+  if( rawtile.compressionType != JPEG ) return false;
+
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+
+  // Our flip is applied before our rotation
+  bool transpose = (rotation == 90 || rotation == 270);
+  bool mirror_h = (rotation == 90 || rotation == 180) != (transpose ? (flip == 2) : (flip == 1));
+  bool mirror_v = (rotation == 180 || rotation == 270) != (transpose ? (flip == 1) : (flip == 2));
+  if( !transpose && !mirror_h && !mirror_v && !greyscale ) return true;
+
+  struct jpeg_decompress_struct src;
+  struct jpeg_compress_struct dst;
+  struct jpeg_error_mgr src_err, dst_err;
+  iip_destination_mgr transform_dest;
+  bool perfect = false;
+
+  src.err = jpeg_std_error( &src_err );
+  src_err.error_exit = iip_error_exit;
+  jpeg_create_decompress( &src );
+  dst.err = jpeg_std_error( &dst_err );
+  dst_err.error_exit = iip_error_exit;
+  jpeg_create_compress( &dst );
+  transform_dest.source = NULL;
+
+  try{
+    jpeg_mem_src( &src, (unsigned char*) rawtile.data, rawtile.dataLength );
+
+    // Keep our comment, ICC profile, XMP and any other metadata
+    jpeg_save_markers( &src, JPEG_COM, 0xFFFF );
+    for( int m = 0; m < 16; m++ ) jpeg_save_markers( &src, JPEG_APP0 + m, 0xFFFF );
+    jpeg_read_header( &src, TRUE );
+
+    // Greyscale images are already greyscale, but colour images can only be converted if they are YCbCr
+    bool grey = ( greyscale && src.num_components == 3 );
+
+    // Dimensions of our transformed image and of its MCUs
+    unsigned int w = transpose ? src.image_height : src.image_width;
+    unsigned int h = transpose ? src.image_width : src.image_height;
+    unsigned int mcu_w = grey ? DCTSIZE : DCTSIZE * (transpose ? src.max_v_samp_factor : src.max_h_samp_factor);
+    unsigned int mcu_h = grey ? DCTSIZE : DCTSIZE * (transpose ? src.max_h_samp_factor : src.max_v_samp_factor);
+    perfect = !( (mirror_h && w % mcu_w) || (mirror_v && h % mcu_h) ) &&
+      !( greyscale && !grey && src.num_components != 1 ) && !( grey && src.jpeg_color_space != JCS_YCbCr );
+
+    if( perfect ){
+
+      // Our destination coefficient arrays must be requested before the source coefficients are read
+      int nc = grey ? 1 : src.num_components;
+      vector<jvirt_barray_ptr> dst_coef( nc );
+      vector<JDIMENSION> cols( nc ), rows( nc ), blocks_x( nc ), blocks_y( nc );
+      for( int c = 0; c < nc; c++ ){
+	jpeg_component_info* comp = &src.comp_info[c];
+	int h_samp = grey ? 1 : ( transpose ? comp->v_samp_factor : comp->h_samp_factor );
+	int v_samp = grey ? 1 : ( transpose ? comp->h_samp_factor : comp->v_samp_factor );
+	blocks_x[c] = transpose ? comp->height_in_blocks : comp->width_in_blocks;
+	blocks_y[c] = transpose ? comp->width_in_blocks : comp->height_in_blocks;
+	cols[c] = (blocks_x[c] + h_samp - 1) / h_samp * h_samp;
+	rows[c] = (blocks_y[c] + v_samp - 1) / v_samp * v_samp;
+	dst_coef[c] = (*src.mem->request_virt_barray)( (j_common_ptr) &src, JPOOL_IMAGE, FALSE, cols[c], rows[c], v_samp );
+      }
+
+      jvirt_barray_ptr* src_coef = jpeg_read_coefficients( &src );
+
+      jpeg_copy_critical_parameters( &src, &dst );
+      dst.image_width = w;
+      dst.image_height = h;
+      if( grey ){
+	jpeg_set_colorspace( &dst, JCS_GRAYSCALE );
+	dst.comp_info[0].quant_tbl_no = src.comp_info[0].quant_tbl_no;
+      }
+      if( transpose ){
+	for( int c = 0; c < nc; c++ ){
+	  int s = dst.comp_info[c].h_samp_factor;
+	  dst.comp_info[c].h_samp_factor = dst.comp_info[c].v_samp_factor;
+	  dst.comp_info[c].v_samp_factor = s;
+	}
+	UINT16 d = dst.X_density;
+	dst.X_density = dst.Y_density;
+	dst.Y_density = d;
+	// Our quantization tables must also be transposed along with our coefficients
+	for( int q = 0; q < NUM_QUANT_TBLS; q++ ){
+	  JQUANT_TBL* table = dst.quant_tbl_ptrs[q];
+	  if( !table ) continue;
+	  for( int i = 0; i < DCTSIZE; i++ ){
+	    for( int j = i + 1; j < DCTSIZE; j++ ){
+	      UINT16 v = table->quantval[i*DCTSIZE+j];
+	      table->quantval[i*DCTSIZE+j] = table->quantval[j*DCTSIZE+i];
+	      table->quantval[j*DCTSIZE+i] = v;
+	    }
+	  }
+	}
+      }
+      dst.optimize_coding = optimize ? TRUE : FALSE;
+
+      // Mirrored axes contain only whole blocks, so padding blocks are only ever found at the right and bottom
+      for( int c = 0; c < nc; c++ ){
+	for( JDIMENSION y = 0; y < rows[c]; y++ ){
+	  JBLOCKARRAY out = (*src.mem->access_virt_barray)( (j_common_ptr) &src, dst_coef[c], y, 1, TRUE );
+	  JDIMENSION my = mirror_v ? blocks_y[c] - 1 - y : y;
+	  for( JDIMENSION x = 0; x < cols[c]; x++ ){
+	    JDIMENSION mx = mirror_h ? blocks_x[c] - 1 - x : x;
+	    JDIMENSION sx = transpose ? my : mx;
+	    JDIMENSION sy = transpose ? mx : my;
+	    JBLOCKARRAY in = (*src.mem->access_virt_barray)( (j_common_ptr) &src, src_coef[c], sy, 1, FALSE );
+	    transform_block( in[0][sx], out[0][x], transpose, mirror_h, mirror_v );
+	  }
+	}
+      }
+
+      transform_dest.pub.init_destination = iip_init_destination;
+      transform_dest.pub.empty_output_buffer = iip_empty_output_buffer;
+      transform_dest.pub.term_destination = iip_term_destination;
+      transform_dest.strip_height = 0;
+      transform_dest.source_size = rawtile.dataLength + MX;
+      transform_dest.source = new unsigned char[transform_dest.source_size];
+      transform_dest.pooled = false;
+      dst.dest = (struct jpeg_destination_mgr*) &transform_dest;
+
+      jpeg_write_coefficients( &dst, &dst_coef[0] );
+
+      // Copy our markers, skipping any JFIF or Adobe markers as these are written by libjpeg itself.
+      // A colour ICC profile is not valid for a greyscale image
+      for( jpeg_saved_marker_ptr m = src.marker_list; m; m = m->next ){
+	if( dst.write_JFIF_header && m->marker == JPEG_APP0 && m->data_length >= 5 &&
+	    memcmp( m->data, "JFIF", 5 ) == 0 ) continue;
+	if( (dst.write_Adobe_marker || grey) && m->marker == JPEG_APP0 + 14 && m->data_length >= 5 &&
+	    memcmp( m->data, "Adobe", 5 ) == 0 ) continue;
+	if( grey && m->marker == ICC_MARKER && m->data_length >= 12 &&
+	    memcmp( m->data, "ICC_PROFILE", 12 ) == 0 ) continue;
+	jpeg_write_marker( &dst, m->marker, m->data, m->data_length );
+      }
+
+      jpeg_finish_compress( &dst );
+      jpeg_finish_decompress( &src );
+    }
+  }
+  catch( ... ){
+    delete[] transform_dest.source;
+    jpeg_destroy_compress( &dst );
+    jpeg_destroy_decompress( &src );
+    throw;
+  }
+
+  jpeg_destroy_compress( &dst );
+  jpeg_destroy_decompress( &src );
+
+  if( !perfect ) return false;
+
+  if( rawtile.memoryManaged ) delete[] (unsigned char*) rawtile.data;
+  rawtile.data = transform_dest.source;
+  rawtile.dataLength = transform_dest.written;
+  rawtile.memoryManaged = 1;
+  if( greyscale ) rawtile.channels = 1;
+  if( transpose ){
+    unsigned int t = rawtile.width;
+    rawtile.width = rawtile.height;
+    rawtile.height = t;
+  }
+
+  return true;
+
+#else
+  return false;
+#endif
 }
 
 
 
+
 // Write ICC profile into JPEG header if profile has been set
 // Function *must* be called AFTER calling jpeg_start_compress() and BEFORE
 // the first call to jpeg_write_scanlines().
@@ -501,32 +1074,32 @@ void JPEGCompressor::writeICCProfile()
     icc_data_len -= length;
     
     // Write the JPEG marker header (APP2 code and marker length)
-    jpeg_write_m_header( &cinfo, ICC_MARKER,
+    jpeg_write_m_header( cinfo, ICC_MARKER,
 			 (unsigned int) (length + ICC_OVERHEAD_LEN) );
 
     // Write the marker identifying string "ICC_PROFILE" (null-terminated).
     // We code it in this less-than-transparent way so that the code works
     // even if the local character set is not ASCII.
-    jpeg_write_m_byte(&cinfo, 0x49);
-    jpeg_write_m_byte(&cinfo, 0x43);
-    jpeg_write_m_byte(&cinfo, 0x43);
-    jpeg_write_m_byte(&cinfo, 0x5F);
-    jpeg_write_m_byte(&cinfo, 0x50);
-    jpeg_write_m_byte(&cinfo, 0x52);
-    jpeg_write_m_byte(&cinfo, 0x4F);
-    jpeg_write_m_byte(&cinfo, 0x46);
-    jpeg_write_m_byte(&cinfo, 0x49);
-    jpeg_write_m_byte(&cinfo, 0x4C);
-    jpeg_write_m_byte(&cinfo, 0x45);
-    jpeg_write_m_byte(&cinfo, 0x0);
+    jpeg_write_m_byte(cinfo, 0x49);
+    jpeg_write_m_byte(cinfo, 0x43);
+    jpeg_write_m_byte(cinfo, 0x43);
+    jpeg_write_m_byte(cinfo, 0x5F);
+    jpeg_write_m_byte(cinfo, 0x50);
+    jpeg_write_m_byte(cinfo, 0x52);
+    jpeg_write_m_byte(cinfo, 0x4F);
+    jpeg_write_m_byte(cinfo, 0x46);
+    jpeg_write_m_byte(cinfo, 0x49);
+    jpeg_write_m_byte(cinfo, 0x4C);
+    jpeg_write_m_byte(cinfo, 0x45);
+    jpeg_write_m_byte(cinfo, 0x0);
 
     // Add the sequencing info
-    jpeg_write_m_byte( &cinfo, cur_marker );
-    jpeg_write_m_byte( &cinfo, (int) num_markers );
+    jpeg_write_m_byte( cinfo, cur_marker );
+    jpeg_write_m_byte( cinfo, (int) num_markers );
 
     // Write the profile data byte by byte
     while( length-- ){
-      jpeg_write_m_byte(&cinfo, *icc_data_ptr);
+      jpeg_write_m_byte(cinfo, *icc_data_ptr);
       icc_data_ptr++;
     }
     cur_marker++;
@@ -549,5 +1122,5 @@ void JPEGCompressor::writeXMPMetadata()
   snprintf( xmpstr, 65536, XMP_PREFIX, '\0', xmp.c_str() );
 
   // Can't use regular addMetadata, because of the zero term after the namespace id; and the APP1 marker
-  jpeg_write_marker( &cinfo, JPEG_APP0+1, (const JOCTET*) xmpstr, XMP_PREFIX_SIZE + xmp.size() );
+  jpeg_write_marker( cinfo, JPEG_APP0+1, (const JOCTET*) xmpstr, XMP_PREFIX_SIZE + xmp.size() );
 }
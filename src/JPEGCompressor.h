@@ -50,6 +50,7 @@ typedef struct {
   size_t source_size;                ///< size of output buffer
   size_t written;                    ///< number of bytes written to buffer
   unsigned int strip_height;         ///< used for stream-based encoding
+  bool pooled;                       ///< whether our output buffer belongs to our buffer pool
 
 } iip_destination_mgr;
 typedef iip_destination_mgr * iip_dest_ptr;
@@ -67,24 +68,73 @@ class JPEGCompressor: public Compressor{
   /// Buffer for the image data
   unsigned char *data;
 
-  /// JPEG library objects
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-  iip_destination_mgr dest_mgr;
+  /// Chroma subsampling for colour images: 444, 422 or 420
+  int subsampling;
+
+  /// Whether to generate optimized Huffman tables
+  bool optimize;
+
+  /// Number of threads for parallel strip based encoding (0 for the OpenMP default)
+  int threads;
+
+  /// Whether our strip based encoding has been carried out in parallel by InitCompression
+  bool parallel;
+
+  /// JPEG library objects: our compression object is kept alive between images on each thread
+  j_compress_ptr cinfo;
   iip_dest_ptr dest;
 
+  /// Set up our thread's compression object for a new image and write the JPEG header
+  /** @param rawtile tile containing the image to be compressed
+      @param strip_height pixel height of strips for strip based encoding or 0 for whole images
+      @param output output buffer for our header and any compressed data
+      @param output_size size of output buffer
+      @param pooled whether our output buffer was taken from our buffer pool
+   */
+  void setup( const RawTile& rawtile, unsigned int strip_height, unsigned char* output, size_t output_size, bool pooled );
+
   /// Write ICC profile
   void writeICCProfile();
 
   /// Write XMP metadata
   void writeXMPMetadata();
 
+  /// Get our comment, ICC profile and XMP metadata as raw JPEG marker segments
+  std::string getMetadataSegments();
+
+  /// Encode a band of scanlines as a separate baseline JPEG with our current settings
+  /** Safe to call concurrently as each call uses its own compression object
+      @param data image data for the band
+      @param h height of the band
+      @param output encoded JPEG
+   */
+  void encodeBand( const unsigned char* data, unsigned int h, std::string& output );
+
+  /// Encode an entire image in parallel as horizontal bands joined with restart markers
+  /** @param rawtile tile containing the image to be compressed
+      @param nthreads number of threads to use
+      @return whether the image could be encoded in parallel
+   */
+  bool compressParallel( const RawTile& rawtile, int nthreads );
+
+#ifdef HAVE_TURBOJPEG
+  /// Compress an entire image using the TurboJPEG API
+  /** @param t tile of image data */
+  unsigned int CompressTurboJPEG( RawTile& t );
+#endif
+
 
  public:
 
   /// Constructor
-  /** @param quality JPEG Quality factor (0-100) */
-  JPEGCompressor( int quality ) { Q = quality; dest = NULL; header_size = 0; };
+  /** @param quality JPEG Quality factor (0-100)
+      @param s chroma subsampling for colour images: 444, 422 or 420
+      @param o whether to generate optimized Huffman tables
+   */
+  JPEGCompressor( int quality, int s = 420, bool o = false ) {
+    Q = quality; subsampling = s; optimize = o; threads = 1; parallel = false;
+    cinfo = NULL; dest = NULL; header = NULL; header_size = 0;
+  };
 
 
   /// Set the compression quality
@@ -100,6 +150,28 @@ class JPEGCompressor: public Compressor{
   inline int getQuality() { return Q; }
 
 
+  /// Get the chroma subsampling used for colour images
+  inline int getSubsampling() { return subsampling; }
+
+
+  /// Get whether optimized Huffman tables are generated
+  inline bool getOptimize() { return optimize; }
+
+
+  /// Set the number of threads used for strip based encoding of large images
+  /** @param t number of threads (0 for the OpenMP default) */
+  inline void setThreads( int t ) { threads = t; }
+
+
+  /// Create an independent compressor with the same settings
+  /** @return new compressor to be deleted by the caller */
+  Compressor* duplicate() {
+    JPEGCompressor* c = new JPEGCompressor( Q, subsampling, optimize );
+    copySettings( c );
+    return c;
+  };
+
+
   /// Initialise strip based compression
   /** If we are doing a strip based encoding, we need to first initialise
       with InitCompression, then compress a single strip at a time using
@@ -127,6 +199,15 @@ class JPEGCompressor: public Compressor{
   /** @param t tile of image data */
   unsigned int Compress( RawTile& t );
 
+  /// Losslessly flip, rotate or convert to greyscale a JPEG compressed tile in the DCT domain without decoding it
+  /** @param t JPEG compressed tile, which is replaced by the transformed tile
+      @param rotation rotation in degrees: 0, 90, 180 or 270
+      @param flip 1 for a horizontal and 2 for a vertical flip, applied before the rotation
+      @param greyscale whether to keep only the luminance of a colour tile
+      @return false if the tile cannot be transformed losslessly, in which case it is left unchanged
+   */
+  bool transform( RawTile& t, int rotation, int flip, bool greyscale = false );
+
   /// Return the JPEG header size
   inline unsigned int getHeaderSize() { return header_size; }
 
@@ -27,7 +27,7 @@
 using namespace std;
 
 
-void JTL::send( Session* session, int resolution, int tile ){
+void JTL::send( Session* session, int resolution, int tile, unsigned int x, unsigned int y, unsigned int w, unsigned int h ){
 
   Timer function_timer;
 
@@ -43,6 +43,10 @@ void JTL::send( Session* session, int resolution, int tile ){
   if( session->loglevel >= 2 ) command_timer.start();
 
 
+  // Tiles of any other size or position are composed from our native tiles
+  bool retiled = ( w > 0 && h > 0 );
+
+
   // If we have requested a rotation, remap the tile index to rotated coordinates
   if( (int)((session->view)->getRotation()) % 360 == 90 ){
 
@@ -50,7 +54,7 @@ void JTL::send( Session* session, int resolution, int tile ){
   else if( (int)((session->view)->getRotation()) % 360 == 270 ){
 
   }
-  else if( (int)((session->view)->getRotation()) % 360 == 180 ){
+  else if( (int)((session->view)->getRotation()) % 360 == 180 && !retiled ){
     int num_res = (*session->image)->getNumResolutions();
     unsigned int im_width = (*session->image)->image_widths[num_res-resolution-1];
     unsigned int im_height = (*session->image)->image_heights[num_res-resolution-1];
@@ -75,6 +79,9 @@ void JTL::send( Session* session, int resolution, int tile ){
   if( session->view->output_format == JPEG ) compressor = session->jpeg;
 #ifdef HAVE_PNG
   else if( session->view->output_format == PNG ) compressor = session->png;
+#endif
+#ifdef HAVE_WEBP
+  else if( session->view->output_format == WEBP ) compressor = session->webp;
 #endif
   else compressor = session->jpeg;
 
@@ -109,13 +116,33 @@ void JTL::send( Session* session, int resolution, int tile ){
 
 
 
+  // Only decode the channels that contribute to our output
+  (*session->image)->setChannelSubset( session->view->getChannelSubset( (*session->image)->getNumChannels() ) );
+
+
+  // Rotations by multiples of 90 degrees, flips and greyscale conversion of colour JPEG tiles
+  // can be carried out losslessly without decoding
+  float rotation = session->view->getRotation();
+  int angle = (int) rotation % 360;
+  bool transform = ( rotation != 0.0 || session->view->flip != 0 );
+  bool greyscale = ( session->view->colourspace == GREYSCALE && (*session->image)->getColourSpace() == sRGB &&
+		     (*session->image)->getNumChannels() == 3 && (*session->image)->getNumBitsPerPixel() == 8 );
+
+  // Binarization, histogram equalization and any floating point processing need decoded pixel data
+  bool binary = ( session->view->colourspace == BINARY && (*session->image)->getColourSpace() != BINARY );
+  bool pixel_ops = ( binary || session->view->floatProcessing() || session->view->equalization );
+
+  bool lossless = ( (transform || greyscale) && ct == JPEG && !retiled && !pixel_ops &&
+		    ( !transform || ( rotation == (float) (int) rotation &&
+				      ( angle == 0 || angle == 90 || angle == 180 || angle == 270 ) ) ) );
+
+
   // Request uncompressed tile if raw pixel data is required for processing
   if( (*session->image)->getNumBitsPerPixel() > 8 || (*session->image)->getColourSpace() == CIELAB
       || (*session->image)->getNumChannels() == 2 || (*session->image)->getNumChannels() > 3
       || ( (session->view->colourspace==GREYSCALE || session->view->colourspace==BINARY) && (*session->image)->getNumChannels()==3 &&
-	   (*session->image)->getNumBitsPerPixel()==8 )
-      || session->view->floatProcessing() || session->view->equalization
-      || session->view->getRotation() != 0.0 || session->view->flip != 0
+	   (*session->image)->getNumBitsPerPixel()==8 && !lossless )
+      || pixel_ops || ( transform && !lossless )
       ) ct = UNCOMPRESSED;
 
 
@@ -142,8 +169,36 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
-  RawTile rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
-					 session->view->yangle, session->view->getLayers(), ct );
+  RawTile rawtile = retiled ?
+    tilemanager.getRetiledTile( resolution, x, y, w, h, session->view->xangle, session->view->yangle, session->view->getLayers(), ct ) :
+    tilemanager.getTile( resolution, tile, session->view->xangle, session->view->yangle, session->view->getLayers(), ct );
+
+
+  // Flip, rotate or convert our JPEG tile to greyscale in the DCT domain. Tiles with partial MCUs that would need
+  // to be moved to the left or top edge cannot be transformed losslessly, so fall back to transforming the decoded tile
+  bool transformed = false;
+  if( lossless && ct == JPEG && rawtile.compressionType == JPEG ){
+    if( session->loglevel >= 4 ) function_timer.start();
+    transformed = session->jpeg->transform( rawtile, angle, session->view->flip, greyscale );
+    if( session->loglevel >= 4 ){
+      *(session->logfile) << "JTL :: " << ( transformed ? "Lossless" : "Unable to carry out lossless" )
+			  << " JPEG transformation in " << function_timer.getTime() << " microseconds" << endl;
+    }
+    if( !transformed ){
+      ct = UNCOMPRESSED;
+      rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
+				     session->view->yangle, session->view->getLayers(), ct );
+    }
+  }
+
+
+  // Let our prefetcher know about this access so that it can fetch the tiles likely to be requested next.
+  // Composed tiles are built from uncompressed native tiles, so prefetch those
+  if( session->prefetcher ){
+    session->prefetcher->record( *session->image, resolution, tile, session->view->xangle, session->view->yangle,
+				 session->view->getLayers(), retiled ? UNCOMPRESSED : ct, compressor->getQuality(),
+				 session->view->embedICC() && ((*session->image)->getMetadata("icc").size()>0) );
+  }
 
 
   int len = rawtile.dataLength;
@@ -303,9 +358,9 @@ void JTL::send( Session* session, int resolution, int tile ){
 
 
   // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image and have requested a JPEG tile
-  // For PNG, strip extra bands if we have more than 4 present
+  // For PNG and WebP, strip extra bands if we have more than 4 present
   if( ( (session->view->output_format == JPEG) && (rawtile.channels == 2 || rawtile.channels > 3) ) ||
-      ( (session->view->output_format == PNG) && (rawtile.channels > 4) ) ){
+      ( (session->view->output_format == PNG || session->view->output_format == WEBP) && (rawtile.channels > 4) ) ){
 
     unsigned int bands = (rawtile.channels==2) ? 1 : 3;
     if( session->loglevel >= 4 ){
@@ -320,7 +375,7 @@ void JTL::send( Session* session, int resolution, int tile ){
 
 
   // Convert to greyscale if requested
-  if( (*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE ){
+  if( (*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE && !transformed ){
     if( session->loglevel >= 4 ){
       *(session->logfile) << "JTL :: Converting to greyscale";
       function_timer.start();
@@ -359,7 +414,7 @@ void JTL::send( Session* session, int resolution, int tile ){
 
 
   // Apply flip
-  if( session->view->flip != 0 ){
+  if( session->view->flip != 0 && !transformed ){
     Timer flip_timer;
     if( session->loglevel >= 5 ){
       flip_timer.start();
@@ -377,7 +432,7 @@ void JTL::send( Session* session, int resolution, int tile ){
 
 
   // Apply rotation - can apply this safely after gamma and contrast adjustment
-  if( session->view->getRotation() != 0.0 ){
+  if( session->view->getRotation() != 0.0 && !transformed ){
     float rotation = session->view->getRotation();
     if( session->loglevel >= 4 ){
       *(session->logfile) << "JTL :: Rotating image by " << rotation << " degrees";
@@ -88,8 +88,7 @@ void JTL_Ext::send(Compressor *compressor,
     for (int i = 1; i < tileCount; i++) {
       out = out.join(imagesToAppend[i], VIPS_DIRECTION_VERTICAL, nullptr);
     }
-    CompressionType compressionType = compressor->getCompressionType();
-    string format = compressionType == JPEG ? ".jpg" : ".png";
+    string format = string(".") + compressor->getSuffix();
     out.write_to_buffer(format.c_str(), (void**) &buffer, &bufferSize, nullptr);
     if (session->loglevel >= 2) {
           *(session->logfile) << "JTLExt :: Append images finished in " << appendTimer.getTime() << " milliseconds." << endl;
@@ -149,8 +148,7 @@ void JTL_Ext::sendZip(Compressor *compressor,
    *(session->logfile) << "JTLExt :: Failed to open zip writer! Error: " << err << endl;
   }
 
-  CompressionType compressionType = compressor->getCompressionType();
-  string format = compressionType == JPEG ? ".jpg" : ".png";
+  string format = string(".") + compressor->getSuffix();
   int compressedI = 0;
   for (int i = 0; i < tileCount; i++) {
 
@@ -227,6 +225,51 @@ void JTL_Ext::sendZip(Compressor *compressor,
   session->response->setImageSent();
 }
 
+/// Physical output resolution and ICC profile with which a tile is encoded
+struct EncodingSettings
+{
+  float dpi_x, dpi_y;
+  int dpi_units;
+  string icc;
+
+  bool operator==(const EncodingSettings &s) const
+  {
+    return dpi_x == s.dpi_x && dpi_y == s.dpi_y && dpi_units == s.dpi_units && icc == s.icc;
+  }
+};
+
+/// Get the settings for a tile: the physical resolution scaled to its zoom level and the ICC profile of its image if requested
+static EncodingSettings encodingSettings(Session *session, const TileRequest &request)
+{
+  IIPImage *image = request.image;
+  int num_res = image->getNumResolutions();
+  unsigned int im_width = image->image_widths[num_res - request.resolution - 1];
+  unsigned int im_height = image->image_heights[num_res - request.resolution - 1];
+
+  EncodingSettings settings;
+  settings.dpi_x = image->dpi_x * (float)im_width / (float)image->getImageWidth();
+  settings.dpi_y = image->dpi_y * (float)im_height / (float)image->getImageHeight();
+  settings.dpi_units = image->dpi_units;
+  if (session->view->embedICC())
+    settings.icc = image->getMetadata("icc");
+  return settings;
+}
+
+/// Set up our compressor with a tile's settings
+static void applySettings(Session *session, Compressor *compressor, const EncodingSettings &settings)
+{
+  compressor->setResolution(settings.dpi_x, settings.dpi_y, settings.dpi_units);
+  compressor->setICCProfile(settings.icc);
+
+  if (session->loglevel >= 5) {
+    *(session->logfile) << "JTLExt :: Setting physical resolution of tile to " << settings.dpi_x << " x " << settings.dpi_y
+                        << ((settings.dpi_units == 1) ? " pixels/inch" : " pixels/cm") << endl;
+  }
+  if (session->loglevel >= 3 && settings.icc.size() > 0) {
+    *(session->logfile) << "JTLExt :: Embedding ICC profile with size " << settings.icc.size() << " bytes" << endl;
+  }
+}
+
 bool contains(const vector<int> &vector, int element)
 {
     bool result = false;
@@ -237,14 +280,18 @@ bool contains(const vector<int> &vector, int element)
     return result;
 }
 
-CompressedTile JTL_Ext::getTile(Session *session, int resolution, int tile)
+vector<CompressedTile> JTL_Ext::getTiles(Session *session, const vector<TileRequest> &tileRequests)
 {
   Timer function_timer;
+  vector<CompressedTile> compressedTiles;
 
   if (session->loglevel >= 3) {
     (*session->logfile) << "JTLExt handler reached" << endl;
   }
 
+  if (tileRequests.empty())
+    return compressedTiles;
+
   // Make sure we have set our image
   this->session = session;
   checkImage();
@@ -253,120 +300,175 @@ CompressedTile JTL_Ext::getTile(Session *session, int resolution, int tile)
   if (session->loglevel >= 2)
     command_timer.start();
 
-  // Sanity check
-  if ((resolution < 0) || (tile < 0)) {
-    ostringstream error;
-    error << "JTLExt :: Invalid resolution/tile number: " << resolution << "," << tile;
-    throw error.str();
-  }
-
   // Determine which output encoding to use
-  CompressionType ct = session->view->output_format;
   Compressor *compressor;
   if (session->view->output_format == PNG)
     compressor = session->png;
+#ifdef HAVE_WEBP
+  else if (session->view->output_format == WEBP)
+    compressor = session->webp;
+#endif
   else
     compressor = session->jpeg;
 
-  TileManager tilemanager(session->tileCache, *session->image, session->watermark, compressor, session->logfile, session->loglevel);
+  // Determine the compression to request for each tile
+  vector<TileRequest> requests(tileRequests);
+  vector<bool> greyscale(requests.size());
+  for (unsigned int n = 0; n < requests.size(); n++) {
 
-  // Request uncompressed tile if raw pixel data is required for processing
-  if ((*session->image)->getNumBitsPerPixel() > 8 || (*session->image)->getColourSpace() == CIELAB ||
-    (*session->image)->getNumChannels() == 2 || (*session->image)->getNumChannels() > 3 ||
-    ((session->view->colourspace == GREYSCALE || session->view->colourspace == BINARY)
-    && (*session->image)->getNumChannels() == 3 && (*session->image)->getNumBitsPerPixel() == 8) ||
-    session->view->floatProcessing() || session->view->equalization || session->view->getRotation() != 0.0 ||
-    session->view->flip != 0 ) {
-    ct = UNCOMPRESSED;
-  }
+    IIPImage *image = requests[n].image;
+    int resolution = requests[n].resolution;
+    int tile = requests[n].tile;
 
-  // Set the physical output resolution for this particular view and zoom level
-  int num_res = (*session->image)->getNumResolutions();
-  unsigned int im_width = (*session->image)->image_widths[num_res - resolution - 1];
-  unsigned int im_height = (*session->image)->image_heights[num_res - resolution - 1];
-  float dpi_x = (*session->image)->dpi_x * (float)im_width / (float)(*session->image)->getImageWidth();
-  float dpi_y = (*session->image)->dpi_y * (float)im_height / (float)(*session->image)->getImageHeight();
-  compressor->setResolution(dpi_x, dpi_y, (*session->image)->dpi_units);
+    // Sanity check
+    if ((resolution < 0) || (tile < 0)) {
+      ostringstream error;
+      error << "JTLExt :: Invalid resolution/tile number: " << resolution << "," << tile;
+      throw error.str();
+    }
 
-  if (session->loglevel >= 5) {
-    *(session->logfile) << "JTLExt :: Setting physical resolution of tile to " << dpi_x << " x " << dpi_y
-                        << (((*session->image)->dpi_units == 1) ? " pixels/inch" : " pixels/cm") << endl;
-  }
+    // Only decode the channels that contribute to our output
+    image->setChannelSubset(session->view->getChannelSubset(image->getNumChannels()));
 
-  // Embed ICC profile
-  if (session->view->embedICC() && ((*session->image)->getMetadata("icc").size() > 0)) {
-    if (session->loglevel >= 3) {
-      *(session->logfile) << "JTLExt :: Embedding ICC profile with size "
-                          << (*session->image)->getMetadata("icc").size() << " bytes" << endl;
-    }
-    compressor->setICCProfile((*session->image)->getMetadata("icc"));
-  }
+    CompressionType ct = session->view->output_format;
 
-  RawTile rawtile = tilemanager.getTile(resolution, tile, session->view->xangle,
-                                        session->view->yangle, session->view->getLayers(), ct);
+    // Greyscale tiles can be produced from the luminance of colour JPEG tiles without decoding
+    greyscale[n] = (ct == JPEG && session->view->colourspace == GREYSCALE && image->getColourSpace() == sRGB &&
+      image->getNumChannels() == 3 && image->getNumBitsPerPixel() == 8);
 
-  int len = rawtile.dataLength;
+    // Request uncompressed tile if raw pixel data is required for processing
+    if (image->getNumBitsPerPixel() > 8 || image->getColourSpace() == CIELAB ||
+      image->getNumChannels() == 2 || image->getNumChannels() > 3 ||
+      ((session->view->colourspace == GREYSCALE || session->view->colourspace == BINARY)
+      && image->getNumChannels() == 3 && image->getNumBitsPerPixel() == 8 && !greyscale[n]) ||
+      session->view->floatProcessing() || session->view->equalization || session->view->getRotation() != 0.0 ||
+      session->view->flip != 0 ) {
+      ct = UNCOMPRESSED;
+    }
 
-  if (session->loglevel >= 2) {
-    *(session->logfile) << "JTLExt :: Tile size: " << rawtile.width << " x " << rawtile.height << endl
-                        << "JTLExt :: Channels per sample: " << rawtile.channels << endl
-                        << "JTLExt :: Bits per channel: " << rawtile.bpc << endl
-                        << "JTLExt :: Data size is " << len << " bytes" << endl;
+    requests[n].compression = ct;
   }
 
-  // Convert CIELAB to sRGB
-  if ((*session->image)->getColourSpace() == CIELAB) {
-    if (session->loglevel >= 4) {
-      *(session->logfile) << "JTLExt :: Converting from CIELAB->sRGB";
-      function_timer.start();
-    }
-    session->processor->LAB2sRGB(rawtile);
-    if (session->loglevel >= 4) {
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+  // Tiles are encoded with the physical output resolution and ICC profile of their own image, so fetch
+  // our tiles in batches sharing these settings, decoding and encoding any cache misses in parallel
+  vector<RawTile> rawtiles(requests.size());
+  vector<bool> fetched(requests.size(), false);
+  for (unsigned int n = 0; n < requests.size(); n++) {
+
+    if (fetched[n])
+      continue;
+
+    EncodingSettings settings = encodingSettings(session, requests[n]);
+    vector<TileRequest> batch;
+    vector<unsigned int> indices;
+    for (unsigned int m = n; m < requests.size(); m++) {
+      if (!fetched[m] && encodingSettings(session, requests[m]) == settings) {
+        batch.push_back(requests[m]);
+        indices.push_back(m);
+        fetched[m] = true;
+      }
     }
+
+    applySettings(session, compressor, settings);
+
+    TileManager tilemanager(session->tileCache, requests[n].image, session->watermark, compressor, session->logfile, session->loglevel);
+    tilemanager.setThreads(session->codecOptions["REGION_THREADS"]);
+    vector<RawTile> tiles = tilemanager.getTiles(batch, session->view->xangle,
+                                                 session->view->yangle, session->view->getLayers());
+    for (unsigned int k = 0; k < indices.size(); k++)
+      rawtiles[indices[k]] = tiles[k];
   }
 
-  // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image and have requested a JPEG tile
-  // For PNG, strip extra bands if we have more than 4 present
-  if (((session->view->output_format == JPEG) && (rawtile.channels == 2 || rawtile.channels > 3)) ||
-      ((session->view->output_format == PNG) && (rawtile.channels > 4))) {
-    unsigned int bands = (rawtile.channels == 2) ? 1 : 3;
-    if (session->loglevel >= 4) {
-      *(session->logfile) << "JTLExt :: Flattening channels to " << bands;
-      function_timer.start();
+  for (unsigned int n = 0; n < requests.size(); n++) {
+
+    IIPImage *image = requests[n].image;
+    CompressionType ct = requests[n].compression;
+    RawTile &rawtile = rawtiles[n];
+
+    // Keep only the luminance of our JPEG tile, falling back to converting the decoded tile if this is not possible
+    bool transformed = false;
+    if (greyscale[n] && ct == JPEG && rawtile.compressionType == JPEG) {
+      if (session->loglevel >= 4) function_timer.start();
+      transformed = session->jpeg->transform(rawtile, 0, 0, true);
+      if (session->loglevel >= 4) {
+        *(session->logfile) << "JTLExt :: " << (transformed ? "Lossless" : "Unable to carry out lossless")
+                            << " JPEG greyscale conversion in " << function_timer.getTime() << " microseconds" << endl;
+      }
+      if (!transformed) {
+        ct = UNCOMPRESSED;
+        TileManager imageTiles(session->tileCache, image, session->watermark, compressor, session->logfile, session->loglevel);
+        rawtile = imageTiles.getTile(requests[n].resolution, requests[n].tile, session->view->xangle,
+                                     session->view->yangle, session->view->getLayers(), ct);
+      }
     }
-    session->processor->flatten(rawtile, bands);
-    if (session->loglevel >= 4) {
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+
+    int len = rawtile.dataLength;
+
+    if (session->loglevel >= 2) {
+      *(session->logfile) << "JTLExt :: Tile size: " << rawtile.width << " x " << rawtile.height << endl
+                          << "JTLExt :: Channels per sample: " << rawtile.channels << endl
+                          << "JTLExt :: Bits per channel: " << rawtile.bpc << endl
+                          << "JTLExt :: Data size is " << len << " bytes" << endl;
     }
-  }
-  
-  // Convert to greyscale if requested
-  if ((*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE) {
-    if (session->loglevel >= 4) {
-      *(session->logfile) << "JTLExt :: Converting to greyscale";
-      function_timer.start();
+
+    // Convert CIELAB to sRGB
+    if (image->getColourSpace() == CIELAB) {
+      if (session->loglevel >= 4) {
+        *(session->logfile) << "JTLExt :: Converting from CIELAB->sRGB";
+        function_timer.start();
+      }
+      session->processor->LAB2sRGB(rawtile);
+      if (session->loglevel >= 4) {
+        *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+      }
     }
-    session->processor->greyscale(rawtile);
-    if (session->loglevel >= 4) {
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+
+    // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image and have requested a JPEG tile
+    // For PNG and WebP, strip extra bands if we have more than 4 present
+    if (((session->view->output_format == JPEG) && (rawtile.channels == 2 || rawtile.channels > 3)) ||
+        ((session->view->output_format == PNG || session->view->output_format == WEBP) && (rawtile.channels > 4))) {
+      unsigned int bands = (rawtile.channels == 2) ? 1 : 3;
+      if (session->loglevel >= 4) {
+        *(session->logfile) << "JTLExt :: Flattening channels to " << bands;
+        function_timer.start();
+      }
+      session->processor->flatten(rawtile, bands);
+      if (session->loglevel >= 4) {
+        *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+      }
     }
-  }
 
-  // Compress to requested output format
-  if (rawtile.compressionType == UNCOMPRESSED) {
-    if (session->loglevel >= 4) {
-      *(session->logfile) << "JTLExt :: Encoding UNCOMPRESSED tile";
-      function_timer.start();
+    // Convert to greyscale if requested
+    if (image->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE && !transformed) {
+      if (session->loglevel >= 4) {
+        *(session->logfile) << "JTLExt :: Converting to greyscale";
+        function_timer.start();
+      }
+      session->processor->greyscale(rawtile);
+      if (session->loglevel >= 4) {
+        *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+      }
     }
-    len = compressor->Compress(rawtile);
-    if (session->loglevel >= 4) {
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds to "
-                          << rawtile.dataLength << " bytes" << endl;
+
+    // Compress to requested output format using the settings of this tile's image
+    if (rawtile.compressionType == UNCOMPRESSED) {
+      applySettings(session, compressor, encodingSettings(session, requests[n]));
+      if (session->loglevel >= 4) {
+        *(session->logfile) << "JTLExt :: Encoding UNCOMPRESSED tile";
+        function_timer.start();
+      }
+      len = compressor->Compress(rawtile);
+      if (session->loglevel >= 4) {
+        *(session->logfile) << " in " << function_timer.getTime() << " microseconds to "
+                            << rawtile.dataLength << " bytes" << endl;
+      }
     }
+
+    CompressedTile compressedTile;
+    compressedTile.rawtile = rawtile;
+    compressedTile.compressedLen = len;
+    compressedTiles.push_back(compressedTile);
   }
-  CompressedTile compressedTile;
-  compressedTile.rawtile = rawtile;
-  compressedTile.compressedLen = len;
-  return compressedTile;
-}
\ No newline at end of file
+
+  return compressedTiles;
+}
@@ -58,6 +58,38 @@ unsigned int get_nprocs_conf(){
 using namespace std;
 
 
+// Thread group shared by every decompressor within this process. Creating and destroying
+// threads for each decode is expensive, so the group is created once and kept
+static kdu_thread_env thread_env;
+
+
+// Return our shared thread group, creating it if necessary, or NULL for single-threaded decoding
+static kdu_thread_env* get_thread_env( unsigned int threads ){
+
+  if( thread_env.exists() ) return &thread_env;
+
+  int num_threads = threads;
+#ifdef NPROCS
+  if( num_threads == 0 ) num_threads = get_nprocs_conf();
+#endif
+
+  // The calling thread also takes part in decoding
+  if( num_threads <= 1 ) return NULL;
+
+  thread_env.create();
+  for( int nt=1; nt < num_threads; nt++ ){
+    // Unable to create all the threads requested
+    if( !thread_env.add_thread() ) break;
+  }
+
+#ifdef DEBUG
+  logfile << "Kakadu :: created thread group with " << thread_env.get_num_threads() << " threads" << endl;
+#endif
+
+  return &thread_env;
+}
+
+
 void KakaduImage::openImage()
 {
   string filename = getFileName( currentX, currentY );
@@ -323,8 +355,12 @@ void KakaduImage::closeImage()
   timer.start();
 #endif
 
-  // Close our codestream - need to make sure it exists or it'll crash
-  if( codestream.exists() ) codestream.destroy();
+  // Close our codestream - need to make sure it exists or it'll crash. Any use
+  // of the codestream by our shared thread group must first be terminated
+  if( codestream.exists() ){
+    if( thread_env.exists() ) thread_env.cs_terminate( codestream );
+    codestream.destroy();
+  }
 
   // Close our JP2 family and JPX files
   src.close();
@@ -458,6 +494,137 @@ RawTile KakaduImage::getRegion( int seq, int ang, unsigned int res, int layers,
 }
 
 
+// Get a region scaled to our output size during decoding
+RawTile KakaduImage::getScaledRegion( int seq, int ang, unsigned int res, int layers, int x, int y, unsigned int w, unsigned int h,
+				      unsigned int ow, unsigned int oh )
+{
+  // Virtual resolutions and bilevel images are handled by our standard stripe decoder and resized by the caller
+  if( res < virtual_levels || bpc == 1 || w == 0 || h == 0 ) return getRegion( seq, ang, res, layers, x, y, w, h );
+
+  // Scale up our output bit depth to the nearest factor of 8
+  unsigned int obpc = bpc;
+  if( bpc <= 16 && bpc > 8 ) obpc = 16;
+  else if( bpc <= 8 ) obpc = 8;
+  else throw file_error( "Kakadu :: Unsupported number of bits" );
+
+#ifdef DEBUG
+  Timer timer;
+  timer.start();
+#endif
+
+  int vipsres = ( numResolutions - 1 ) - res;
+
+  // Set the number of layers in the same way as for unscaled regions
+  if( layers < 0 ) layers = quality_layers;
+  else if( layers == 0 ) layers = ceil( quality_layers/2.0 );
+  if( layers < 1 ) layers = 1;
+
+  // Open our image if it has so far only been set up from cached metadata
+  if( !codestream.exists() ) openImage();
+
+  // Check our codestream status - throw exception for malformed codestreams
+  if( !codestream.exists() ) throw file_error( "Kakadu :: Malformed JPEG2000 - unable to access codestream");
+
+  // Map each of our output channels directly onto the corresponding output component
+  kdu_channel_mapping mapping;
+  mapping.set_num_channels( channels );
+  for( unsigned int c=0; c<channels; c++ ){
+    mapping.source_components[c] = c;
+    mapping.default_rendering_precision[c] = 0;
+    mapping.default_rendering_signed[c] = false;
+  }
+
+  // Our rational scaling factor with respect to our requested resolution and our region on the scaled canvas
+  kdu_coords numerator( ow, oh );
+  kdu_coords denominator( w, h );
+
+  kdu_region_decompressor region_decompressor;
+  kdu_dims region;
+
+  // Use our persistent worker threads
+  kdu_thread_env *env_ref = get_thread_env( threads );
+
+  RawTile rawtile( 0, res, seq, ang, ow, oh, channels, obpc );
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+
+  try{
+
+    kdu_dims rendered = region_decompressor.get_rendered_image_dims( codestream, &mapping, -1, vipsres,
+								      numerator, denominator, KDU_WANT_OUTPUT_COMPONENTS );
+    region.pos = rendered.pos + kdu_coords( (kdu_long) x * ow / w, (kdu_long) y * oh / h );
+    region.size = kdu_coords( ow, oh );
+    region &= rendered;
+
+    if( region.is_empty() ){
+#ifdef DEBUG
+      logfile << "Kakadu :: Error: scaled region of zero size requested" << endl;
+#endif
+      throw 1;
+    }
+
+    // Our region may be clipped by a pixel at the image edge
+    rawtile.width = region.size.x;
+    rawtile.height = region.size.y;
+    rawtile.dataLength = rawtile.width * rawtile.height * channels * (obpc/8);
+    if( obpc == 16 ) rawtile.data = new unsigned short[rawtile.width*rawtile.height*channels];
+    else rawtile.data = new unsigned char[rawtile.width*rawtile.height*channels];
+
+#ifdef DEBUG
+    logfile << "Kakadu :: scaled region decompressor starting for region " << w << "x" << h
+	    << " at resolution " << res << " scaled to " << region.size.x << "x" << region.size.y << endl;
+#endif
+
+    if( !region_decompressor.start( codestream, &mapping, -1, vipsres, layers, region, numerator, denominator,
+				    false, KDU_WANT_OUTPUT_COMPONENTS, false, env_ref, NULL ) ){
+      throw 1;
+    }
+
+    // Interleave our channels directly into our output buffer
+    std::vector<int> offsets( channels );
+    for( unsigned int c=0; c<channels; c++ ) offsets[c] = c;
+
+    kdu_dims incomplete = region, processed;
+    int increment = region.size.x * 64;
+    int max_pixels = region.size.x * region.size.y;
+
+    while( !incomplete.is_empty() ){
+      bool continues;
+      if( obpc == 16 ){
+	continues = region_decompressor.process( (kdu_uint16*) rawtile.data, &offsets[0], channels, region.pos, region.size.x,
+						 increment, max_pixels, incomplete, processed, bpc );
+      }
+      else{
+	continues = region_decompressor.process( (kdu_byte*) rawtile.data, &offsets[0], channels, region.pos, region.size.x,
+						 increment, max_pixels, incomplete, processed, 8 );
+      }
+      if( !continues ) break;
+    }
+
+    if( !region_decompressor.finish() || !incomplete.is_empty() ){
+      throw file_error( "Kakadu :: Error indicated by finish()" );
+    }
+
+  }
+  catch (...){
+    // Our thread group cannot be re-used after an exception, so destroy it: it is re-created on the next decode
+    region_decompressor.finish();
+    if( thread_env.exists() ){
+      thread_env.handle_exception( -1 );
+      thread_env.destroy();
+    }
+    throw file_error( "Kakadu :: Core Exception Caught");
+  }
+
+#ifdef DEBUG
+  logfile << "Kakadu :: getScaledRegion() :: " << timer.getTime() << " microseconds" << endl;
+#endif
+
+  return rawtile;
+}
+
+
+
 // Main processing function
 void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffset, unsigned int tw, unsigned int th, void *d )
 {
@@ -496,6 +663,9 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
   canvas_dims.pos = kdu_coords( xoffset, yoffset );
   canvas_dims.size = kdu_coords( tw, th );
 
+  // Open our image if it has so far only been set up from cached metadata
+  if( !codestream.exists() ) openImage();
+
   // Check our codestream status - throw exception for malformed codestreams
   if( !codestream.exists() ) throw file_error( "Kakadu :: Malformed JPEG2000 - unable to access codestream");
 
@@ -505,35 +675,18 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
   codestream.map_region( 0, canvas_dims, image_dims, true );
 
 
-  // Create some worker threads
-#ifdef NPROCS
-  int num_threads = get_nprocs_conf();
-#else
-  int num_threads = 0;
-#endif
-
-
-  kdu_thread_env env, *env_ref = NULL;
-  if( num_threads > 0 ){
-    env.create();
-    for (int nt=0; nt < num_threads; nt++){
-      // Unable to create all the threads requested
-      if( !env.add_thread() ) num_threads = nt;
-    }
-    env_ref = &env;
-  }
-
+  // Use our persistent worker threads
+  kdu_thread_env *env_ref = get_thread_env( threads );
 
 
 #ifdef DEBUG
-  logfile << "Kakadu :: decompressor init with " << num_threads << " threads" << endl;
+  logfile << "Kakadu :: decompressor init with " << (env_ref ? env_ref->get_num_threads() : 1) << " threads" << endl;
   logfile << "Kakadu :: decoding " << layers << " quality layers" << endl;
 #endif
 
 
-  // Setup tile and stripe buffers
+  // Setup tile buffer and stripe heights
   void *buffer = NULL;
-  void *stripe_buffer = NULL;
   int *stripe_heights = NULL;
 
   try{
@@ -568,28 +721,11 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
     int index = 0;
     bool continues = true;
 
-    // Get our stripe heights so that we can allocate our stripe buffer
-    // Assume that first stripe height is largest
-    decompressor.get_recommended_stripe_heights( comp_dims.size.y,
-						 1024, stripe_heights, NULL );
-
-#ifdef DEBUG
-    logfile << "Kakadu :: Allocating memory for stripe height " << stripe_heights[0] << endl;
-#endif
-
-    // Create our buffers
-
-    if( obpc == 16 ){
-      stripe_buffer = new kdu_uint16[tw*stripe_heights[0]*channels];
-      buffer = new unsigned short[tw*th*channels];
-    }
-    else if( obpc == 8 ){
-      stripe_buffer = new kdu_byte[tw*stripe_heights[0]*channels];
-      buffer = new unsigned char[tw*th*channels];
-    }
-
-    // Keep track of changes in stripe heights
-    int previous_stripe_heights = stripe_heights[0];
+    // Kakadu's pull_stripe() already interleaves our components, so pull our stripes directly
+    // into the output buffer. Only virtual resolutions need a local buffer for resizing
+    if( res >= virtual_levels ) buffer = d;
+    else if( obpc == 16 ) buffer = new unsigned short[tw*th*channels];
+    else if( obpc == 8 ) buffer = new unsigned char[tw*th*channels];
 
 
     while( continues ){
@@ -598,24 +734,6 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
       decompressor.get_recommended_stripe_heights( comp_dims.size.y,
 						   1024, stripe_heights, NULL );
 
-
-      // If we have a larger stripe height, allocate new memory for this
-      if( stripe_heights[0] > previous_stripe_heights ){
-
-	// First delete then re-allocate our buffers
-	delete_buffer( stripe_buffer );
-	if( obpc == 16 ){
-	  stripe_buffer = new kdu_uint16[tw*stripe_heights[0]*channels];
-	}
-	else if( obpc == 8 ){
-	  stripe_buffer = new kdu_byte[tw*stripe_heights[0]*channels];
-	}
-
-#ifdef DEBUG
-	logfile << "Kakadu :: Stripe height increase: re-allocating memory for height " << stripe_heights[0] << endl;
-#endif
-      }
-
       // Check for zero height, which can occur with incorrect position or size parameters
       if( stripe_heights[0] == 0 ){
 #ifdef DEBUG
@@ -628,26 +746,10 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
       if( obpc == 16 ){
 	// Set these to false to get unsigned 16 bit values
 	bool s[3] = {false,false,false};
-	continues = decompressor.pull_stripe( (kdu_int16*) stripe_buffer, stripe_heights, NULL, NULL, NULL, NULL, s );
+	continues = decompressor.pull_stripe( &( ((kdu_int16*)buffer)[index] ), stripe_heights, NULL, NULL, NULL, NULL, s );
       }
       else if( obpc == 8 ){
-	continues = decompressor.pull_stripe( (kdu_byte*) stripe_buffer, stripe_heights, NULL, NULL, NULL );
-      }
-
-
-#ifdef DEBUG
-      logfile << "Kakadu :: stripe pulled" << endl;
-#endif
-
-      // Copy the data into the supplied buffer
-      void *b1, *b2;
-      if( obpc == 16 ){
-	b1 = &( ((kdu_uint16*)stripe_buffer)[0] );
-	b2 = &( ((unsigned short*)buffer)[index] );
-      }
-      else{ // if( obpc == 8 ){
-	b1 = &( ((kdu_byte*)stripe_buffer)[0] );
-	b2 = &( ((unsigned char*)buffer)[index] );
+	continues = decompressor.pull_stripe( &( ((kdu_byte*)buffer)[index] ), stripe_heights, NULL, NULL, NULL );
 
 	/* Handle 1 bit bilevel images, which we output scaled to 8 bits
 	   - ideally we would do this in the Kakadu pull_stripe function,
@@ -657,23 +759,27 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 	*/
 	if( bpc == 1 ){
 
+	  kdu_byte* stripe = &( ((kdu_byte*)buffer)[index] );
 	  unsigned int k = tw * stripe_heights[0] * channels;
 
 	  // Deal with inverted LUTs - we should really handle LUTs more generally, however
 	  if( !lut.empty() && lut[0]>lut[1] ){
 	    for( unsigned int n=0; n<k; n++ ){
-	      ((kdu_byte*)stripe_buffer)[n] =  ~(-((kdu_byte*)stripe_buffer)[n] >> 8);
+	      stripe[n] =  ~(-stripe[n] >> 8);
 	    }
 	  }
 	  else{
 	    for( unsigned int n=0; n<k; n++ ){
-	      ((kdu_byte*)stripe_buffer)[n] =  (-((kdu_byte*)stripe_buffer)[n] >> 8);
+	      stripe[n] =  (-stripe[n] >> 8);
 	    }
 	  }
 	}
       }
 
-      memcpy( b2, b1, tw * stripe_heights[0] * channels * (obpc/8) );
+
+#ifdef DEBUG
+      logfile << "Kakadu :: stripe pulled" << endl;
+#endif
 
       // Advance our output buffer pointer
       index += tw * stripe_heights[0] * channels;
@@ -712,11 +818,9 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 	  }
 	}
       }
+      // Delete our local buffer
+      delete_buffer( buffer );
     }
-    else memcpy( d, buffer, tw*th*channels * (obpc/8) );
-
-    // Delete our local buffer
-    delete_buffer( buffer );
 
 #ifdef DEBUG
     logfile << "Kakadu :: decompressor completed" << endl;
@@ -725,21 +829,20 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 
   }
   catch (...){
-    // Shut down our decompressor, delete our buffers, destroy our threads and codestream before rethrowing the exception
+    // Shut down our decompressor, delete our buffers and codestream before rethrowing the exception.
+    // Our thread group cannot be re-used after an exception, so destroy it: it is re-created on the next decode
     decompressor.finish();
-    if( env.exists() ) env.destroy();
-    delete_buffer( stripe_buffer );
-    delete_buffer( buffer );
+    if( thread_env.exists() ){
+      thread_env.handle_exception( -1 );
+      thread_env.destroy();
+    }
+    if( buffer != d ) delete_buffer( buffer );
     if( stripe_heights ) delete[] stripe_heights;
     throw file_error( "Kakadu :: Core Exception Caught"); // Rethrow the exception
   }
 
 
-  // Destroy our threads
-  if( env.exists() ) env.destroy();
-
-  // Delete our stripe buffer
-  delete_buffer( stripe_buffer );
+  // Delete our stripe heights
   if( stripe_heights ){
     delete[] stripe_heights;
     stripe_heights = NULL;
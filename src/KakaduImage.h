@@ -38,6 +38,7 @@
 #include <jpx.h>
 #include <jp2.h>
 #include <kdu_stripe_decompressor.h>
+#include <kdu_region_decompressor.h>
 #include <fstream>
 
 #define TILESIZE 256
@@ -104,6 +105,9 @@ class KakaduImage : public IIPImage {
   /// Kakadu decompressor object
   kdu_stripe_decompressor decompressor;
 
+  /// Number of threads in our shared thread group: 0 for all available processors
+  unsigned int threads;
+
   /// Tile or Strip region
   kdu_dims comp_dims;
 
@@ -128,26 +132,28 @@ class KakaduImage : public IIPImage {
 
   /// Constructor
   KakaduImage(): IIPImage(){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL; threads = 0;
   };
 
   /// Constructor
   /** @param path image path
    */
   KakaduImage( const std::string& path ): IIPImage( path ){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL; threads = 0;
   };
 
   /// Copy Constructor
   /** @param image Kakadu object
    */
-  KakaduImage( const KakaduImage& image ): IIPImage( image ) {};
+  KakaduImage( const KakaduImage& image ): IIPImage( image ) {
+    input = NULL; threads = image.threads;
+  };
 
   /// Constructor from IIPImage object
   /** @param image IIPImage object
    */
   KakaduImage( const IIPImage& image ): IIPImage( image ){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL; threads = 0;
   };
 
   /// Assignment Operator
@@ -157,6 +163,7 @@ class KakaduImage : public IIPImage {
     if( this != &image ){
       closeImage();
       IIPImage::operator=(image);
+      threads = image.threads;
     }
     return *this;
   }
@@ -166,6 +173,11 @@ class KakaduImage : public IIPImage {
   ~KakaduImage() { closeImage(); };
 
 
+  /// Set the number of threads used within the codec
+  /** The thread group is created on first use and shared by all subsequent decodes
+      @param t number of threads: 0 for all available processors */
+  void setThreads( unsigned int t ){ threads = t; };
+
   /// Overloaded function for opening a TIFF image
   void openImage();
 
@@ -181,6 +193,9 @@ class KakaduImage : public IIPImage {
   /// Return whether this image type directly handles region decoding
   bool regionDecoding(){ return true; };
 
+  /// Return whether this image type can scale a region to an arbitrary size while decoding
+  bool scaledRegionDecoding(){ return true; };
+
   /// Overloaded function for getting a particular tile
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
@@ -204,6 +219,24 @@ class KakaduImage : public IIPImage {
    */
   RawTile getRegion( int ha, int va, unsigned int r, int l, int x, int y, unsigned int w, unsigned int h );
 
+  /// Overloaded function for returning a region scaled to a given size during decoding
+  /** Uses Kakadu's region decompressor to render at a rational reduction factor from the
+      given resolution.
+      @param ha horizontal angle
+      @param va vertical angle
+      @param r resolution
+      @param l number of quality layers to decode
+      @param x x coordinate
+      @param y y coordinate
+      @param w width of region
+      @param h height of region
+      @param ow output width
+      @param oh output height
+      @return RawTile image
+   */
+  RawTile getScaledRegion( int ha, int va, unsigned int r, int l, int x, int y, unsigned int w, unsigned int h,
+			   unsigned int ow, unsigned int oh );
+
   /// Read-mode types
   enum KDU_READMODE { KDU_FAST,     ///< Default fast mode
 		      KDU_FUSSY,    ///< Fussy mode
@@ -54,6 +54,10 @@
 #include <omp.h>
 #endif
 
+#ifndef WIN32
+#include <poll.h>
+#endif
+
 // If necessary, define missing setenv and unsetenv functions
 #ifndef HAVE_SETENV
 static void setenv(char *n, char *v, int x)
@@ -95,12 +99,39 @@ char *tz = NULL;
 
 // Create pointers to our cache structures for use in our signal handler function
 imageCacheMapType *ic = NULL;
+metadataCacheMapType *mc = NULL;
 Cache *tc = NULL;
 
+/* Check, without blocking, whether a new request is waiting either on our listening
+   socket or on a connection kept open by the web server after the last request
+*/
+static bool IIPRequestPending(void *arg)
+{
+#ifndef WIN32
+  FCGX_Request *r = (FCGX_Request *)arg;
+  struct pollfd fds[2];
+  int n = 0;
+  fds[n].fd = r->listen_sock;
+  fds[n].events = POLLIN;
+  fds[n++].revents = 0;
+  if (r->ipcFd >= 0)
+  {
+    fds[n].fd = r->ipcFd;
+    fds[n].events = POLLIN;
+    fds[n++].revents = 0;
+  }
+  return (poll(fds, n, 0) > 0);
+#else
+  return false;
+#endif
+}
+
 void IIPReloadCache(int signal)
 {
   if (ic)
     ic->clear();
+  if (mc)
+    mc->clear();
   if (tc)
     tc->clear();
 
@@ -274,18 +305,35 @@ int main(int argc, char *argv[])
   imageCacheMapType imageCache;
   ic = &imageCache;
 
+  // Pre-serialised metadata responses
+  metadataCacheMapType metadataCache;
+  mc = &metadataCache;
+
   // Get our image pattern variable
   string filename_pattern = Environment::getFileNamePattern();
 
   // Get our default quality variable
   int jpeg_quality = Environment::getJPEGQuality();
 
+  // Get our JPEG chroma subsampling and Huffman table optimization
+  int jpeg_subsampling = Environment::getJPEGSubsampling();
+  bool jpeg_optimize = Environment::getJPEGOptimize();
+
   // Get our default PNG compression level
   int png_quality = Environment::getPNGQuality();
 
+#ifdef HAVE_WEBP
+  // Get our default WebP quality and whether to serve WebP to clients that accept it
+  int webp_quality = Environment::getWebPQuality();
+  bool webp_negotiation = Environment::getWebPNegotiation();
+#endif
+
   // Get our max CVT size
   int max_CVT = Environment::getMaxCVT();
 
+  // Get our max size for streamed TIFF exports
+  int max_TIFF_CVT = Environment::getMaxTIFFCVT();
+
   // Get the default number of quality layers to decode
   int max_layers = Environment::getMaxLayers();
 
@@ -322,6 +370,16 @@ int main(int argc, char *argv[])
   // Set our IIIF version
   unsigned int iiif_version = Environment::getIIIFVersion();
 
+  // Get the tile size advertised to DeepZoom clients
+  unsigned int deepzoom_tile_size = Environment::getDeepZoomTileSize();
+
+  // Get the maximum number of threads used for region decoding
+  unsigned int region_threads = Environment::getRegionThreads();
+
+  // Get our tile prefetching budget
+  unsigned int prefetch_tiles = Environment::getPrefetchTiles();
+  unsigned int prefetch_time = Environment::getPrefetchTime();
+
   // Create our image processing engine
   Transform *processor = new Transform();
 
@@ -330,6 +388,9 @@ int main(int argc, char *argv[])
   unsigned int kdu_readmode = Environment::getKduReadMode();
 #endif
 
+  // Get the number of threads used within the JPEG2000 codec
+  unsigned int codec_threads = Environment::getCodecThreads();
+
   // Print out some information
   if (loglevel >= 1)
   {
@@ -337,11 +398,20 @@ int main(int argc, char *argv[])
     logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
     logfile << "Setting filesystem suffix to '" << filesystem_suffix << "'" << endl;
     logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
+    logfile << "Setting JPEG chroma subsampling to " << jpeg_subsampling << endl;
+    logfile << "JPEG Huffman table optimization is " << (jpeg_optimize ? "enabled" : "disabled") << endl;
     logfile << "Setting default PNG compression level to " << png_quality << endl;
+#ifdef HAVE_WEBP
+    logfile << "Setting default WebP quality to " << webp_quality << endl;
+    logfile << "WebP content negotiation is " << (webp_negotiation ? "enabled" : "disabled") << endl;
+#endif
     logfile << "Setting maximum CVT size to " << max_CVT << endl;
+    if( max_TIFF_CVT != 0 ) logfile << "Setting maximum CVT size for TIFF export to " << max_TIFF_CVT << endl;
     logfile << "Setting HTTP Cache-Control header to '" << cache_control << "'" << endl;
     logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
     logfile << "Setting default IIIF Image API version to " << iiif_version << endl;
+    if (deepzoom_tile_size > 0)
+      logfile << "Setting DeepZoom tile size to " << deepzoom_tile_size << endl;
     if (!cors.empty())
       logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
     if (!base_url.empty())
@@ -356,6 +426,9 @@ int main(int argc, char *argv[])
     }
     logfile << "Setting Allow Upscaling to " << (allow_upscaling ? "true" : "false") << endl;
     logfile << "Setting ICC profile embedding to " << (embed_icc ? "true" : "false") << endl;
+    if (prefetch_tiles > 0)
+      logfile << "Setting tile prefetching to " << prefetch_tiles << " tiles within "
+              << prefetch_time << " microseconds after each request" << endl;
 #ifdef HAVE_KAKADU
     logfile << "Setting up JPEG2000 support via Kakadu SDK" << endl;
     logfile << "Setting Kakadu read-mode to " << ((kdu_readmode == 2) ? "resilient" : (kdu_readmode == 1) ? "fussy"
@@ -363,6 +436,13 @@ int main(int argc, char *argv[])
             << endl;
 #elif defined(HAVE_OPENJPEG)
     logfile << "Setting up JPEG2000 support via OpenJPEG" << endl;
+#endif
+#if defined(HAVE_KAKADU) || defined(HAVE_OPENJPEG)
+    logfile << "Setting JPEG2000 decoding threads to ";
+    if (codec_threads == 0)
+      logfile << "number of available processors" << endl;
+    else
+      logfile << codec_threads << endl;
 #endif
     logfile << "Setting image processing engine to " << processor->getDescription() << endl;
 #ifdef _OPENMP
@@ -373,6 +453,11 @@ int main(int argc, char *argv[])
     }
     if (num_threads > 1)
       logfile << "OpenMP enabled for parallelized image processing with " << num_threads << " threads" << endl;
+    logfile << "Setting region tile decoding threads to ";
+    if (region_threads == 0)
+      logfile << "OpenMP default" << endl;
+    else
+      logfile << region_threads << endl;
 #endif
   }
 
@@ -539,6 +624,9 @@ int main(int argc, char *argv[])
   // Create our tile cache
   Cache tileCache(max_image_cache_size);
   tc = &tileCache;
+
+  // Create our tile prefetcher
+  Prefetcher prefetcher(prefetch_tiles, prefetch_time, jpeg_subsampling, jpeg_optimize);
   Task *task = NULL;
 
 
@@ -570,8 +658,12 @@ int main(int argc, char *argv[])
     //  so that we can close the image on exceptions
     IIPImage *image = NULL;
 
-    JPEGCompressor jpeg(jpeg_quality);
+    JPEGCompressor jpeg(jpeg_quality, jpeg_subsampling, jpeg_optimize);
     PNGCompressor png(png_quality);
+#ifdef HAVE_WEBP
+    WebPCompressor webp(webp_quality);
+#endif
+    TIFFCompressor tiff;
 
     // View object for use with the CVT command etc
     View view;
@@ -598,15 +690,29 @@ int main(int argc, char *argv[])
       session.view = &view;
       session.jpeg = &jpeg;
       session.png = &png;
+#ifdef HAVE_WEBP
+      session.webp = &webp;
+#endif
+      session.tiff = &tiff;
       session.loglevel = loglevel;
       session.logfile = &logfile;
       session.imageCache = &imageCache;
+      session.metadataCache = &metadataCache;
       session.tileCache = &tileCache;
+      session.prefetcher = prefetcher.enabled() ? &prefetcher : NULL;
       session.out = &writer;
       session.watermark = &watermark;
       session.headers.clear();
       session.processor = processor;
       session.codecOptions["IIIF_VERSION"] = iiif_version;
+      session.codecOptions["DEEPZOOM_TILE_SIZE"] = deepzoom_tile_size;
+      session.codecOptions["REGION_THREADS"] = region_threads;
+      session.codecOptions["CODEC_THREADS"] = codec_threads;
+      session.codecOptions["MAX_CVT"] = max_CVT;
+      session.codecOptions["MAX_TIFF_CVT"] = max_TIFF_CVT;
+#ifdef HAVE_WEBP
+      session.codecOptions["WEBP_NEGOTIATION"] = webp_negotiation;
+#endif
 #ifdef HAVE_KAKADU
       session.codecOptions["KAKADU_READMODE"] = kdu_readmode;
 #endif
@@ -727,12 +833,23 @@ int main(int argc, char *argv[])
           logfile << "HTTP Header: If-Modified-Since: " << header << endl;
         }
       }
+
+      // Check for IF_NONE_MATCH
+      if ((header = FCGX_GetParam("HTTP_IF_NONE_MATCH", request.envp)))
+      {
+        session.headers["HTTP_IF_NONE_MATCH"] = string(header);
+        if (loglevel >= 2)
+        {
+          logfile << "HTTP Header: If-None-Match: " << header << endl;
+        }
+      }
 #endif
 
 #ifdef HAVE_MEMCACHED
-      // Check whether this exists in memcached, but only if we haven't had an if_modified_since
+      // Check whether this exists in memcached, but only if we haven't had a conditional
       // request, which should always be faster to send
-      if (!header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty())
+      if (session.headers.find("HTTP_IF_MODIFIED_SINCE") == session.headers.end() &&
+          session.headers.find("HTTP_IF_NONE_MATCH") == session.headers.end())
       {
         char *memcached_response = NULL;
         if ((memcached_response = memcached.retrieve(request_string)))
@@ -793,6 +910,27 @@ int main(int argc, char *argv[])
           delete task;
           task = NULL;
         }
+
+        // No further commands need to be run if the client's copy is still valid
+        if (response.notModified())
+          break;
+      }
+
+      ////////////////////////////////////////////////////////
+      ////////// Send a 304 if content is unmodified /////////
+      ////////////////////////////////////////////////////////
+
+      if (response.notModified())
+      {
+        if (writer.putS(response.formatNotModified().c_str()) == -1)
+        {
+          if (loglevel >= 1)
+            logfile << "Error sending 304 Not Modified" << endl;
+        }
+        else if (loglevel >= 2)
+        {
+          logfile << "Sending HTTP 304 Not Modified" << endl;
+        }
       }
 
       ////////////////////////////////////////////////////////
@@ -802,7 +940,7 @@ int main(int argc, char *argv[])
       /* Make sure something has actually been sent to the client
    If no response has been sent by now, we must have a malformed command
        */
-      if ((!response.imageSent()) && (!response.isSet()))
+      if ((!response.notModified()) && (!response.imageSent()) && (!response.isSet()))
       {
         // Malformed command syntax error code is 2 1
         response.setError("2 1", request_string);
@@ -811,7 +949,7 @@ int main(int argc, char *argv[])
       /* Once we have finished parsing all our OBJ and COMMAND requests
    send out our response.
        */
-      if (response.isSet())
+      if ((!response.notModified()) && response.isSet())
       {
         if (loglevel >= 4)
         {
@@ -856,21 +994,9 @@ int main(int argc, char *argv[])
     catch (const int &code)
     {
 
-      string status;
-
       switch (code)
       {
 
-      case 304:
-        status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
-        writer.putS(status.c_str());
-        writer.flush();
-        if (loglevel >= 2)
-        {
-          logfile << "Sending HTTP 304 Not Modified" << endl;
-        }
-        break;
-
       case 100:
         if (loglevel >= 2)
         {
@@ -1018,6 +1144,19 @@ int main(int argc, char *argv[])
               << endl;
     }
 
+    // Prefetch the tiles likely to be requested next. Complete the FCGI request first
+    // so that the client is not kept waiting while we do this and stop as soon as a
+    // new request arrives
+    if (prefetcher.pending())
+    {
+#ifndef DEBUG
+      FCGX_Finish_r(&request);
+      prefetcher.run(&tileCache, &watermark, &logfile, loglevel, IIPRequestPending, &request);
+#else
+      prefetcher.run(&tileCache, &watermark, &logfile, loglevel);
+#endif
+    }
+
     ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
   }
 
@@ -22,12 +22,205 @@
 #include <sstream>
 #include <fstream>
 #include <cmath>
+#include <list>
+#include <vector>
+#include <algorithm>
 #include "Timer.h"
+#include "Interleave.h"
+
+
+// OpenJPEG 2.2 onwards supports multi-threaded decoding and 2.3 onwards repeated
+// decoding of different areas from single-tiled codestreams with the same codec
+#if defined(OPJ_VERSION_MAJOR) && ((OPJ_VERSION_MAJOR > 2) || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 2))
+#define OPJ_HAVE_THREADS 1
+#endif
+#if defined(OPJ_VERSION_MAJOR) && ((OPJ_VERSION_MAJOR > 2) || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 3))
+#define OPJ_REUSE_CODEC 1
+#endif
+
+// High-Throughput JPEG2000 (HTJ2K, Part 15) block decoding is supported from OpenJPEG 2.5
+#if defined(OPJ_VERSION_MAJOR) && ((OPJ_VERSION_MAJOR > 2) || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 5))
+#define OPJ_HAVE_HTJ2K 1
+#endif
+
+// Maximum number of codecs we keep open between requests and the maximum memory in bytes
+// that these may hold in total
+#define MAX_OPEN_CODECS 8
+#define MAX_OPEN_CODEC_BYTES 268435456
+
+// Length of an SOT marker and its segment, which starts every tile-part
+#define SOT_LENGTH 12
+
+// Rsiz capability flag in the SIZ marker segment indicating HTJ2K (Part 15) code-blocks
+#define RSIZ_HTJ2K 0x4000
 
 
 using namespace std;
 
 
+// A codec left open with its stream and parsed header for re-use by later requests
+struct OpenCodec {
+  string path;
+  time_t timestamp;
+  opj_stream_t* stream;
+  opj_codec_t* codec;
+  opj_image_t* image;
+  OPJ_UINT64 length;
+  size_t bytes;
+};
+
+static list<OpenCodec> open_codecs;
+static size_t open_codec_bytes = 0;
+
+
+// Estimate the memory held by an open single-tile codec: OpenJPEG retains the compressed data of
+// the tile, which can be as large as the file itself, as well as our decoded component buffers
+static size_t codec_bytes( OPJ_UINT64 length, const opj_image_t* image ){
+  size_t bytes = (size_t) length;
+  for( unsigned int k=0; k<image->numcomps; k++ ){
+    if( image->comps[k].data ) bytes += (size_t) image->comps[k].w * image->comps[k].h * sizeof(OPJ_INT32);
+  }
+  return bytes;
+}
+
+
+// File stream which uses a tile-part index of the codestream to never read beyond the tile-part
+// being read and, at the start of each tile-part, to only read its SOT marker segment. Tile-parts
+// outside of the requested area are therefore skipped over by OpenJPEG without being read.
+struct IndexedStream {
+  ifstream file;
+  OPJ_UINT64 position;
+  OPJ_UINT64 length;
+  vector<OPJ_UINT64> bounds;   // Start of each tile-part followed by the end of the last one
+};
+
+
+static OPJ_SIZE_T indexed_stream_read( void* buffer, OPJ_SIZE_T n, void* data ){
+  IndexedStream* s = (IndexedStream*) data;
+  if( s->position >= s->length ) return (OPJ_SIZE_T) -1;
+
+  OPJ_UINT64 end = s->length;
+  vector<OPJ_UINT64>::const_iterator b = upper_bound( s->bounds.begin(), s->bounds.end(), s->position );
+  if( b != s->bounds.end() ) end = *b;
+  if( b != s->bounds.begin() && *(b-1) == s->position && end - s->position > SOT_LENGTH ){
+    end = s->position + SOT_LENGTH;
+  }
+  if( n > end - s->position ) n = end - s->position;
+
+  s->file.clear();
+  s->file.seekg( s->position );
+  s->file.read( (char*) buffer, n );
+  n = s->file.gcount();
+  if( n == 0 ) return (OPJ_SIZE_T) -1;
+
+  s->position += n;
+  return n;
+}
+
+
+static OPJ_OFF_T indexed_stream_skip( OPJ_OFF_T n, void* data ){
+  IndexedStream* s = (IndexedStream*) data;
+  s->position += n;
+  return n;
+}
+
+
+static OPJ_BOOL indexed_stream_seek( OPJ_OFF_T n, void* data ){
+  IndexedStream* s = (IndexedStream*) data;
+  if( n < 0 || (OPJ_UINT64) n > s->length ) return OPJ_FALSE;
+  s->position = n;
+  return OPJ_TRUE;
+}
+
+
+static void indexed_stream_free( void* data ){
+  delete (IndexedStream*) data;
+}
+
+
+// Read an unsigned big-endian integer of n bytes
+static OPJ_UINT64 read_be( const unsigned char* b, unsigned int n ){
+  OPJ_UINT64 v = 0;
+  for( unsigned int i=0; i<n; i++ ) v = (v << 8) | b[i];
+  return v;
+}
+
+
+// Find the start of the codestream: either a raw J2K / J2C codestream or the contents of
+// the jp2c box of a JP2 family (JP2, JPX, JPH) file. Returns -1 if no codestream is found
+static OPJ_UINT64 find_codestream( ifstream& file ){
+
+  unsigned char b[16];
+  OPJ_UINT64 p = 0;
+
+  if( !file.seekg( 0 ).read( (char*) b, 2 ) ) return (OPJ_UINT64) -1;
+  if( b[0] == 0xff && b[1] == 0x4f ) return 0;
+
+  while( true ){
+    if( !file.seekg( p ).read( (char*) b, 8 ) ) return (OPJ_UINT64) -1;
+    OPJ_UINT64 box = read_be( b, 4 );
+    unsigned int header = 8;
+    if( box == 1 ){
+      if( !file.read( (char*) b+8, 8 ) ) return (OPJ_UINT64) -1;
+      box = read_be( b+8, 8 );
+      header = 16;
+    }
+    if( read_be( b+4, 4 ) == 0x6a703263 ) return p + header;  // 'jp2c'
+    if( box < header ) return (OPJ_UINT64) -1;
+    p += box;
+  }
+}
+
+
+// Read the Rsiz capabilities field of the SIZ marker segment, which must follow the SOC marker
+static unsigned int codestream_capabilities( ifstream& file, OPJ_UINT64 start ){
+  unsigned char b[6];
+  if( !file.seekg( start ).read( (char*) b, 6 ) ) return 0;
+  if( b[0] != 0xff || b[1] != 0x4f || b[2] != 0xff || b[3] != 0x51 ) return 0;
+  return read_be( b+4, 2 );
+}
+
+
+// Build an index of the position of every tile-part within a codestream starting at the given
+// offset by following its SOT marker chain. Returns an empty index if it cannot be indexed
+static vector<OPJ_UINT64> index_codestream( ifstream& file, OPJ_UINT64 start, OPJ_UINT64 length ){
+
+  vector<OPJ_UINT64> index;
+  unsigned char b[SOT_LENGTH];
+
+  // Skip over the marker segments of the main header until we reach the first SOT marker
+  OPJ_UINT64 p = start + 2;
+  while( true ){
+    if( !file.seekg( p ).read( (char*) b, 4 ) || b[0] != 0xff ) return index;
+    if( b[1] == 0x90 ) break;
+    OPJ_UINT64 segment = read_be( b+2, 2 );
+    if( segment < 2 ) return index;
+    p += 2 + segment;
+  }
+
+  // Follow the chain of tile-parts using the Psot length of each SOT marker segment
+  while( p + SOT_LENGTH <= length ){
+    if( !file.seekg( p ).read( (char*) b, SOT_LENGTH ) ) break;
+    if( b[0] != 0xff || b[1] != 0x90 ) break;
+    index.push_back( p );
+    OPJ_UINT64 psot = read_be( b+6, 4 );
+    // A Psot of zero indicates the last tile-part, which extends until the EOC marker
+    if( psot == 0 ){
+      p = length - 2;
+      break;
+    }
+    if( psot < SOT_LENGTH ){
+      index.clear();
+      return index;
+    }
+    p += psot;
+  }
+  if( !index.empty() ) index.push_back( p );
+
+  return index;
+}
+
+
 // Handle info, warning and error messages from OpenJPEG
 static void error_callback( const char* msg, void* ){
   stringstream ss;
@@ -53,8 +246,81 @@ void OpenJPEGImage::openImage()
   // Update our timestamp
   updateTimestamp( filename );
 
-  // Create decompression codec
-  _codec = opj_create_decompress( OPJ_CODEC_JP2 );
+  // Re-use any codec left open by a previous request if the file is unchanged
+  for( list<OpenCodec>::iterator it = open_codecs.begin(); it != open_codecs.end(); it++ ){
+    if( it->path == filename && it->timestamp == timestamp ){
+      _stream = it->stream;
+      _codec = it->codec;
+      _image = it->image;
+      stream_length = it->length;
+      reusable = true;
+      open_codec_bytes -= it->bytes;
+      open_codecs.erase( it );
+#ifdef DEBUG
+      logfile << "OpenJPEG :: openImage() :: Re-using open codec" << endl;
+#endif
+      if( bpc == 0 ) loadImageInfo( currentX, currentY );
+      return;
+    }
+  }
+
+#ifdef DEBUG
+  Timer timer;
+  timer.start();
+#endif
+
+  // Open the JPEG2000 file in read mode
+  IndexedStream* input = new IndexedStream;
+  input->file.rdbuf()->pubsetbuf( 0, 0 );
+  input->file.open( filename.c_str(), ios::in | ios::binary );
+  if( !input->file ){
+    delete input;
+    throw file_error( "OpenJPEG :: Unable to open '" + filename + "'" );
+  }
+  input->file.seekg( 0, ios::end );
+  input->length = input->file.tellg();
+  input->position = 0;
+  stream_length = input->length;
+
+  // Locate our codestream and check whether it uses HTJ2K code-blocks
+  OPJ_UINT64 start = find_codestream( input->file );
+  if( start == (OPJ_UINT64) -1 ){
+    delete input;
+    throw file_error( "OpenJPEG :: No codestream in file '" + filename + "'" );
+  }
+  if( codestream_capabilities( input->file, start ) & RSIZ_HTJ2K ){
+#ifdef OPJ_HAVE_HTJ2K
+#ifdef DEBUG
+    logfile << "OpenJPEG :: openImage() :: HTJ2K codestream detected" << endl;
+#endif
+#else
+    delete input;
+    throw file_error( "OpenJPEG :: HTJ2K decoding of '" + filename + "' requires OpenJPEG 2.5 or later" );
+#endif
+  }
+
+  // Our tile-part index is built on first access and kept with our image object, so that it
+  // is stored in the image cache and re-used by subsequent requests until our file changes
+  if( codestream_index.empty() || codestream_index_timestamp != timestamp ){
+    codestream_index = index_codestream( input->file, start, input->length );
+    // Store a single zero offset for codestreams we are unable to index
+    if( codestream_index.empty() ) codestream_index.push_back( 0 );
+    codestream_index_timestamp = timestamp;
+#ifdef DEBUG
+    logfile << "OpenJPEG :: openImage() :: indexed " << codestream_index.size()-1 << " tile-parts" << endl;
+#endif
+  }
+  if( codestream_index.size() > 1 ) input->bounds.assign( codestream_index.begin(), codestream_index.end() );
+
+  _stream = opj_stream_create( OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE );
+  opj_stream_set_read_function( _stream, indexed_stream_read );
+  opj_stream_set_skip_function( _stream, indexed_stream_skip );
+  opj_stream_set_seek_function( _stream, indexed_stream_seek );
+  opj_stream_set_user_data( _stream, input, indexed_stream_free );
+  opj_stream_set_user_data_length( _stream, input->length );
+
+  // Create decompression codec for either a raw codestream or a JP2 family file
+  _codec = opj_create_decompress( (start == 0) ? OPJ_CODEC_J2K : OPJ_CODEC_JP2 );
 
   // Set info, warning and error handlers for codec
 #ifdef DEBUG
@@ -70,15 +336,15 @@ void OpenJPEGImage::openImage()
     throw file_error( "OpenJPEG :: openImage() :: error setting up decoder" );
   }
 
-#ifdef DEBUG
-  Timer timer;
-  timer.start();
-#endif
-
-  // Open the JPEG2000 file in read mode
-  if( !(_stream = opj_stream_create_default_file_stream( filename.c_str(), true) ) ){
-    throw file_error( "OpenJPEG :: Unable to open '" + filename + "'" );
+#ifdef OPJ_HAVE_THREADS
+  // Decode code-blocks in parallel
+  if( threads != 1 && opj_has_thread_support() ){
+    int n = (threads == 0) ? opj_get_num_cpus() : (int) threads;
+    if( !opj_codec_set_threads( _codec, n ) ){
+      throw file_error( "OpenJPEG :: openImage() :: unable to set number of threads" );
+    }
   }
+#endif
 
 #ifdef DEBUG
   logfile << "OpenJPEG :: openImage() :: " << "Stream created" << endl;
@@ -93,6 +359,13 @@ void OpenJPEGImage::openImage()
   logfile << "OpenJPEG :: openImage() :: " << "Header read" << endl;
 #endif
 
+#ifdef OPJ_REUSE_CODEC
+  // Single-tiled codestreams can be decoded repeatedly, so our codec can be kept open
+  opj_codestream_info_v2_t* cst_info = opj_get_cstr_info( _codec );
+  reusable = ( cst_info->tw * cst_info->th == 1 );
+  opj_destroy_cstr_info( &cst_info );
+#endif
+
   // Load our metadata if not already loaded
   if( bpc == 0 ) loadImageInfo( currentX, currentY );
 
@@ -111,6 +384,29 @@ void OpenJPEGImage::closeImage()
   timer.start();
 #endif
 
+  // Keep reusable codecs open for subsequent requests, closing the oldest if necessary to remain
+  // within both our limits. Codecs which on their own exceed our memory limit are always closed
+  size_t bytes = ( reusable && _image ) ? codec_bytes( stream_length, _image ) : 0;
+  if( reusable && _codec && _stream && _image && bytes <= MAX_OPEN_CODEC_BYTES ){
+    while( !open_codecs.empty() &&
+	   ( open_codecs.size() >= MAX_OPEN_CODECS || open_codec_bytes + bytes > MAX_OPEN_CODEC_BYTES ) ){
+      OpenCodec& oldest = open_codecs.front();
+      opj_destroy_codec( oldest.codec );
+      opj_stream_destroy( oldest.stream );
+      opj_image_destroy( oldest.image );
+      open_codec_bytes -= oldest.bytes;
+      open_codecs.pop_front();
+    }
+    OpenCodec open = { getFileName( currentX, currentY ), timestamp, _stream, _codec, _image, stream_length, bytes };
+    open_codecs.push_back( open );
+    open_codec_bytes += bytes;
+    _codec = NULL;
+    _stream = NULL;
+    _image = NULL;
+    reusable = false;
+    return;
+  }
+
   if( _codec && _stream ) opj_end_decompress( _codec, _stream );
   if( _codec ){
     opj_destroy_codec( _codec );
@@ -382,8 +678,8 @@ RawTile OpenJPEGImage::getRegion( int ha, int va, unsigned int res, int layers,
 // Main processing function
 void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoffset, unsigned int tw, unsigned int th, void *d )
 {
-  // Unfortunately, it's not currently possible to re-use OpenJPEG's stream or image structures,
-  // so re-open if necessary
+  // OpenJPEG's stream and image structures can only be re-used for single-tiled codestreams
+  // with recent versions of OpenJPEG, so re-open if necessary
   if( !_image ) openImage();
 
   // Scale up our output bit depth to the nearest factor of 8
@@ -419,6 +715,7 @@ void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoff
 
   // Set number of quality layer and resolution
   opj_dparameters_t params;
+  opj_set_default_decoder_parameters( &params );
   params.cp_layer = layers;
   params.cp_reduce = vipsres;
 
@@ -427,6 +724,16 @@ void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoff
     throw file_error( "OpenJPEG :: process() :: opj_setup_decoder() failed" );
   }
 
+#ifdef OPJ_REUSE_CODEC
+  if( !opj_set_decoded_resolution_factor( _codec, vipsres ) ){
+    throw file_error( "OpenJPEG :: process() :: opj_set_decoded_resolution_factor() failed" );
+  }
+#endif
+
+  // Don't keep our codec if decoding fails
+  bool keep = reusable;
+  reusable = false;
+
 
   // Set resolution - hack for openjpeg up to 2.2.0
   for( OPJ_UINT32 i = 0; i < _image->numcomps; i++ ){
@@ -469,33 +776,36 @@ void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoff
 #endif
 
 
-  // Copy our decoded data by looping over all pixels
-  unsigned int n = 0;
-  unsigned int nk = 0;
-
-  for( unsigned int j=0; j < th; j += factor ){
-    for( unsigned int i = 0; i < tw; i += factor ){
-      for( unsigned int k = 0; k < channels; k++ ){
-        // Handle 16 and 8 bit data:
-	// OpenJPEG's output data is 32 bit unsigned int, so just mask of the bottom 2 bytes
-	// for 16 bit output or bottom 1 byte for 8 bit
-	if( obpc == 16 ){
-	  ((unsigned short*)d)[nk++] =(  (_image->comps[k].data[n]) & 0x0000ffff );
-	}
-	// Binary (bi-level) images need to be scaled up to 8 bits
-	else if( bpc == 1 ){
-	  ((unsigned char*)d)[nk++] = ((_image->comps[k].data[n]) & 0x000000f) * 255;
-	}
-	else{
-	  ((unsigned char*)d)[nk++] = (_image->comps[k].data[n]) & 0x000000ff;
-	}
+#ifdef DEBUG
+  Timer timer;
+  timer.start();
+#endif
+
+  // Interleave our decoded components into our output buffer
+  unsigned int n = ((tw + factor - 1) / factor) * ((th + factor - 1) / factor);
+
+  if( bpc != 1 ){
+    vector<OPJ_INT32*> planes( channels );
+    for( unsigned int k=0; k<channels; k++ ) planes[k] = _image->comps[k].data;
+    interleave( &planes[0], channels, n, obpc, d );
+  }
+  // Binary (bi-level) images need to be scaled up to 8 bits
+  else{
+    unsigned int nk = 0;
+    for( unsigned int i=0; i<n; i++ ){
+      for( unsigned int k=0; k<channels; k++ ){
+	((unsigned char*)d)[nk++] = ((_image->comps[k].data[i]) & 0x000000f) * 255;
       }
-      n++;
     }
   }
 
-  // We need to close the image here in case we try to use the OpenJPEG
-  // stream or image structures multiple times in the same request pipeline
-  closeImage();
+#ifdef DEBUG
+  logfile << "OpenJPEG :: component interleaving :: " << timer.getTime() << " microseconds" << endl;
+#endif
+
+  // Unless our codec can decode repeatedly, we need to close the image here in case we try
+  // to use the OpenJPEG stream or image structures multiple times in the same request pipeline
+  reusable = keep;
+  if( !reusable ) closeImage();
 
 }
@@ -38,6 +38,10 @@ class OpenJPEGImage : public IIPImage {
   opj_codec_t*  _codec;   /// codec
   opj_image_t*  _image;   /// image
 
+  unsigned int threads;   /// Number of threads used by the codec: 0 for all available processors
+  bool reusable;          /// Whether our codec can decode successive regions and be kept open between requests
+  OPJ_UINT64 stream_length; /// Length of our file, used to estimate the memory held by an open codec
+
 
   /// Main processing function
   /** @param r resolution
@@ -56,7 +60,7 @@ class OpenJPEGImage : public IIPImage {
 
   /// Constructor
   OpenJPEGImage() : IIPImage(){
-    _stream = NULL; _codec = NULL; _image = NULL;
+    _stream = NULL; _codec = NULL; _image = NULL; threads = 0; reusable = false; stream_length = 0;
     tile_width = TILESIZE; tile_height = TILESIZE; virtual_levels = 0;
   };
 
@@ -65,7 +69,7 @@ class OpenJPEGImage : public IIPImage {
   /** @param path image path
    */
   OpenJPEGImage( const std::string& path)  : IIPImage(path){
-    _stream = NULL; _codec = NULL; _image = NULL;
+    _stream = NULL; _codec = NULL; _image = NULL; threads = 0; reusable = false; stream_length = 0;
     tile_width = TILESIZE; tile_height = TILESIZE; virtual_levels = 0;
   };
 
@@ -73,14 +77,16 @@ class OpenJPEGImage : public IIPImage {
   /// Copy Constructor
   /** @param image OpenJPEG object
    */
-  OpenJPEGImage( const OpenJPEGImage& image ): IIPImage( image ) {};
+  OpenJPEGImage( const OpenJPEGImage& image ): IIPImage( image ) {
+    _stream = NULL; _codec = NULL; _image = NULL; threads = image.threads; reusable = false; stream_length = 0;
+  };
 
 
   /// Copy Constructor
   /** @param image IIPImage object
    */
   OpenJPEGImage( const IIPImage& image ) : IIPImage(image){
-    _stream = NULL; _codec = NULL; _image = NULL;
+    _stream = NULL; _codec = NULL; _image = NULL; threads = 0; reusable = false; stream_length = 0;
     tile_width = TILESIZE; tile_height = TILESIZE; virtual_levels = 0;
   };
 
@@ -89,7 +95,12 @@ class OpenJPEGImage : public IIPImage {
   ~OpenJPEGImage(){ closeImage(); };
 
 
-  /// Overloaded function for opening a TIFF image
+  /// Set the number of threads used within the codec
+  /** @param t number of threads: 0 for all available processors */
+  void setThreads( unsigned int t ){ threads = t; };
+
+
+  /// Overloaded function for opening a JP2 image
   void openImage();
 
 
@@ -19,6 +19,13 @@
 
 
 #include "PNGCompressor.h"
+#include <zlib.h>
+#include <cstdlib>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 
@@ -37,6 +44,19 @@ using namespace std;
 #define XMP_OVERHEAD_SIZE 18    // XMP overhead for PNG = prefix size + null byte
 
 
+// Images of at least this many bytes are deflated in parallel blocks (16MB)
+#define MIN_PARALLEL_BYTES 16777216
+
+// Uncompressed size of each parallel deflate block (1MB)
+#define PARALLEL_BLOCK_SIZE 1048576
+
+// Deflate window size used as the preset dictionary for each block
+#define DICTIONARY_SIZE 32768
+
+// Maximum size of the IDAT chunks we write
+#define MAX_IDAT_SIZE 1048576
+
+
 /// Check for little endianness
 inline bool byte_order_little_endian() {
   long one = 1;
@@ -86,6 +106,225 @@ static void png_warning_fn( png_structp png_ptr, png_const_charp msg ){
 }
 
 
+// Paeth predictor as defined by the PNG specification
+static inline unsigned char paeth( int a, int b, int c )
+{
+  int p = a + b - c;
+  int pa = abs( p - a );
+  int pb = abs( p - b );
+  int pc = abs( p - c );
+  if( pa <= pb && pa <= pc ) return a;
+  if( pb <= pc ) return b;
+  return c;
+}
+
+
+
+/* Filter a row of big endian image data. As in libpng, the filter with the lowest sum of absolute
+   signed differences is chosen from those enabled. The output is the filter type byte followed by
+   the filtered row. prior is NULL for the first row of the image
+*/
+static void filter_row( const unsigned char* row, const unsigned char* prior, size_t rowbytes,
+			unsigned int bpp, int filters, unsigned char* output, unsigned char* scratch )
+{
+  static const int types[5] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH };
+
+  unsigned long best_sum = (unsigned long) -1;
+
+  for( int f = 0; f < 5; f++ ){
+
+    // Always consider no filtering if no valid filter has been requested
+    if( !(filters & types[f]) && !(f == 0 && (filters & PNG_ALL_FILTERS) == 0) ) continue;
+
+    unsigned long sum = 0;
+    for( size_t i = 0; i < rowbytes; i++ ){
+      int a = (i >= bpp) ? row[i-bpp] : 0;
+      int b = prior ? prior[i] : 0;
+      int c = (prior && i >= bpp) ? prior[i-bpp] : 0;
+      unsigned char v;
+      switch( f ){
+        case 1: v = row[i] - a; break;
+        case 2: v = row[i] - b; break;
+        case 3: v = row[i] - ((a + b) >> 1); break;
+        case 4: v = row[i] - paeth( a, b, c ); break;
+        default: v = row[i];
+      }
+      scratch[i] = v;
+      sum += (v < 128) ? v : 256 - v;
+    }
+
+    if( sum < best_sum ){
+      best_sum = sum;
+      output[0] = (unsigned char) f;
+      memcpy( output + 1, scratch, rowbytes );
+    }
+  }
+}
+
+
+
+// Append a PNG chunk with its length and CRC to our output
+static void append_chunk( vector<unsigned char>& output, const char* type, const unsigned char* data, size_t length )
+{
+  unsigned char tag[8] = { (unsigned char)(length >> 24), (unsigned char)(length >> 16),
+			   (unsigned char)(length >> 8), (unsigned char) length,
+			   (unsigned char) type[0], (unsigned char) type[1], (unsigned char) type[2], (unsigned char) type[3] };
+  output.insert( output.end(), tag, tag + 8 );
+  if( length > 0 ) output.insert( output.end(), data, data + length );
+
+  uLong crc = crc32( 0L, tag + 4, 4 );
+  if( length > 0 ) crc = crc32( crc, data, length );
+  unsigned char check[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char) crc };
+  output.insert( output.end(), check, check + 4 );
+}
+
+
+
+/*
+  Large images are filtered and deflated in independent blocks of rows as in pigz. Each block is compressed
+  to a raw deflate stream using the end of the previous block as a preset dictionary and terminated with
+  a sync flush, which byte aligns the output, so the blocks can simply be concatenated into a single zlib
+  stream. The Adler-32 checksums of the blocks are combined for the zlib trailer. zlib-ng in its zlib
+  compatible mode can be linked in place of zlib for faster deflate
+*/
+void PNGCompressor::compressParallel( const RawTile& rawtile, int nthreads )
+{
+#ifdef _OPENMP
+  const unsigned char* data = (const unsigned char*) rawtile.data;
+  unsigned int bpp = channels * dest.bytes_per_pixel;
+  size_t rowbytes = (size_t) width * bpp;
+  bool swap = ( dest.bytes_per_pixel == 2 && byte_order_little_endian() );
+
+  unsigned int block_rows = PARALLEL_BLOCK_SIZE / (rowbytes + 1);
+  if( block_rows == 0 ) block_rows = 1;
+  int nblocks = (height + block_rows - 1) / block_rows;
+
+  vector< vector<unsigned char> > filtered( nblocks );
+  vector< vector<unsigned char> > deflated( nblocks );
+  vector<uLong> checksums( nblocks );
+  int strategy = (filterType == PNG_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+  string error;
+
+#pragma omp parallel num_threads(nthreads)
+  {
+    // Row buffers for our byte swapped current and prior rows as well as for trial filtering
+    vector<unsigned char> rows( 3 * rowbytes );
+    unsigned char* current = &rows[0];
+    unsigned char* prior = &rows[rowbytes];
+    unsigned char* scratch = &rows[2*rowbytes];
+
+#pragma omp for schedule(dynamic)
+    for( int n = 0; n < nblocks; n++ ){
+
+      unsigned int y0 = n * block_rows;
+      unsigned int y1 = (y0 + block_rows > height) ? height : y0 + block_rows;
+      filtered[n].resize( (size_t)(y1 - y0) * (rowbytes + 1) );
+
+      for( unsigned int y = (y0 > 0 ? y0 - 1 : 0); y < y1; y++ ){
+	unsigned char* tmp = prior; prior = current; current = tmp;
+	const unsigned char* row = &data[ (size_t) y * rowbytes ];
+	if( swap ){
+	  for( size_t i = 0; i < rowbytes; i += 2 ){
+	    current[i] = row[i+1];
+	    current[i+1] = row[i];
+	  }
+	}
+	else memcpy( current, row, rowbytes );
+	if( y < y0 ) continue;
+	filter_row( current, (y > 0 ? prior : NULL), rowbytes, bpp, filterType,
+		    &filtered[n][ (size_t)(y - y0) * (rowbytes + 1) ], scratch );
+      }
+
+      checksums[n] = adler32( 1L, &filtered[n][0], filtered[n].size() );
+    }
+
+    // Deflate each block once the filtered data of the previous block, our dictionary, is available
+#pragma omp for schedule(dynamic)
+    for( int n = 0; n < nblocks; n++ ){
+
+      z_stream z;
+      memset( &z, 0, sizeof(z) );
+      if( deflateInit2( &z, Q, Z_DEFLATED, -15, 8, strategy ) != Z_OK ){
+#pragma omp critical(pngblock)
+	error = "PNGCompressor :: Unable to initialize deflate";
+	continue;
+      }
+
+      if( n > 0 ){
+	size_t dictionary = filtered[n-1].size() < DICTIONARY_SIZE ? filtered[n-1].size() : DICTIONARY_SIZE;
+	deflateSetDictionary( &z, &filtered[n-1][ filtered[n-1].size() - dictionary ], dictionary );
+      }
+
+      int flush = (n == nblocks-1) ? Z_FINISH : Z_SYNC_FLUSH;
+      deflated[n].resize( deflateBound( &z, filtered[n].size() ) + 16 );
+      z.next_in = &filtered[n][0];
+      z.avail_in = filtered[n].size();
+
+      int status;
+      do{
+	// Grow our output if necessary
+	if( z.total_out == deflated[n].size() ) deflated[n].resize( deflated[n].size() * 2 );
+	z.next_out = &deflated[n][ z.total_out ];
+	z.avail_out = deflated[n].size() - z.total_out;
+	status = deflate( &z, flush );
+      }
+      while( status == Z_OK && z.avail_out == 0 );
+
+      // A sync flush that has already completed reports that no further progress is possible
+      if( status != Z_STREAM_END && !(flush == Z_SYNC_FLUSH && (status == Z_OK || status == Z_BUF_ERROR)) ){
+#pragma omp critical(pngblock)
+	error = "PNGCompressor :: Deflate error";
+      }
+
+      deflated[n].resize( z.total_out );
+      deflateEnd( &z );
+    }
+  }
+
+  if( !error.empty() ) throw error;
+
+
+  // Assemble our zlib stream: header, deflate blocks and combined checksum
+  int level = (Q < 2) ? 0 : ( (Q < 6) ? 1 : ( (Q == 6) ? 2 : 3 ) );
+  unsigned int cmf = 0x78;
+  unsigned int flg = level << 6;
+  flg += 31 - ((cmf << 8) + flg) % 31;
+
+  vector<unsigned char> stream;
+  stream.push_back( cmf );
+  stream.push_back( flg );
+
+  uLong adler = checksums[0];
+  for( int n = 0; n < nblocks; n++ ){
+    if( n > 0 ) adler = adler32_combine( adler, checksums[n], filtered[n].size() );
+    stream.insert( stream.end(), deflated[n].begin(), deflated[n].end() );
+    vector<unsigned char>().swap( deflated[n] );
+  }
+  vector< vector<unsigned char> >().swap( filtered );
+
+  stream.push_back( (adler >> 24) & 0xFF );
+  stream.push_back( (adler >> 16) & 0xFF );
+  stream.push_back( (adler >> 8) & 0xFF );
+  stream.push_back( adler & 0xFF );
+
+
+  // Our PNG header followed by our IDAT chunks and the IEND chunk
+  vector<unsigned char> output( dest.output, dest.output + dest.written );
+  for( size_t offset = 0; offset < stream.size(); offset += MAX_IDAT_SIZE ){
+    size_t length = (stream.size() - offset < MAX_IDAT_SIZE) ? stream.size() - offset : MAX_IDAT_SIZE;
+    append_chunk( output, "IDAT", &stream[offset], length );
+  }
+  append_chunk( output, "IEND", NULL, 0 );
+
+  delete[] dest.output;
+  header = new unsigned char[output.size()];
+  memcpy( header, &output[0], output.size() );
+  header_size = output.size();
+#endif
+}
+
+
+
 void PNGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_height )
 {
 
@@ -184,8 +423,32 @@ void PNGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_
 
 
   // Deterine header size
+  header = dest.output;
   header_size = dest.written;
 
+  parallel = false;
+
+#ifdef _OPENMP
+  // Filter and deflate large images in parallel. The whole encoded image is then returned as our header
+  int nthreads = (threads == 0) ? omp_get_max_threads() : threads;
+  if( nthreads > 1 && (size_t) width * height * channels * dest.bytes_per_pixel >= MIN_PARALLEL_BYTES ){
+    try{
+      compressParallel( rawtile, nthreads );
+    }
+    catch( const string& error ){
+      png_destroy_write_struct( &(dest.png_ptr), &(dest.info_ptr) );
+      delete[] header;
+      header = NULL;
+      header_size = 0;
+      throw;
+    }
+    png_destroy_write_struct( &(dest.png_ptr), &(dest.info_ptr) );
+    dest.png_ptr = NULL;
+    dest.info_ptr = NULL;
+    parallel = true;
+  }
+#endif
+
 }
 
 
@@ -199,6 +462,9 @@ unsigned int PNGCompressor::CompressStrip( unsigned char* input, unsigned char*
     header_size = 0;
   }
 
+  // Our image has already been fully encoded in parallel
+  if( parallel ) return 0;
+
 
   // Take into account extra bytes needed for 16bit images
   png_uint_32 ulRowBytes = width * channels * dest.bytes_per_pixel;
@@ -220,6 +486,11 @@ unsigned int PNGCompressor::CompressStrip( unsigned char* input, unsigned char*
 
 unsigned int PNGCompressor::Finish( unsigned char *output )
 {  
+  if( parallel ){
+    parallel = false;
+    return 0;
+  }
+
   dest.output = output;
   dest.written = 0;
 
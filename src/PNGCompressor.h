@@ -74,6 +74,18 @@ class PNGCompressor : public Compressor {
   /// Write XMP metadata
   void writeXMPMetadata();
 
+  /// Number of threads for parallel strip based encoding (0 for the OpenMP default)
+  int threads;
+
+  /// Whether our strip based encoding has been carried out in parallel by InitCompression
+  bool parallel;
+
+  /// Filter and deflate an entire image in parallel blocks and append the IDAT and IEND chunks to our output
+  /** @param rawtile tile containing the image to be compressed
+      @param nthreads number of threads to use
+   */
+  void compressParallel( const RawTile& rawtile, int nthreads );
+
   
  public:
 
@@ -92,6 +104,10 @@ class PNGCompressor : public Compressor {
 
     // Zlib range is 0-9
     this->Q = compressionLevel;
+    filterType = PNG_FAST_FILTERS;
+
+    threads = 1;
+    parallel = false;
 
   };
 
@@ -144,6 +160,21 @@ class PNGCompressor : public Compressor {
   inline CompressionType getCompressionType(){ return PNG; };
 
 
+  /// Set the number of threads used for strip based encoding of large images
+  /** @param t number of threads (0 for the OpenMP default) */
+  inline void setThreads( int t ) { threads = t; }
+
+
+  /// Create an independent compressor with the same settings
+  /** @return new compressor to be deleted by the caller */
+  Compressor* duplicate() {
+    PNGCompressor* c = new PNGCompressor( Q );
+    c->filterType = filterType;
+    copySettings( c );
+    return c;
+  };
+
+
   /// Get the current compression level
   /** @return Deflate compresson level */
   inline int getQuality(){ return Q; }
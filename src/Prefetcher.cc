@@ -0,0 +1,243 @@
+/*
+    IIP Tile Prefetcher
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Prefetcher.h"
+#include "TileManager.h"
+#include "JPEGCompressor.h"
+#include "Timer.h"
+
+#ifdef HAVE_PNG
+#include "PNGCompressor.h"
+#endif
+
+#ifdef HAVE_WEBP
+#include "WebPCompressor.h"
+#endif
+
+
+// Maximum number of images for which we keep track of the last tile access
+#define MAX_HISTORY 1000
+
+
+using namespace std;
+
+
+
+void Prefetcher::add( int r, int x, int y ){
+
+  if( r < 0 || r >= (int) image->getNumResolutions() || x < 0 || y < 0 ) return;
+
+  unsigned int w = image->image_widths[image->getNumResolutions()-r-1];
+  unsigned int h = image->image_heights[image->getNumResolutions()-r-1];
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+  int ntlx = (w / tw) + (w % tw == 0 ? 0 : 1);
+  int ntly = (h / th) + (h % th == 0 ? 0 : 1);
+
+  if( x >= ntlx || y >= ntly ) return;
+
+  int tile = (y*ntlx) + x;
+
+  // Make sure we don't add the same tile twice
+  for( unsigned int i=0; i<candidates.size(); i++ ){
+    if( candidates[i].resolution == r && candidates[i].tile == tile ) return;
+  }
+
+  Candidate c = { r, tile };
+  candidates.push_back( c );
+}
+
+
+
+void Prefetcher::record( IIPImage* im, int resolution, int tile, int x, int y, int l, CompressionType c, int q, bool icc ){
+
+  if( !enabled() || !im ) return;
+
+  // Create our own decoder handle if this is a new image, the image has been modified or a different
+  // channel subset is being decoded.
+  // Image types that cannot be duplicated are not prefetched
+  if( !image || image->getCachePath() != im->getCachePath() || image->timestamp != im->timestamp ){
+    IIPImage* handle = im->duplicate();
+    if( !handle ) return;
+    delete image;
+    image = handle;
+    candidates.clear();
+  }
+
+  xangle = x;
+  yangle = y;
+  layers = l;
+  ctype = c;
+  quality = q;
+  embed_icc = icc;
+
+  // Position of our tile within the tile grid
+  int num_res = image->getNumResolutions();
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+  unsigned int w = image->image_widths[num_res-resolution-1];
+  unsigned int h = image->image_heights[num_res-resolution-1];
+  int ntlx = (w / tw) + (w % tw == 0 ? 0 : 1);
+  int tx = tile % ntlx;
+  int ty = tile / ntlx;
+
+
+  // Compare with the previous access on this image to determine whether we are panning or zooming
+  int dx = 0, dy = 0;
+  bool zoom_in = false, zoom_out = false;
+
+  map<string, Access>::iterator it = history.find( image->getImagePath() );
+  if( it != history.end() ){
+    const Access& last = it->second;
+    if( last.resolution == resolution ){
+      dx = (tx > last.x) ? 1 : ( (tx < last.x) ? -1 : 0 );
+      dy = (ty > last.y) ? 1 : ( (ty < last.y) ? -1 : 0 );
+    }
+    else if( last.resolution < resolution ) zoom_in = true;
+    else zoom_out = true;
+  }
+  else if( history.size() >= MAX_HISTORY ) history.erase( history.begin() );
+
+  Access access = { resolution, tx, ty };
+  history[image->getImagePath()] = access;
+
+
+  // Pixel extent of our tile mapped onto the next resolution up and down
+  int cx0 = 0, cx1 = -1, cy0 = 0, cy1 = -1, px = -1, py = -1;
+  if( resolution+1 < num_res ){
+    unsigned long w1 = image->image_widths[num_res-resolution-2];
+    unsigned long h1 = image->image_heights[num_res-resolution-2];
+    cx0 = (tx*tw*w1/w) / tw;
+    cx1 = (((tx+1)*tw*w1/w) - 1) / tw;
+    cy0 = (ty*th*h1/h) / th;
+    cy1 = (((ty+1)*th*h1/h) - 1) / th;
+  }
+  if( resolution > 0 ){
+    unsigned long w1 = image->image_widths[num_res-resolution];
+    unsigned long h1 = image->image_heights[num_res-resolution];
+    px = (tx*tw*w1/w) / tw;
+    py = (ty*th*h1/h) / th;
+  }
+
+
+  // Queue up our candidates in order of likelihood:
+  //  1. the next tile in the direction of panning
+  //  2. the children or parent if we are zooming
+  //  3. the immediate neighbours
+  //  4. the remaining parent or children
+  if( dx || dy ) add( resolution, tx+dx, ty+dy );
+
+  if( zoom_in ){
+    for( int j=cy0; j<=cy1; j++ ) for( int i=cx0; i<=cx1; i++ ) add( resolution+1, i, j );
+  }
+  else if( zoom_out ) add( resolution-1, px, py );
+
+  add( resolution, tx+1, ty );
+  add( resolution, tx-1, ty );
+  add( resolution, tx, ty+1 );
+  add( resolution, tx, ty-1 );
+
+  add( resolution-1, px, py );
+  for( int j=cy0; j<=cy1; j++ ) for( int i=cx0; i<=cx1; i++ ) add( resolution+1, i, j );
+
+}
+
+
+
+void Prefetcher::run( Cache* tileCache, Watermark* watermark, Logger* logfile, int loglevel,
+		      bool (*interrupted)( void* ), void* arg ){
+
+  if( candidates.empty() || !image ) return;
+
+  Timer timer;
+  timer.start();
+
+  // Set up a compressor identical to that used for the original request
+  JPEGCompressor jpeg( quality, jpeg_subsampling, jpeg_optimize );
+#ifdef HAVE_PNG
+  PNGCompressor png( quality );
+  Compressor* compressor = (ctype == PNG) ? (Compressor*) &png : (Compressor*) &jpeg;
+#else
+  Compressor* compressor = &jpeg;
+#endif
+#ifdef HAVE_WEBP
+  WebPCompressor webp( quality );
+  if( ctype == WEBP ) compressor = &webp;
+#endif
+  if( embed_icc ) compressor->setICCProfile( image->getMetadata("icc") );
+
+  TileManager tilemanager( tileCache, image, watermark, compressor, logfile, loglevel );
+
+  int num_res = image->getNumResolutions();
+  unsigned int n = 0;
+  bool interrupt = false;
+
+  for( unsigned int i=0; i<candidates.size(); i++ ){
+
+    // Don't start a tile we don't expect to finish within our time budget
+    long elapsed = timer.getTime();
+    if( n >= max_tiles || elapsed + tile_time > (long) max_time ) break;
+
+    // Give way as soon as a new request is waiting
+    if( interrupted && interrupted( arg ) ){
+      interrupt = true;
+      break;
+    }
+
+    int r = candidates[i].resolution;
+    int t = candidates[i].tile;
+
+    // Skip tiles already in our cache
+    RawTile* cached = tileCache->getTile( image->getCachePath(), r, t, xangle, yangle, ctype,
+					  (ctype == UNCOMPRESSED) ? 0 : quality );
+    if( cached && cached->timestamp >= image->timestamp ) continue;
+
+    // Set the physical output resolution in the same way as for JTL requests
+    unsigned int w = image->image_widths[num_res-r-1];
+    unsigned int h = image->image_heights[num_res-r-1];
+    float dpi_x = image->dpi_x * (float) w / (float) image->getImageWidth();
+    float dpi_y = image->dpi_y * (float) h / (float) image->getImageHeight();
+    compressor->setResolution( dpi_x, dpi_y, image->dpi_units );
+
+    try{
+      tilemanager.getTile( r, t, xangle, yangle, layers, ctype );
+      n++;
+      // Update our running estimate of the time taken to prefetch a tile
+      long t_tile = timer.getTime() - elapsed;
+      tile_time = (tile_time == 0) ? t_tile : (3*tile_time + t_tile) / 4;
+    }
+    catch( const file_error& error ){
+      if( loglevel >= 3 ) *logfile << "Prefetcher :: " << error.what() << endl;
+    }
+    catch( const string& error ){
+      if( loglevel >= 3 ) *logfile << "Prefetcher :: " << error << endl;
+    }
+    catch( ... ){
+      if( loglevel >= 3 ) *logfile << "Prefetcher :: Unable to prefetch tile " << t << " at resolution " << r << endl;
+    }
+  }
+
+  if( loglevel >= 2 ){
+    *logfile << "Prefetcher :: Prefetched " << n << " tiles from " << candidates.size() << " candidates in "
+	     << timer.getTime() << " microseconds" << endl;
+    if( interrupt ) *logfile << "Prefetcher :: Stopped as a new request is pending" << endl;
+  }
+
+  candidates.clear();
+}
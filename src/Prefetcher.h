@@ -0,0 +1,150 @@
+/*
+    IIP Tile Prefetcher
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _PREFETCHER_H
+#define _PREFETCHER_H
+
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "IIPImage.h"
+#include "RawTile.h"
+#include "Cache.h"
+#include "Watermark.h"
+#include "Logger.h"
+
+
+
+/// Class to predict and prefetch the tiles a viewer is likely to request next
+/** Tile accesses are recorded as they are served. Once the response has been completed,
+    the neighbouring tiles in the direction of panning as well as the parent and child
+    tiles for zooming are decoded, encoded and inserted into the tile cache, subject to a
+    tile and time budget so as not to delay the next request for too long. Prefetching runs
+    in the request loop, so we stop as soon as a new request is waiting and do not start a
+    tile whose expected decode time would exceed what remains of our time budget. A request
+    arriving during a prefetch can therefore still be delayed by at most one tile decode.
+ */
+class Prefetcher {
+
+ private:
+
+  /// A tile we may want to prefetch
+  struct Candidate {
+    int resolution;
+    int tile;
+  };
+
+  /// Last tile access on an image: used to determine the direction of panning or zooming
+  struct Access {
+    int resolution;
+    int x;
+    int y;
+  };
+
+  unsigned int max_tiles;          ///< Maximum number of tiles to prefetch after each request
+  unsigned int max_time;           ///< Maximum time in microseconds to spend prefetching
+  long tile_time;                  ///< Running average time in microseconds taken to prefetch a tile
+
+  IIPImage* image;                 ///< Our own decoder handle for the image being prefetched
+  int xangle;                      ///< Horizontal sequence number
+  int yangle;                      ///< Vertical sequence number
+  int layers;                      ///< Number of quality layers to decode
+  CompressionType ctype;           ///< Compression type with which tiles were requested
+  int quality;                     ///< Compression quality with which tiles were requested
+  bool embed_icc;                  ///< Whether an ICC profile was embedded in the tiles
+  int jpeg_subsampling;            ///< JPEG chroma subsampling
+  bool jpeg_optimize;              ///< Whether JPEG Huffman tables are optimized
+
+  std::vector<Candidate> candidates;         ///< Tiles to prefetch in order of priority
+  std::map<std::string, Access> history;     ///< Most recent tile access for each image
+
+
+  /// Add a candidate tile if it exists and has not already been added
+  /** @param r resolution
+      @param x horizontal tile index
+      @param y vertical tile index
+   */
+  void add( int r, int x, int y );
+
+
+ public:
+
+  /// Constructor
+  /** @param tiles maximum number of tiles to prefetch after each request (0 disables prefetching)
+      @param time maximum time in microseconds to spend prefetching after each request
+      @param subsampling JPEG chroma subsampling
+      @param optimize whether to optimize JPEG Huffman tables
+   */
+  Prefetcher( unsigned int tiles, unsigned int time, int subsampling, bool optimize ){
+    max_tiles = tiles;
+    max_time = time;
+    jpeg_subsampling = subsampling;
+    jpeg_optimize = optimize;
+    image = NULL;
+    xangle = 0; yangle = 0; layers = 0;
+    ctype = JPEG; quality = 0;
+    embed_icc = false;
+    tile_time = 0;
+  };
+
+
+  /// Destructor
+  ~Prefetcher(){ delete image; };
+
+
+  /// Whether prefetching is enabled
+  bool enabled(){ return max_tiles > 0; };
+
+
+  /// Whether there are tiles waiting to be prefetched
+  bool pending(){ return !candidates.empty(); };
+
+
+  /// Record a tile access and queue up the tiles likely to be requested next
+  /** @param im image the tile was requested from
+      @param resolution resolution number
+      @param tile tile number
+      @param x horizontal sequence number
+      @param y vertical sequence number
+      @param l number of quality layers
+      @param c compression type with which the tile was requested
+      @param q compression quality
+      @param icc whether the image ICC profile was embedded
+   */
+  void record( IIPImage* im, int resolution, int tile, int x, int y, int l, CompressionType c, int q, bool icc );
+
+
+  /// Decode the queued tiles into the tile cache within our budget
+  /** Should only be called once the response for the current request has been completed
+      @param tileCache tile cache
+      @param watermark watermark object
+      @param logfile logger
+      @param loglevel logging level
+      @param interrupted function returning true if a new request is waiting, in which case we stop
+      @param arg argument passed to the interrupted function
+   */
+  void run( Cache* tileCache, Watermark* watermark, Logger* logfile, int loglevel,
+	    bool (*interrupted)( void* ) = NULL, void* arg = NULL );
+
+};
+
+
+#endif
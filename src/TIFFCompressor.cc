@@ -0,0 +1,304 @@
+/*  TIFF writer for tiled BigTIFF images
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TIFFCompressor.h"
+#include <cstring>
+#include <cmath>
+
+using namespace std;
+
+
+// Tile size in pixels. A strip of up to this height completes at most one row of tiles, which
+// then fits within the output buffer for that strip
+#define TILE_SIZE 128
+
+// TIFF field types
+#define FIELD_BYTE 1
+#define FIELD_ASCII 2
+#define FIELD_SHORT 3
+#define FIELD_LONG 4
+#define FIELD_RATIONAL 5
+#define FIELD_UNDEFINED 7
+#define FIELD_LONG8 16
+
+// Size of the BigTIFF header and of each directory entry
+#define BIGTIFF_HEADER_SIZE 16
+#define BIGTIFF_ENTRY_SIZE 20
+
+
+
+// A TIFF directory entry with its values in little endian byte order
+struct TIFFEntry {
+  unsigned short tag;
+  unsigned short type;
+  unsigned long long count;
+  string data;
+};
+
+
+
+/// Check for little endianness
+inline bool byte_order_little_endian() {
+  long one = 1;
+  return (*((char*)(&one)));
+}
+
+
+
+// Little endian helper
+static void put_le( string& s, unsigned long long value, unsigned int bytes )
+{
+  for( unsigned int i = 0; i < bytes; i++ ) s += (char) ((value >> (8*i)) & 0xFF);
+}
+
+
+
+// Add an entry with a single integer value
+static void add_entry( vector<TIFFEntry>& entries, unsigned short tag, unsigned short type, unsigned long long value )
+{
+  TIFFEntry entry = { tag, type, 1, "" };
+  put_le( entry.data, value, (type == FIELD_SHORT) ? 2 : ( (type == FIELD_LONG) ? 4 : 8 ) );
+  entries.push_back( entry );
+}
+
+
+
+// Add an entry containing raw data
+static void add_entry( vector<TIFFEntry>& entries, unsigned short tag, unsigned short type, const string& data )
+{
+  TIFFEntry entry = { tag, type, data.size(), data };
+  entries.push_back( entry );
+}
+
+
+
+void TIFFCompressor::writeHeader()
+{
+  unsigned int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  unsigned long long ntiles = (unsigned long long) tiles_x * tiles_y;
+  unsigned long long tile_bytes = (unsigned long long) TILE_SIZE * TILE_SIZE * channels * bytes_per_sample;
+
+  vector<TIFFEntry> entries;
+  string values;
+
+  // Entries must be sorted by tag
+  add_entry( entries, 256, FIELD_LONG, width );                         // ImageWidth
+  add_entry( entries, 257, FIELD_LONG, height );                        // ImageLength
+
+  for( unsigned int c = 0; c < channels; c++ ) put_le( values, bytes_per_sample * 8, 2 );
+  add_entry( entries, 258, FIELD_SHORT, values );                       // BitsPerSample
+  entries.back().count = channels;
+
+  add_entry( entries, 259, FIELD_SHORT, 1 );                            // Compression: none
+  add_entry( entries, 262, FIELD_SHORT, (channels < 3) ? 1 : 2 );       // Photometric: min-is-black or RGB
+  add_entry( entries, 277, FIELD_SHORT, channels );                     // SamplesPerPixel
+
+  // Physical resolution as rationals with 3 decimal places
+  bool resolution = ( dpi_units > 0 && dpi_x > 0 && dpi_y > 0 );
+  if( resolution ){
+    values.clear();
+    put_le( values, (unsigned long long) round( dpi_x * 1000.0 ), 4 );
+    put_le( values, 1000, 4 );
+    add_entry( entries, 282, FIELD_RATIONAL, values );                  // XResolution
+    entries.back().count = 1;
+    values.clear();
+    put_le( values, (unsigned long long) round( dpi_y * 1000.0 ), 4 );
+    put_le( values, 1000, 4 );
+    add_entry( entries, 283, FIELD_RATIONAL, values );                  // YResolution
+    entries.back().count = 1;
+  }
+
+  add_entry( entries, 284, FIELD_SHORT, 1 );                            // PlanarConfiguration: contiguous
+  if( resolution ) add_entry( entries, 296, FIELD_SHORT, (dpi_units == 2) ? 3 : 2 );  // ResolutionUnit
+
+  add_entry( entries, 305, FIELD_ASCII, string( "iipsrv/" VERSION ) + '\0' );  // Software
+
+  add_entry( entries, 322, FIELD_LONG, TILE_SIZE );                     // TileWidth
+  add_entry( entries, 323, FIELD_LONG, TILE_SIZE );                     // TileLength
+
+  // Tile offsets are filled in once we know the size of our header
+  add_entry( entries, 324, FIELD_LONG8, string( ntiles * 8, '\0' ) );   // TileOffsets
+  entries.back().count = ntiles;
+  size_t offsets = entries.size() - 1;
+
+  values.clear();
+  for( unsigned long long n = 0; n < ntiles; n++ ) put_le( values, tile_bytes, 8 );
+  add_entry( entries, 325, FIELD_LONG8, values );                       // TileByteCounts
+  entries.back().count = ntiles;
+
+  // Unassociated alpha
+  if( channels == 2 || channels == 4 ) add_entry( entries, 338, FIELD_SHORT, 2 );  // ExtraSamples
+
+  if( xmp.size() > 0 ) add_entry( entries, 700, FIELD_BYTE, xmp );     // XMP
+  if( icc.size() > 0 ) add_entry( entries, 34675, FIELD_UNDEFINED, icc );  // ICC profile
+
+
+  // Values of more than 8 bytes follow our directory, aligned to 8 bytes
+  size_t size = BIGTIFF_HEADER_SIZE + 8 + entries.size() * BIGTIFF_ENTRY_SIZE + 8;
+  for( size_t n = 0; n < entries.size(); n++ ){
+    if( entries[n].data.size() > 8 ) size += (entries[n].data.size() + 7) & ~7;
+  }
+
+  // Our tiles follow our header in the order in which they are written
+  entries[offsets].data.clear();
+  for( unsigned long long n = 0; n < ntiles; n++ ) put_le( entries[offsets].data, size + n * tile_bytes, 8 );
+
+
+  // BigTIFF header: byte order, version, offset size and the offset of our directory
+  string tiff( "II" );
+  put_le( tiff, 43, 2 );
+  put_le( tiff, 8, 2 );
+  put_le( tiff, 0, 2 );
+  put_le( tiff, BIGTIFF_HEADER_SIZE, 8 );
+
+  // Our directory followed by the offset of the next directory, of which there is none
+  size_t position = BIGTIFF_HEADER_SIZE + 8 + entries.size() * BIGTIFF_ENTRY_SIZE + 8;
+  string data;
+  put_le( tiff, entries.size(), 8 );
+  for( size_t n = 0; n < entries.size(); n++ ){
+    const TIFFEntry& entry = entries[n];
+    put_le( tiff, entry.tag, 2 );
+    put_le( tiff, entry.type, 2 );
+    put_le( tiff, entry.count, 8 );
+    if( entry.data.size() <= 8 ){
+      tiff += entry.data;
+      tiff.append( 8 - entry.data.size(), '\0' );
+    }
+    else{
+      put_le( tiff, position + data.size(), 8 );
+      data += entry.data;
+      data.append( ((entry.data.size() + 7) & ~7) - entry.data.size(), '\0' );
+    }
+  }
+  put_le( tiff, 0, 8 );
+  tiff += data;
+
+  delete[] header;
+  header = new unsigned char[tiff.size()];
+  memcpy( header, tiff.data(), tiff.size() );
+  header_size = tiff.size();
+}
+
+
+
+unsigned int TIFFCompressor::writeTiles( unsigned char* output )
+{
+  size_t row_bytes = (size_t) width * channels * bytes_per_sample;
+  size_t tile_row_bytes = (size_t) TILE_SIZE * channels * bytes_per_sample;
+  unsigned char* out = output;
+
+  for( unsigned int x = 0; x < tiles_x; x++ ){
+    size_t offset = x * tile_row_bytes;
+    size_t length = (offset + tile_row_bytes > row_bytes) ? row_bytes - offset : tile_row_bytes;
+    for( unsigned int y = 0; y < TILE_SIZE; y++ ){
+      if( y < buffered ) memcpy( out, &rows[ y * row_bytes + offset ], length );
+      else memset( out, 0, length );
+      if( length < tile_row_bytes ) memset( out + length, 0, tile_row_bytes - length );
+      out += tile_row_bytes;
+    }
+  }
+
+  buffered = 0;
+  return out - output;
+}
+
+
+
+void TIFFCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_height )
+{
+  if( rawtile.bpc != 8 && rawtile.bpc != 16 ) throw string( "TIFFCompressor :: only 8 and 16 bit images are supported" );
+  if( rawtile.channels < 1 || rawtile.channels > 4 ) throw string( "TIFFCompressor :: only 1-4 channels are supported" );
+
+  width = rawtile.width;
+  height = rawtile.height;
+  channels = rawtile.channels;
+  bytes_per_sample = rawtile.bpc / 8;
+  tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+  rows.resize( (size_t) width * TILE_SIZE * channels * bytes_per_sample );
+  buffered = 0;
+
+  writeHeader();
+}
+
+
+
+unsigned int TIFFCompressor::CompressStrip( unsigned char* input, unsigned char* output, unsigned int strip_height )
+{
+  // First delete our header if we have one
+  if( header_size > 0 && header ){
+    delete[] header;
+    header = NULL;
+    header_size = 0;
+  }
+
+  size_t row_bytes = (size_t) width * channels * bytes_per_sample;
+  bool swap = ( bytes_per_sample == 2 && !byte_order_little_endian() );
+  unsigned int written = 0;
+
+  for( unsigned int y = 0; y < strip_height; y++ ){
+
+    // Our TIFF is little endian
+    unsigned char* row = &rows[ buffered * row_bytes ];
+    memcpy( row, &input[ y * row_bytes ], row_bytes );
+    if( swap ){
+      for( size_t i = 0; i < row_bytes; i += 2 ){
+	unsigned char tmp = row[i];
+	row[i] = row[i+1];
+	row[i+1] = tmp;
+      }
+    }
+
+    if( ++buffered == TILE_SIZE ) written += writeTiles( output + written );
+  }
+
+  return written;
+}
+
+
+
+unsigned int TIFFCompressor::Finish( unsigned char* output )
+{
+  unsigned int written = (buffered > 0) ? writeTiles( output ) : 0;
+  vector<unsigned char>().swap( rows );
+  return written;
+}
+
+
+
+unsigned int TIFFCompressor::Compress( RawTile& rawtile )
+{
+  InitCompression( rawtile, rawtile.height );
+
+  unsigned int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  size_t size = header_size + (size_t) tiles_x * tiles_y * TILE_SIZE * TILE_SIZE * channels * bytes_per_sample;
+  unsigned char* output = new unsigned char[size];
+  memcpy( output, header, header_size );
+
+  size_t position = header_size;
+  position += CompressStrip( (unsigned char*) rawtile.data, output + position, rawtile.height );
+  position += Finish( output + position );
+
+  if( rawtile.memoryManaged ) delete[] (unsigned char*) rawtile.data;
+  rawtile.data = output;
+  rawtile.memoryManaged = 1;
+  rawtile.dataLength = position;
+  rawtile.compressionType = BIGTIFF;
+
+  return position;
+}
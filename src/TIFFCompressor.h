@@ -0,0 +1,121 @@
+/*  IIP TIFF Compressor Class:
+    Writes uncompressed tiled BigTIFF images as a stream
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TIFFCOMPRESSOR_H
+#define _TIFFCOMPRESSOR_H
+
+
+#include "Compressor.h"
+#include <vector>
+
+
+
+/// Writer for tiled BigTIFF images: Handles 8 and 16 bit images with 1 to 4 channels
+/** libtiff needs to be able to seek within its output, so we write our own TIFF files. As our
+    tiles are uncompressed, the size and position of every tile are known in advance and can be
+    written into the header before any image data, allowing images of any size to be sent out
+    as they are produced. Strips of image data are buffered until a complete row of tiles is available
+*/
+class TIFFCompressor : public Compressor {
+
+ private:
+
+  unsigned int width;                 ///< width of our image
+  unsigned int height;                ///< height of our image
+  unsigned int channels;              ///< number of channels
+  unsigned int bytes_per_sample;      ///< bytes per sample (1 for 8 bit and 2 for 16 bit images)
+  unsigned int tiles_x;               ///< number of tiles horizontally
+
+  std::vector<unsigned char> rows;    ///< buffer for a row of tiles
+  unsigned int buffered;              ///< number of image rows in our buffer
+
+  /// Build our TIFF header and directory
+  void writeHeader();
+
+  /// Write out our buffered row of tiles, padding any partial tiles
+  /** @param output output buffer
+      @return number of bytes written
+   */
+  unsigned int writeTiles( unsigned char* output );
+
+
+ public:
+
+  /// Constructor
+  TIFFCompressor(){
+    Q = 0;
+    dpi_x = dpi_y = 0;
+    dpi_units = 0;
+    header = NULL;
+    header_size = 0;
+    width = height = channels = bytes_per_sample = tiles_x = buffered = 0;
+  };
+
+
+  /// Destructor
+  ~TIFFCompressor(){ delete[] header; };
+
+
+  /// Initialize strip based compression
+  /** Our header contains the position of every tile within the file
+      @param rawtile tile containing the image to be compressed: only the dimensions are used
+      @param strip_height pixel height of the strips to be compressed
+   */
+  void InitCompression( const RawTile& rawtile, unsigned int strip_height );
+
+  /// Add a strip of image data and write out any completed rows of tiles
+  /** The output buffer must be able to hold strip_height rows of image data plus 64kB
+      @param s source image data
+      @param o output buffer
+      @param tile_height pixel height of the strip
+      @return number of bytes written
+   */
+  unsigned int CompressStrip( unsigned char* s, unsigned char* o, unsigned int tile_height );
+
+  /// Write out any final partial row of tiles
+  /** @param output output buffer
+      @return number of bytes written
+   */
+  unsigned int Finish( unsigned char* output );
+
+  /// Write an entire image at once
+  /** @param t tile of image data
+      @return size of the TIFF file
+   */
+  unsigned int Compress( RawTile& t );
+
+  /// Return the header size
+  inline unsigned int getHeaderSize() { return header_size; }
+
+  /// Return a pointer to the header itself
+  inline unsigned char* getHeader() { return header; }
+
+  /// Return the TIFF mime type
+  inline const char* getMimeType(){ return "image/tiff"; }
+
+  /// Return the image filename suffix
+  inline const char* getSuffix(){ return "tif"; }
+
+  /// Get compression type
+  inline CompressionType getCompressionType(){ return BIGTIFF; };
+
+};
+
+
+#endif
@@ -106,6 +106,23 @@ void TIL::run( Session* session, const std::string& a ){
   }
 
 
+  /* Fetch all the tiles within our rectangle in a single batch, so that
+     cache misses can be decoded and encoded in parallel
+   */
+  vector<TileRequest> requests;
+  for( int i = startx; i <= endx; i++ ){
+    for( int j = starty; j <= endy; j++ ){
+      TileRequest request = { *session->image, resolution, i + (j*ntlx), JPEG };
+      requests.push_back( request );
+    }
+  }
+
+  TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  tilemanager.setThreads( session->codecOptions["REGION_THREADS"] );
+  vector<RawTile> tiles = tilemanager.getTiles( requests, session->view->xangle,
+						session->view->yangle, session->view->getLayers() );
+
+
   /* Only send our MIME type once
    */
   if( (endx >= startx) && (endy >= starty) ){
@@ -114,23 +131,22 @@ void TIL::run( Session* session, const std::string& a ){
 	      "Server: iipsrv/%s\r\n"
 	      "Content-Type: application/vnd.netfpx\r\n"
 	      "Last-Modified: %s\r\n"
+	      "%s"
 	      "%s\r\n"
 	      "\r\n",
-	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
+	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getETagHeader().c_str(),
+	      session->response->getCacheControl().c_str() );
 
     session->out->putS( (const char*)str );
   }
 
 
+  unsigned int k = 0;
   for( int i = startx; i <= endx; i++ ){
     for( int j = starty; j <= endy; j++ ){
 
       int n = i + (j*ntlx);
-
-      // Get our tile using our tile manager
-      TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
-      RawTile rawtile = tilemanager.getTile( resolution, n, session->view->xangle,
-					     session->view->yangle, session->view->getLayers(), JPEG );
+      const RawTile& rawtile = tiles[k++];
 
       int len = rawtile.dataLength;
 
@@ -22,12 +22,37 @@
 
 
 #include "TPTImage.h"
+#include "Transforms.h"
 #include <sstream>
+#include <vector>
+#include <cstdio>
+#include <jpeglib.h>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
 
 
 using namespace std;
 
 
+// Size of the virtual tiles with which we serve stripped images
+#define STRIP_TILE_SIZE 256
+
+// Maximum memory in bytes used to cache decoded strips
+#define MAX_STRIP_CACHE 67108864
+
+
+// Copy a single channel plane into its position within interleaved data
+template <typename T> static void interleave( const T* plane, T* output, size_t np, unsigned int channels, unsigned int c ){
+  output += c;
+  for( size_t i = 0; i < np; i++ ){
+    *output = plane[i];
+    output += channels;
+  }
+}
+
+
 void TPTImage::openImage()
 {
 
@@ -63,7 +88,7 @@ void TPTImage::loadImageInfo( int seq, int ang )
 {
   tdir_t current_dir;
   int count;
-  uint16_t colour, samplesperpixel, bitspersample, sampleformat;
+  uint16_t colour, samplesperpixel, bitspersample, sampleformat, planarconfig = PLANARCONFIG_CONTIG;
   double sminvaluearr[4] = {0.0}, smaxvaluearr[4] = {0.0};
   double *sminvalue = NULL, *smaxvalue = NULL;
   unsigned int w, h;
@@ -82,10 +107,17 @@ void TPTImage::loadImageInfo( int seq, int ang )
   TIFFGetField( tiff, TIFFTAG_BITSPERSAMPLE, &bitspersample );
   TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &colour );
   TIFFGetField( tiff, TIFFTAG_SAMPLEFORMAT, &sampleformat );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planarconfig );
   TIFFGetField( tiff, TIFFTAG_XRESOLUTION, &dpi_x );
   TIFFGetField( tiff, TIFFTAG_YRESOLUTION, &dpi_y );
   TIFFGetField( tiff, TIFFTAG_RESOLUTIONUNIT, &dpi_units );
 
+  // Stripped images are served through a virtual tile grid
+  if( !TIFFIsTiled( tiff ) ){
+    tile_width = STRIP_TILE_SIZE;
+    tile_height = STRIP_TILE_SIZE;
+  }
+
   // Units for libtiff are 1=unknown, 2=DPI and 3=pixels/cm, whereas we want 0=unknown, 1=DPI and 2=pixels/cm
   dpi_units--;
 
@@ -93,6 +125,7 @@ void TPTImage::loadImageInfo( int seq, int ang )
   channels = (unsigned int) samplesperpixel;
   bpc = (unsigned int) bitspersample;
   sampleType = (sampleformat==3) ? FLOATINGPOINT : FIXEDPOINT;
+  separate_planes = (planarconfig == PLANARCONFIG_SEPARATE);
 
   // Check for the no. of resolutions in the pyramidal image
   current_dir = TIFFCurrentDirectory( tiff );
@@ -103,7 +136,11 @@ void TPTImage::loadImageInfo( int seq, int ang )
 
   // Get subifd data (mostly for OME_TIFF support)
   initializeSubIfdOffsets();
-  
+
+  // Clear any sizes from a previous load
+  image_widths.clear();
+  image_heights.clear();
+
   image_widths.push_back(w);
   image_heights.push_back(h);
   if (subIfdOffsets.size())
@@ -131,6 +168,22 @@ void TPTImage::loadImageInfo( int seq, int ang )
     numResolutions = count + 1;
   }
 
+  // If we don't have enough resolutions to fit a whole image into a single tile, synthesize
+  // virtual resolutions below the smallest physical resolution, halving and rounding up at each
+  // level, as for JPEG2000. These are generated on demand by downsampling. Images with a full
+  // pyramid are left unchanged, so their resolution numbering and smallest level are unaffected
+  virtual_levels = 0;
+  w = image_widths.back();
+  h = image_heights.back();
+  while( tile_width && tile_height && ( w > tile_width || h > tile_height ) ){
+    w = (w + 1) / 2;
+    h = (h + 1) / 2;
+    image_widths.push_back( w );
+    image_heights.push_back( h );
+    virtual_levels++;
+  }
+  numResolutions += virtual_levels;
+
   // Reset the TIFF directory
   if( !TIFFSetDirectory( tiff, current_dir ) ){
     throw file_error( "TPTImage :: TIFFSetDirectory() failed" );
@@ -215,6 +268,15 @@ void TPTImage::closeImage()
     _TIFFfree( tile_buf );
     tile_buf = NULL;
   }
+  strip_cache.clear();
+  strip_order.clear();
+  strip_cache_size = 0;
+#ifdef HAVE_TURBOJPEG
+  if( jpeg_decoder != NULL ){
+    tj3Destroy( (tjhandle) jpeg_decoder );
+    jpeg_decoder = NULL;
+  }
+#endif
 }
 
 
@@ -227,7 +289,7 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 
   // Check the resolution exists
-  if( res > numResolutions ){
+  if( res >= numResolutions ){
     ostringstream error;
     error << "TPTImage :: Asked for non-existent resolution: " << res;
     throw file_error( error.str() );
@@ -261,28 +323,23 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   }
 
 
+  // Virtual resolutions are generated from the smallest physical resolution
+  if( res < virtual_levels ){
+    return getVirtualTile( seq, ang, res, layers, tile );
+  }
+
+
   // The first resolution is the highest, so we need to invert
   //  the resolution - can avoid this if we store our images with
   //  the smallest image first.
   int vipsres = ( numResolutions - 1 ) - res;
 
   // Change to the right directory for the resolution
-  if (subIfdOffsets.empty() || vipsres == 0)
-  {
-    if (!TIFFSetDirectory(tiff, vipsres))
-    {
-      stringstream s;
-      s << "subifd: " << !subIfdOffsets.empty() << endl;
-      s << "numres: " << numResolutions << "\nres: " << res << "\nvipsres: " << vipsres << endl;
-      throw file_error(s.str());
-    }
-  }
-  else
-  {
-    if (!TIFFSetSubDirectory(tiff, subIfdOffsets[vipsres - 1]))
-    {
-      throw file_error("TPTImage :: TIFFSetSubDirectory() failed");
-    }
+  selectDirectory( vipsres );
+
+  // Stripped resolutions are assembled from their strips
+  if( !TIFFIsTiled( tiff ) ){
+    return getStripTile( seq, ang, res, tile );
   }
 
   // Check that a valid tile number was given
@@ -357,6 +414,51 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   else colourspace = sRGB;
 
 
+  // Channels stored as separate planes are read one plane at a time and interleaved,
+  // skipping any planes outside of our channel subset
+  if( separate_planes && channels > 1 && bpc % 8 == 0 ){
+
+    unsigned int bytes = bpc / 8;
+    tsize_t plane_size = TIFFTileSize( tiff );
+    ttile_t tiles_per_plane = TIFFNumberOfTiles( tiff ) / channels;
+
+    RawTile rawtile( tile, res, seq, ang, tw, th, channels, bpc );
+    rawtile.filename = getImagePath();
+    rawtile.timestamp = timestamp;
+    rawtile.padded = true;
+    rawtile.sampleType = sampleType;
+    rawtile.dataLength = np * channels * bytes;
+
+    if( bpc == 16 ) rawtile.data = new unsigned short[np*channels];
+    else if( bpc == 32 && sampleType == FLOATINGPOINT ) rawtile.data = new float[np*channels];
+    else if( bpc == 32 ) rawtile.data = new unsigned int[np*channels];
+    else rawtile.data = new unsigned char[np*channels];
+
+    if( !channel_subset.empty() ) memset( rawtile.data, 0, rawtile.dataLength );
+
+    if( !tile_buf ){
+      if( ( tile_buf = _TIFFmalloc( plane_size ) ) == NULL ){
+	throw file_error( "TPTImage :: TIFFmalloc() failed" );
+      }
+    }
+
+    for( unsigned int c = 0; c < channels; c++ ){
+
+      if( !channel_subset.empty() && !channel_subset[c] ) continue;
+
+      if( TIFFReadEncodedTile( tiff, (ttile_t) (tile + c*tiles_per_plane), tile_buf, plane_size ) == -1 ){
+	throw file_error( "TPTImage :: TIFFReadEncodedTile() failed for " + getFileName( seq, ang ) );
+      }
+
+      if( bytes == 1 ) interleave( (unsigned char*) tile_buf, (unsigned char*) rawtile.data, np, channels, c );
+      else if( bytes == 2 ) interleave( (unsigned short*) tile_buf, (unsigned short*) rawtile.data, np, channels, c );
+      else if( bytes == 4 ) interleave( (unsigned int*) tile_buf, (unsigned int*) rawtile.data, np, channels, c );
+    }
+
+    return rawtile;
+  }
+
+
   // Allocate memory for our tile.
   if( !tile_buf ){
     if( ( tile_buf = _TIFFmalloc( TIFFTileSize(tiff) ) ) == NULL ){
@@ -364,9 +466,27 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
     }
   }
 
+  int length = -1;
+
+#ifdef HAVE_TURBOJPEG
+  // Decode 8 bit JPEG compressed tiles with TurboJPEG rather than through libtiff's JPEG codec
+  uint16_t compression = 0;
+  TIFFGetField( tiff, TIFFTAG_COMPRESSION, &compression );
+  if( compression == COMPRESSION_JPEG && bpc == 8 && (channels == 1 || channels == 3) &&
+      (colour == PHOTOMETRIC_YCBCR || colour == PHOTOMETRIC_MINISBLACK) &&
+      np == tile_width * tile_height && TIFFTileSize( tiff ) >= (tmsize_t) np * channels ){
+    try{
+      decodeJPEGTile( (ttile_t) tile, 1, colour, (unsigned char*) tile_buf );
+      length = np * channels;
+    }
+    // Fall back to libtiff
+    catch( const string& ){ length = -1; }
+  }
+#endif
+
   // Decode and read the tile
-  int length = TIFFReadEncodedTile( tiff, (ttile_t) tile,
-				    tile_buf, (tsize_t) - 1 );
+  if( length == -1 ) length = TIFFReadEncodedTile( tiff, (ttile_t) tile,
+						   tile_buf, (tsize_t) - 1 );
   if( length == -1 ) {
     throw file_error( "TPTImage :: TIFFReadEncodedTile() failed for " + getFileName( seq, ang ) );
   }
@@ -419,9 +539,450 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   return( rawtile );
 }
 
+void TPTImage::selectDirectory( int vipsres )
+{
+  if (subIfdOffsets.empty() || vipsres == 0)
+  {
+    if (!TIFFSetDirectory(tiff, vipsres))
+    {
+      stringstream s;
+      s << "subifd: " << !subIfdOffsets.empty() << endl;
+      s << "numres: " << numResolutions << "\nvipsres: " << vipsres << endl;
+      throw file_error(s.str());
+    }
+  }
+  else
+  {
+    if (!TIFFSetSubDirectory(tiff, subIfdOffsets[vipsres - 1]))
+    {
+      throw file_error("TPTImage :: TIFFSetSubDirectory() failed");
+    }
+  }
+}
+
+
+string TPTImage::getCachePath()
+{
+  if( !separate_planes || channel_subset.empty() ) return getImagePath();
+
+  string path = getImagePath() + ":";
+  for( unsigned int i = 0; i < channel_subset.size(); i++ ) path += channel_subset[i] ? '1' : '0';
+  return path;
+}
+
+
+
+const unsigned char* TPTImage::getStrip( unsigned int res, tstrip_t strip )
+{
+  pair<unsigned int,tstrip_t> key( res, strip );
+
+  map< pair<unsigned int,tstrip_t>, vector<unsigned char> >::iterator it = strip_cache.find( key );
+  if( it != strip_cache.end() ) return &(it->second)[0];
+
+  tmsize_t size = TIFFStripSize( tiff );
+  vector<unsigned char> buffer( size );
+  if( TIFFReadEncodedStrip( tiff, strip, &buffer[0], size ) == -1 ){
+    throw file_error( "TPTImage :: TIFFReadEncodedStrip() failed for " + getFileName( currentX, currentY ) );
+  }
+
+  // Evict our oldest strips to stay within our memory limit
+  while( !strip_order.empty() && strip_cache_size + size > MAX_STRIP_CACHE ){
+    it = strip_cache.find( strip_order.front() );
+    strip_cache_size -= it->second.size();
+    strip_cache.erase( it );
+    strip_order.pop_front();
+  }
+
+  strip_order.push_back( key );
+  strip_cache_size += size;
+
+  vector<unsigned char>& entry = strip_cache[key];
+  entry.swap( buffer );
+  return &entry[0];
+}
+
+
+
+RawTile TPTImage::getStripTile( int seq, int ang, unsigned int res, unsigned int tile )
+{
+  uint32_t im_width = 0, im_height = 0, rows_per_strip = 0;
+  uint16_t colour = 0, planar = PLANARCONFIG_CONTIG, samples = 1;
+
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &colour );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_SAMPLESPERPIXEL, &samples );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip );
+  if( rows_per_strip == 0 || rows_per_strip > im_height ) rows_per_strip = im_height;
+
+  // JPEG encoded strips can be subsampled YCbCr encoded. Ask to decode these to RGB
+  if( colour == PHOTOMETRIC_YCBCR ) TIFFSetField( tiff, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
+
+  // Colourmapped images are returned as palette indices in the same way as tiled images
+  if( colour == PHOTOMETRIC_PALETTE ){
+    colourspace = GREYSCALE;
+    channels = 1;
+  }
+
+  if( (bpc != 1 && bpc % 8 != 0) || (bpc == 1 && samples != 1) ){
+    throw file_error( "TPTImage :: Unsupported bit depth for stripped image" );
+  }
+
+  // Calculate the number of tiles in each direction in our virtual tile grid
+  unsigned int ntlx = (im_width / tile_width) + (im_width % tile_width == 0 ? 0 : 1);
+  unsigned int ntly = (im_height / tile_height) + (im_height % tile_height == 0 ? 0 : 1);
+
+  if( tile >= ntlx * ntly ){
+    ostringstream tile_no;
+    tile_no << "TPTImage :: Asked for non-existent tile: " << tile;
+    throw file_error( tile_no.str() );
+  }
+
+  // Position and size of our tile. Edge tiles are not padded
+  unsigned int x0 = (tile % ntlx) * tile_width;
+  unsigned int y0 = (tile / ntlx) * tile_height;
+  unsigned int tw = (im_width - x0 < tile_width) ? im_width - x0 : tile_width;
+  unsigned int th = (im_height - y0 < tile_height) ? im_height - y0 : tile_height;
+
+  // Samples are either interleaved within each strip or stored in separate planes
+  unsigned int planes = (planar == PLANARCONFIG_SEPARATE) ? samples : 1;
+  unsigned int interleaved = samples / planes;
+  unsigned int obpc = (bpc == 1) ? 8 : bpc;
+  unsigned int bytes = obpc / 8;
+  size_t scanline = TIFFScanlineSize( tiff );
+  size_t np = (size_t) tw * th * samples;
+
+  RawTile rawtile( tile, res, seq, ang, tw, th, samples, obpc );
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+  rawtile.sampleType = sampleType;
+  rawtile.padded = false;
+  rawtile.dataLength = np * bytes;
+
+  if( obpc == 16 ) rawtile.data = new unsigned short[np];
+  else if( obpc == 32 && sampleType == FLOATINGPOINT ) rawtile.data = new float[np];
+  else if( obpc == 32 ) rawtile.data = new unsigned int[np];
+  else rawtile.data = new unsigned char[np];
+
+  // Take into account photometric interpretation for bilevel images:
+  //   0: white is zero, 1: black is zero
+  unsigned char min = (colour == 0) ? 255 : 0;
+  unsigned char max = (colour == 0) ? 0 : 255;
+
+  unsigned char* out = (unsigned char*) rawtile.data;
+
+  // Skip any planes outside of our channel subset
+  bool subset = (planes > 1 && channel_subset.size() == planes);
+  if( subset ) memset( out, 0, rawtile.dataLength );
+
+  for( unsigned int p = 0; p < planes; p++ ){
+
+    if( subset && !channel_subset[p] ) continue;
+
+    for( unsigned int j = 0; j < th; j++ ){
+
+      uint32_t row = y0 + j;
+      const unsigned char* line = getStrip( res, TIFFComputeStrip( tiff, row, p ) ) + (size_t)(row % rows_per_strip) * scanline;
+      unsigned char* dst = out + (size_t) j * tw * samples * bytes;
+
+      if( bpc == 1 ){
+	// Unpack bits, which are usually MSB2LSB
+	for( unsigned int i = 0; i < tw; i++ ){
+	  unsigned int x = x0 + i;
+	  dst[i*samples + p] = (line[x/8] & (0x80 >> (x%8))) ? max : min;
+	}
+      }
+      else if( planes == 1 ){
+	memcpy( dst, line + (size_t) x0 * interleaved * bytes, (size_t) tw * interleaved * bytes );
+      }
+      else{
+	for( unsigned int i = 0; i < tw; i++ ){
+	  memcpy( dst + ((size_t) i*samples + p) * bytes, line + (size_t)(x0 + i) * bytes, bytes );
+	}
+      }
+    }
+  }
+
+  return rawtile;
+}
+
+
+
+// Our JPEG error_exit function: throw an exception rather than exit
+METHODDEF(void) tpt_jpeg_error_exit( j_common_ptr cinfo )
+{
+  char buffer[ JMSG_LENGTH_MAX ];
+  (*cinfo->err->format_message) ( cinfo, buffer );
+  jpeg_destroy( cinfo );
+  throw string( buffer );
+}
+
+
+void TPTImage::decodeJPEGTile( ttile_t t, unsigned int scale, uint16_t photometric, unsigned char* buffer )
+{
+  // Read the raw JPEG stream for this tile along with any shared JPEG tables
+  toff_t *bytecounts = NULL;
+  if( !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &bytecounts ) || !bytecounts || bytecounts[t] == 0 ){
+    throw string( "TPTImage :: Unable to get tile byte count" );
+  }
+
+  vector<unsigned char> raw( bytecounts[t] );
+  tmsize_t length = TIFFReadRawTile( tiff, t, &raw[0], raw.size() );
+  if( length <= 2 ) throw string( "TPTImage :: TIFFReadRawTile() failed" );
+
+  uint32_t ntables = 0;
+  void *tables = NULL;
+  TIFFGetField( tiff, TIFFTAG_JPEGTABLES, &ntables, &tables );
+
+  unsigned int stride = (tile_width / scale) * channels;
+
+#ifdef HAVE_TURBOJPEG
+
+  // TurboJPEG infers the colour space from the number of components, so RGB encoded tiles are left to libjpeg
+  if( photometric != PHOTOMETRIC_RGB ){
+
+    if( !jpeg_decoder ){
+      if( (jpeg_decoder = tj3Init( TJINIT_DECOMPRESS )) == NULL ){
+	throw string( "TPTImage :: Unable to initialize TurboJPEG" );
+      }
+    }
+    tjhandle tj = (tjhandle) jpeg_decoder;
+
+    // TurboJPEG needs a complete stream, so merge the abbreviated table stream (minus its EOI marker)
+    // with the tile stream (minus its SOI marker)
+    const unsigned char* stream = &raw[0];
+    size_t stream_length = length;
+    vector<unsigned char> merged;
+    if( tables && ntables > 4 ){
+      merged.reserve( ntables - 2 + length - 2 );
+      merged.insert( merged.end(), (unsigned char*) tables, (unsigned char*) tables + ntables - 2 );
+      merged.insert( merged.end(), raw.begin() + 2, raw.begin() + length );
+      stream = &merged[0];
+      stream_length = merged.size();
+    }
+
+    tjscalingfactor factor = { 1, (int) scale };
+    tj3Set( tj, TJPARAM_FASTDCT, 1 );
+    if( tj3DecompressHeader( tj, stream, stream_length ) == -1 || tj3SetScalingFactor( tj, factor ) == -1 ){
+      throw string( "TPTImage :: " ) + tj3GetErrorStr( tj );
+    }
+
+    unsigned int w = TJSCALED( tj3Get( tj, TJPARAM_JPEGWIDTH ), factor );
+    unsigned int h = TJSCALED( tj3Get( tj, TJPARAM_JPEGHEIGHT ), factor );
+    if( w * channels > stride || h > tile_height / scale ){
+      throw string( "TPTImage :: Unexpected scaled JPEG tile size" );
+    }
+
+    if( tj3Decompress8( tj, stream, stream_length, buffer, stride, (channels == 1) ? TJPF_GRAY : TJPF_RGB ) == -1 ){
+      throw string( "TPTImage :: " ) + tj3GetErrorStr( tj );
+    }
+    return;
+  }
+
+#endif
+
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error( &jerr );
+  jerr.error_exit = tpt_jpeg_error_exit;
+  jpeg_create_decompress( &cinfo );
+
+  // Load the abbreviated table stream first so that the tile stream can refer to it
+  if( tables && ntables > 0 ){
+    jpeg_mem_src( &cinfo, (unsigned char*) tables, ntables );
+    jpeg_read_header( &cinfo, FALSE );
+  }
+
+  jpeg_mem_src( &cinfo, &raw[0], length );
+  jpeg_read_header( &cinfo, TRUE );
+
+  // TIFF JPEG streams have no JFIF or Adobe markers, so set the colour space explicitly
+  if( photometric == PHOTOMETRIC_YCBCR ) cinfo.jpeg_color_space = JCS_YCbCr;
+  else if( photometric == PHOTOMETRIC_RGB ) cinfo.jpeg_color_space = JCS_RGB;
+  else cinfo.jpeg_color_space = JCS_GRAYSCALE;
+  cinfo.out_color_space = (cinfo.num_components == 1) ? JCS_GRAYSCALE : JCS_RGB;
+
+  // Let the IDCT do the downsampling for us
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale;
+  cinfo.dct_method = JDCT_IFAST;
+
+  jpeg_start_decompress( &cinfo );
+
+  if( cinfo.output_width * cinfo.output_components > stride || cinfo.output_height > tile_height / scale ){
+    jpeg_destroy_decompress( &cinfo );
+    throw string( "TPTImage :: Unexpected scaled JPEG tile size" );
+  }
+
+  while( cinfo.output_scanline < cinfo.output_height ){
+    JSAMPROW row = buffer + (size_t) cinfo.output_scanline * stride;
+    jpeg_read_scanlines( &cinfo, &row, 1 );
+  }
+
+  jpeg_finish_decompress( &cinfo );
+  jpeg_destroy_decompress( &cinfo );
+
+#else
+  throw string( "TPTImage :: Scaled JPEG decoding not supported by this libjpeg" );
+#endif
+}
+
+
+
+RawTile TPTImage::getVirtualTile( int seq, int ang, unsigned int res, int layers, unsigned int tile )
+{
+  // Our source is the smallest physical resolution, which we need to shrink by this factor
+  unsigned int base = virtual_levels;
+  unsigned int factor = 1 << (base - res);
+
+  unsigned int im_width = image_widths[numResolutions-1-res];
+  unsigned int im_height = image_heights[numResolutions-1-res];
+  unsigned int base_width = image_widths[numResolutions-1-base];
+  unsigned int base_height = image_heights[numResolutions-1-base];
+
+  unsigned int ntlx = (im_width / tile_width) + (im_width % tile_width == 0 ? 0 : 1);
+  unsigned int ntly = (im_height / tile_height) + (im_height % tile_height == 0 ? 0 : 1);
+
+  if( tile >= ntlx * ntly ){
+    ostringstream tile_no;
+    tile_no << "TPTImage :: Asked for non-existent tile: " << tile;
+    throw file_error( tile_no.str() );
+  }
+
+  // Size of our output tile
+  unsigned int tx = tile % ntlx;
+  unsigned int ty = tile / ntlx;
+  unsigned int tw = (im_width - tx*tile_width < tile_width) ? im_width - tx*tile_width : tile_width;
+  unsigned int th = (im_height - ty*tile_height < tile_height) ? im_height - ty*tile_height : tile_height;
+
+  // Area of the physical resolution covered by our tile
+  unsigned int x0 = tx * tile_width * factor;
+  unsigned int y0 = ty * tile_height * factor;
+  unsigned int x1 = (x0 + tw*factor < base_width) ? x0 + tw*factor : base_width;
+  unsigned int y1 = (y0 + th*factor < base_height) ? y0 + th*factor : base_height;
+
+  selectDirectory( numResolutions - 1 - base );
+
+  uint16_t compression = 0, planar = PLANARCONFIG_CONTIG, photometric = 0;
+  TIFFGetField( tiff, TIFFTAG_COMPRESSION, &compression );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &photometric );
+
+  // JPEG compressed 8 bit tiles can be decoded directly at up to 1/8 scale within the IDCT
+  unsigned int scale = 1;
+  if( TIFFIsTiled( tiff ) && compression == COMPRESSION_JPEG && bpc == 8 && planar == PLANARCONFIG_CONTIG &&
+      (channels == 1 || channels == 3) && tile_width % 8 == 0 && tile_height % 8 == 0 &&
+      (photometric == PHOTOMETRIC_YCBCR || photometric == PHOTOMETRIC_RGB || photometric == PHOTOMETRIC_MINISBLACK) ){
+    scale = (factor < 8) ? factor : 8;
+  }
+
+  unsigned int base_ntlx = (base_width / tile_width) + (base_width % tile_width == 0 ? 0 : 1);
+  RawTile mosaic( tile, res, seq, ang );
+
+  // Fall back to full decoding if the scaled decode fails for whatever reason
+  for( ; ; scale = 1 ){
+
+    // Our mosaic in scaled coordinates. Offsets are exact multiples of the scale
+    unsigned int sx = x0 / scale;
+    unsigned int sy = y0 / scale;
+    unsigned int mw = (x1 - x0 + scale - 1) / scale;
+    unsigned int mh = (y1 - y0 + scale - 1) / scale;
+    unsigned int stw = tile_width / scale;
+    unsigned int sth = tile_height / scale;
+
+    vector<unsigned char> scaled;
+    if( scale > 1 ) scaled.resize( (size_t) stw * sth * channels );
+
+    try{
+      for( unsigned int j = y0/tile_height; j <= (y1-1)/tile_height; j++ ){
+	for( unsigned int i = x0/tile_width; i <= (x1-1)/tile_width; i++ ){
+
+	  ttile_t t = j*base_ntlx + i;
+	  unsigned char* ptr;
+	  unsigned int bytes;
+	  unsigned int stride, pw, ph;
+	  RawTile rawtile;
+
+	  if( scale > 1 ){
+	    decodeJPEGTile( t, scale, photometric, &scaled[0] );
+	    ptr = &scaled[0];
+	    bytes = channels;
+	    stride = pw = stw;
+	    ph = sth;
+	    if( !mosaic.data ){
+	      mosaic.channels = channels;
+	      mosaic.bpc = 8;
+	      mosaic.data = new unsigned char[(size_t)mw*mh*channels];
+	    }
+	  }
+	  else{
+	    // Tiled images return edge tiles padded to the full tile size, but the
+	    // virtual tiles of stripped images are returned at their actual size
+	    rawtile = getTile( seq, ang, base, layers, t );
+	    ptr = (unsigned char*) rawtile.data;
+	    bytes = rawtile.channels * (rawtile.bpc/8);
+	    stride = rawtile.padded ? tile_width : rawtile.width;
+	    pw = rawtile.width;
+	    ph = rawtile.height;
+	    if( !mosaic.data ){
+	      mosaic.channels = rawtile.channels;
+	      mosaic.bpc = rawtile.bpc;
+	      mosaic.sampleType = rawtile.sampleType;
+	      size_t n = (size_t) mw*mh*rawtile.channels;
+	      if( rawtile.bpc == 16 ) mosaic.data = new unsigned short[n];
+	      else if( rawtile.bpc == 32 && rawtile.sampleType == FLOATINGPOINT ) mosaic.data = new float[n];
+	      else if( rawtile.bpc == 32 ) mosaic.data = new unsigned int[n];
+	      else mosaic.data = new unsigned char[n];
+	    }
+	  }
+
+	  // Copy the part of this tile that lies within our mosaic
+	  unsigned int ox = i * stw;
+	  unsigned int oy = j * sth;
+	  unsigned int cx0 = (ox > sx) ? ox : sx;
+	  unsigned int cx1 = (ox + pw < sx + mw) ? ox + pw : sx + mw;
+	  unsigned int cy0 = (oy > sy) ? oy : sy;
+	  unsigned int cy1 = (oy + ph < sy + mh) ? oy + ph : sy + mh;
+
+	  for( unsigned int k = cy0; k < cy1; k++ ){
+	    memcpy( (unsigned char*) mosaic.data + ((size_t)(k-sy)*mw + (cx0-sx)) * bytes,
+		    ptr + ((size_t)(k-oy)*stride + (cx0-ox)) * bytes,
+		    (cx1-cx0) * bytes );
+	  }
+	}
+      }
+    }
+    catch( const string& error ){
+      if( scale == 1 ) throw file_error( error );
+      delete[] (unsigned char*) mosaic.data;
+      mosaic.data = NULL;
+      selectDirectory( numResolutions - 1 - base );
+      continue;
+    }
+
+    mosaic.width = mw;
+    mosaic.height = mh;
+    mosaic.dataLength = mw * mh * mosaic.channels * (mosaic.bpc/8);
+    break;
+  }
+
+  // Area average down to our virtual resolution
+  Transform().downsample( mosaic, factor / scale );
+
+  mosaic.filename = getImagePath();
+  mosaic.timestamp = timestamp;
+  mosaic.padded = false;
+
+  return mosaic;
+}
+
 bool TPTImage::initializeSubIfdOffsets() {
     uint16 subIfdCount = 0;
     uint64 *offsets = nullptr;
+    subIfdOffsets.clear();
     bool success = TIFFGetField(tiff, TIFFTAG_SUBIFD, &subIfdCount, &offsets);
     subIfdOffsets.insert(subIfdOffsets.begin(), offsets, offsets + subIfdCount);
     return success;
@@ -45,6 +45,24 @@ class TPTImage : public IIPImage {
   /// Offsets of subifds
   std::vector<uint64> subIfdOffsets;
 
+  /// Decoded strips of stripped images indexed by resolution and strip number
+  std::map< std::pair<unsigned int,tstrip_t>, std::vector<unsigned char> > strip_cache;
+
+  /// Order in which strips were added to our strip cache
+  std::list< std::pair<unsigned int,tstrip_t> > strip_order;
+
+  /// Total size in bytes of our cached strips
+  size_t strip_cache_size;
+
+  /// Whether channels are stored as separate planes
+  bool separate_planes;
+
+  /// Channels to decode from separate planes - empty for all channels
+  std::vector<bool> channel_subset;
+
+  /// TurboJPEG decompression handle, created on first use when built with TurboJPEG
+  void* jpeg_decoder;
+
   /**
    * @brief Initializes vector of subifd offsets.
    * 
@@ -53,21 +71,61 @@ class TPTImage : public IIPImage {
    */
   bool initializeSubIfdOffsets();
 
+  /// Change to the TIFF directory holding a particular physical resolution
+  /** @param vipsres directory index where 0 is the full size image
+   */
+  void selectDirectory( int vipsres );
+
+  /// Get a tile from a stripped image by assembling it from the strips that it overlaps
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param t tile number within our virtual tile grid
+   */
+  RawTile getStripTile( int x, int y, unsigned int r, unsigned int t );
+
+  /// Get a decoded strip from our strip cache, decoding it if necessary
+  /** @param r resolution
+      @param s strip number within the current directory
+      @return pointer to decoded strip data, valid until the next call
+   */
+  const unsigned char* getStrip( unsigned int r, tstrip_t s );
+
+  /// Generate a tile for a virtual resolution by downsampling the smallest physical resolution
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param l quality layers
+      @param t tile number
+   */
+  RawTile getVirtualTile( int x, int y, unsigned int r, int l, unsigned int t );
+
+  /// Decode a JPEG compressed tile directly, optionally at a reduced size using DCT scaling
+  /** @param t tile number within the current directory
+      @param scale downsampling factor: 1, 2, 4 or 8
+      @param photometric TIFF photometric interpretation of the current directory
+      @param buffer output buffer large enough for the scaled tile
+   */
+  void decodeJPEGTile( ttile_t t, unsigned int scale, uint16_t photometric, unsigned char* buffer );
+
 
  public:
 
   /// Constructor
-  TPTImage():IIPImage(), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage():IIPImage(), tiff( NULL ), tile_buf( NULL ), strip_cache_size( 0 ), separate_planes( false ),
+    jpeg_decoder( NULL ) {};
 
   /// Constructor
   /** @param path image path
    */
-  TPTImage( const std::string& path ): IIPImage( path ), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage( const std::string& path ): IIPImage( path ), tiff( NULL ), tile_buf( NULL ), strip_cache_size( 0 ),
+    separate_planes( false ), jpeg_decoder( NULL ) {};
 
   /// Copy Constructor
   /** @param image IIPImage object
    */
-  TPTImage( const TPTImage& image ): IIPImage( image ), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage( const TPTImage& image ): IIPImage( image ), tiff( NULL ), tile_buf( NULL ), strip_cache_size( 0 ),
+    separate_planes( image.separate_planes ), channel_subset( image.channel_subset ), jpeg_decoder( NULL ) {};
 
   /// Assignment Operator
   /** @param image TPTImage object
@@ -88,6 +146,9 @@ class TPTImage : public IIPImage {
   TPTImage( const IIPImage& image ): IIPImage( image ) {
     tiff = NULL;
     tile_buf = NULL;
+    strip_cache_size = 0;
+    separate_planes = false;
+    jpeg_decoder = NULL;
   };
 
   /// Destructor
@@ -105,6 +166,24 @@ class TPTImage : public IIPImage {
   /// Overloaded function for closing a TIFF image
   void closeImage();
 
+  /// Create a copy with its own TIFF handle, which is opened on first tile access
+  IIPImage* duplicate(){ return new TPTImage( *this ); };
+
+  /// Decode only a subset of channels for images with channels stored as separate planes
+  /** @param c flag for each channel - an empty vector selects all channels
+   */
+  void setChannelSubset( const std::vector<bool>& c ){
+    channel_subset = ( c.size() == channels ) ? c : std::vector<bool>();
+  };
+
+  /// Tiles decoded with a channel subset are cached separately from full tiles
+  std::string getCachePath();
+
+  /// Virtual resolutions below the first are built up from the tiles of the next resolution up
+  /** @param r resolution
+   */
+  bool composedResolution( unsigned int r ){ return r + 1 < virtual_levels; };
+
   /// Overloaded function for getting a particular tile
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
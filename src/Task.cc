@@ -23,6 +23,9 @@
 #include <cstdlib>
 #include <algorithm>
 
+// Maximum number of pre-serialised metadata responses to keep
+#define MAX_METADATA_RESPONSES 1000
+
 using namespace std;
 
 Task *Task::factory(const string &t)
@@ -105,6 +108,63 @@ void Task::checkImage()
   }
 }
 
+bool Task::sendCachedResponse(const string &key, const string &mimeType)
+{
+  if (!session->metadataCache)
+    return false;
+
+  metadataCacheMapType::iterator i = session->metadataCache->find(key);
+  if (i == session->metadataCache->end() || i->second.timestamp != (*session->image)->timestamp)
+    return false;
+
+  if (session->loglevel >= 3)
+    *(session->logfile) << "Task :: Sending pre-serialised response for " << key << endl;
+
+  // Our header contains per-request values such as our ETag, so is always created afresh
+  string response = session->response->createHTTPHeader(mimeType, (*session->image)->getTimestamp()) + i->second.body;
+  session->out->putStr(response.c_str(), response.size());
+  session->response->setImageSent();
+  return true;
+}
+
+void Task::sendResponse(const string &key, const string &mimeType, const string &body)
+{
+  if (session->metadataCache)
+  {
+    // Responses are small, so simply limit their number
+    if (session->metadataCache->size() >= MAX_METADATA_RESPONSES &&
+        session->metadataCache->find(key) == session->metadataCache->end())
+      session->metadataCache->erase(session->metadataCache->begin());
+    MetadataResponse& cached = (*session->metadataCache)[key];
+    cached.timestamp = (*session->image)->timestamp;
+    cached.body = body;
+  }
+
+  string response = session->response->createHTTPHeader(mimeType, (*session->image)->getTimestamp()) + body;
+  session->out->putStr(response.c_str(), response.size());
+  session->response->setImageSent();
+}
+
+void Task::negotiateFormat()
+{
+#ifdef HAVE_WEBP
+  if (session->view->output_format != JPEG || !session->codecOptions["WEBP_NEGOTIATION"])
+    return;
+
+  // Our response now depends on the Accept header, so let any caches know. Memcached is keyed
+  // on the query string alone, so negotiated responses must not be stored there
+  session->response->setVary("Accept");
+  session->response->setCachability(false);
+
+  if (session->headers["HTTP_ACCEPT"].find("image/webp") != string::npos)
+  {
+    session->view->output_format = WEBP;
+    if (session->loglevel >= 3)
+      *(session->logfile) << "Task :: Client accepts WebP: sending WebP output" << endl;
+  }
+#endif
+}
+
 void QLT::run(Session *session, const string &argument)
 {
 
@@ -119,12 +179,15 @@ void QLT::run(Session *session, const string &argument)
       if (session->loglevel >= 2)
       {
         *(session->logfile) << "QLT :: Quality factor of " << argument
-                            << " out of bounds. Must be 0-100 for JPEG and 0-9 for PNG" << endl;
+                            << " out of bounds. Must be 0-100 for JPEG and WebP and 0-9 for PNG" << endl;
       }
     }
 
     session->jpeg->setQuality(factor);
     session->png->setQuality(factor);
+#ifdef HAVE_WEBP
+    session->webp->setQuality(factor);
+#endif
 
     if (session->loglevel >= 2)
       *(session->logfile) << "QLT :: Requested quality is " << factor << endl;
@@ -267,6 +330,24 @@ void CVT::run(Session *session, const string &src)
     if (session->loglevel >= 3)
       *(session->logfile) << "CVT :: PNG output" << endl;
   }
+#ifdef HAVE_WEBP
+  else if (argument == "webp")
+  {
+    session->view->output_format = WEBP;
+    if (session->loglevel >= 3)
+      *(session->logfile) << "CVT :: WebP output" << endl;
+  }
+#endif
+  else if (argument == "tif" || argument == "tiff")
+  {
+    session->view->output_format = BIGTIFF;
+    // TIFF exports are streamed and can be allowed a larger size
+    int max_size = (int)session->codecOptions["MAX_TIFF_CVT"];
+    if (max_size != 0)
+      session->view->setMaxSize(max_size);
+    if (session->loglevel >= 3)
+      *(session->logfile) << "CVT :: TIFF output" << endl;
+  }
   else
   {
     session->view->output_format = JPEG;
@@ -422,6 +503,10 @@ void JTL::run(Session *session, const string &argument)
   int resolution = atoi(argument.substr(0, delimitter).c_str());
   int tile = atoi(argument.substr(delimitter + 1, argument.length()).c_str());
 
+  // Serve WebP rather than JPEG if the client accepts it
+  this->session = session;
+  negotiateFormat();
+
   // Send out the requested tile
   this->send(session, resolution, tile);
 }
@@ -37,6 +37,11 @@
 #include "Transforms.h"
 #include "Logger.h"
 #include "PNGCompressor.h"
+#ifdef HAVE_WEBP
+#include "WebPCompressor.h"
+#endif
+#include "TIFFCompressor.h"
+#include "Prefetcher.h"
 
 // Define our http header cache max age (24 hours)
 #define MAX_AGE 86400
@@ -52,12 +57,24 @@ typedef HASHMAP<std::string, IIPImage,
 typedef HASHMAP<std::string, IIPImage> imageCacheMapType;
 #endif
 
+/// Pre-serialised metadata response body together with the modification time of the image it describes
+struct MetadataResponse
+{
+  time_t timestamp;
+  std::string body;
+};
+typedef HASHMAP<std::string, MetadataResponse> metadataCacheMapType;
+
 /// Structure to hold our session data
 struct Session
 {
   IIPImage **image;
   JPEGCompressor *jpeg;
   PNGCompressor *png;
+#ifdef HAVE_WEBP
+  WebPCompressor *webp;
+#endif
+  TIFFCompressor *tiff;
   View *view;
   IIPResponse *response;
   Watermark *watermark;
@@ -68,7 +85,9 @@ struct Session
   std::map<const std::string, unsigned int> codecOptions;
 
   imageCacheMapType *imageCache;
+  metadataCacheMapType *metadataCache;
   Cache *tileCache;
+  Prefetcher *prefetcher;
 
 #ifdef DEBUG
   FileWriter *out;
@@ -104,6 +123,24 @@ public:
 
   /// Check image
   void checkImage();
+
+  /// Switch our default JPEG output to WebP if content negotiation is enabled and the client accepts WebP
+  void negotiateFormat();
+
+  /// Send a pre-serialised metadata response if we have one that is up to date for our image
+  /** Only the body is kept, the HTTP header being created for each request
+      @param key key identifying the response
+      @param mimeType mime type of the response
+      @return whether a response was sent
+   */
+  bool sendCachedResponse(const std::string &key, const std::string &mimeType);
+
+  /// Send a metadata response and keep a pre-serialised copy of its body for subsequent requests
+  /** @param key key identifying the response
+      @param mimeType mime type of the response
+      @param body response body
+   */
+  void sendResponse(const std::string &key, const std::string &mimeType, const std::string &body);
 };
 
 /// OBJ commands
@@ -204,11 +241,17 @@ public:
   void run(Session *session, const std::string &argument);
 
   /// Send out a single tile
-  /** @param session our current session
+  /** Tiles whose size or position differ from our native tiling can be requested by pixel area
+      @param session our current session
       @param resolution requested image resolution
-      @param tile requested tile index
+      @param tile requested tile index or that of the native tile containing the top left of our area
+      @param x left offset of a composed tile at this resolution
+      @param y top offset of a composed tile at this resolution
+      @param w width of a composed tile: 0 for a native tile
+      @param h height of a composed tile: 0 for a native tile
    */
-  void send(Session *session, int resolution, int tile);
+  void send(Session *session, int resolution, int tile, unsigned int x = 0, unsigned int y = 0,
+            unsigned int w = 0, unsigned int h = 0);
 };
 
 typedef struct CompressedTile
@@ -223,7 +266,9 @@ class JTL_Ext : public Task
 public:
   void run(Session *session, const std::string &argument);
 
-  CompressedTile getTile(Session *session, int resolution, int tile);
+  /// Get a batch of tiles, possibly from several images, processed and encoded for output
+  /** The compression type of each request is determined here from the image and view */
+  std::vector<CompressedTile> getTiles(Session *session, const std::vector<TileRequest> &requests);
 
   void send(Compressor *compressor,
             const std::vector<CompressedTile> &compressedTiles,
@@ -262,6 +307,29 @@ public:
 /// CVT Region Export Command
 class CVT : public Task
 {
+private:
+  /// Apply our processing pipeline and resizing to a region or to a horizontal band of our view
+  /** @param image region or band of our view
+      @param min minimum values used for normalization, which may be updated by a contrast stretch
+      @param max maximum values used for normalization, which may be updated by a contrast stretch
+      @param resampled_width width of our final output image
+      @param resampled_height height of our final output image
+      @param source_height height of our whole view before resizing
+      @param source_top row within our view at which our image starts
+      @param first_row first output row to produce
+      @param rows number of output rows to produce
+  */
+  void process(RawTile &image, std::vector<float> &min, std::vector<float> &max,
+               unsigned int resampled_width, unsigned int resampled_height, unsigned int source_height,
+               unsigned int source_top, unsigned int first_row, unsigned int rows);
+
+  /// Set the physical resolution, ICC profile and XMP metadata of our output
+  /** @param compressor our output compressor
+      @param im_width width of the resolution level of our view
+      @param im_height height of the resolution level of our view
+  */
+  void setupCompressor(Compressor *compressor, unsigned int im_width, unsigned int im_height);
+
 public:
   void run(Session *session, const std::string &argument);
 
@@ -24,41 +24,111 @@
 
 
 #include <cmath>
+#include <vector>
+#include <map>
+#include <exception>
+#include <sstream>
 #include "TileManager.h"
+#include "Transforms.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 using namespace std;
 
 
 
-RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType ctype ){
+RawTile TileManager::decodeTile( IIPImage* im, int resolution, int tile, int xangle, int yangle, int layers, ostream& log ){
 
   RawTile ttt;
 
   // Get a raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  ttt = im->getTile( xangle, yangle, resolution, layers, tile );
+  ttt.filename = im->getCachePath();
 
 
   // Apply the watermark if we have one.
   // Do this before inserting into cache so that we cache watermarked tiles
   if( watermark && watermark->isSet() ){
 
-    if( loglevel >= 4 ) insert_timer.start();
-    unsigned int tw = ttt.padded? image->getTileWidth() : ttt.width;
-    unsigned int th = ttt.padded? image->getTileHeight() : ttt.height;
+    // Use a local timer as we may be one of several concurrent decoding threads
+    Timer watermark_timer;
+    if( loglevel >= 4 ) watermark_timer.start();
+    unsigned int tw = ttt.padded? im->getTileWidth() : ttt.width;
+    unsigned int th = ttt.padded? im->getTileHeight() : ttt.height;
 
     watermark->apply( ttt.data, tw, th, ttt.channels, ttt.bpc );
-    if( loglevel >= 4 ) *logfile << "TileManager :: Watermark applied: " << insert_timer.getTime()
-				 << " microseconds" << endl;
+    if( loglevel >= 4 ) log << "TileManager :: Watermark applied: " << watermark_timer.getTime()
+			    << " microseconds" << endl;
   }
 
 
   // We need to crop our edge tiles if they are padded
-  if( ((ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight())) && ttt.padded ){
-    if( loglevel >= 5 ) * logfile << "TileManager :: Cropping tile" << endl;
-    this->crop( &ttt );
+  if( ((ttt.width != im->getTileWidth()) || (ttt.height != im->getTileHeight())) && ttt.padded ){
+    if( loglevel >= 5 ) log << "TileManager :: Cropping tile" << endl;
+    this->crop( &ttt, im, log );
+  }
+
+  return ttt;
+
+}
+
+
+
+RawTile TileManager::composeTile( int resolution, int tile, int xangle, int yangle, int layers ){
+
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+
+  int num_res = image->getNumResolutions();
+  unsigned int im_width = image->image_widths[num_res-resolution-1];
+  unsigned int im_height = image->image_heights[num_res-resolution-1];
+  unsigned int ntlx = (im_width / tw) + (im_width % tw == 0 ? 0 : 1);
+  unsigned int ntly = (im_height / th) + (im_height % th == 0 ? 0 : 1);
+
+  if( (unsigned int) tile >= ntlx*ntly ){
+    ostringstream error;
+    error << "TileManager :: Asked for non-existent tile: " << tile;
+    throw file_error( error.str() );
   }
 
+  // The area covered by our tile within the next resolution up
+  unsigned int next_width = image->image_widths[num_res-resolution-2];
+  unsigned int next_height = image->image_heights[num_res-resolution-2];
+  unsigned int x = 2 * (tile % ntlx) * tw;
+  unsigned int y = 2 * (tile / ntlx) * th;
+  unsigned int w = (x + 2*tw < next_width) ? 2*tw : next_width - x;
+  unsigned int h = (y + 2*th < next_height) ? 2*th : next_height - y;
+
+  // Assemble the 2x2 block of tiles, which are already watermarked, and halve it
+  RawTile ttt = this->getRegion( resolution+1, xangle, yangle, layers, x, y, w, h );
+  Transform().downsample( ttt, 2 );
+
+  ttt.tileNum = tile;
+  ttt.resolution = resolution;
+  ttt.filename = image->getCachePath();
+  ttt.timestamp = image->timestamp;
+  ttt.padded = false;
+
+  return ttt;
+
+}
+
+
+
+RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType ctype ){
+
+  // Decode our tile, applying any watermark and cropping edge tiles. Tiles at
+  // the smallest virtual resolutions are instead composed from larger cached tiles
+  if( loglevel >= 4 ) insert_timer.start();
+  RawTile ttt = image->composedResolution( resolution ) ?
+    this->composeTile( resolution, tile, xangle, yangle, layers ) :
+    this->decodeTile( image, resolution, tile, xangle, yangle, layers, *logfile );
+  if( loglevel >= 4 ) *logfile << "TileManager :: Tile decoding time: " << insert_timer.getTime()
+			       << " microseconds" << endl;
+
 
   // Add our uncompressed tile directly into our cache
   if( ctype == UNCOMPRESSED ){
@@ -71,6 +141,25 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
   }
 
 
+  // Encode our tile
+  this->compress( ttt, ctype );
+
+
+  // Add to our tile cache
+  if( loglevel >= 4 ) insert_timer.start();
+  tileCache->insert( ttt );
+  if( loglevel >= 4 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
+			       << " microseconds" << endl;
+
+
+  return ttt;
+
+}
+
+
+
+void TileManager::compress( RawTile& ttt, CompressionType ctype ){
+
   switch( ctype ){
 
    case JPEG:
@@ -92,6 +181,17 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
     break;
 
 
+   case WEBP:
+    // WebP can only handle 8 bit images with up to 4 channels
+    if( ttt.bpc == 8 && ttt.channels <= 4 ){
+      if( loglevel >= 4 ) compression_timer.start();
+      compressor->Compress( ttt );
+      if( loglevel >= 4 ) *logfile << "TileManager :: WebP Compression Time: "
+				   << compression_timer.getTime() << " microseconds" << endl;
+    }
+    break;
+
+
    case DEFLATE:
     // No deflate for the time being ;-)
     if( loglevel >= 4 ) *logfile << "TileManager :: DEFLATE Compression requested: Not currently available" << endl;
@@ -103,29 +203,32 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
   }
 
+}
 
-  // Add to our tile cache
-  if( loglevel >= 4 ) insert_timer.start();
-  tileCache->insert( ttt );
-  if( loglevel >= 4 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
-			       << " microseconds" << endl;
 
 
-  return ttt;
+bool TileManager::encodable( const RawTile& ttt, CompressionType ctype ){
+
+  switch( ctype ){
+    case JPEG: return ttt.bpc == 8 && (ttt.channels == 1 || ttt.channels == 3);
+    case PNG: return true;
+    case WEBP: return ttt.bpc == 8 && ttt.channels <= 4;
+    default: return false;
+  }
 
 }
 
 
 
-void TileManager::crop( RawTile *ttt ){
+void TileManager::crop( RawTile *ttt, IIPImage* im, ostream& log ){
 
-  int tw = image->getTileWidth();
-  int th = image->getTileHeight();
+  int tw = im->getTileWidth();
+  int th = im->getTileHeight();
 
   if( loglevel >= 5 ){
-    *logfile << "TileManager :: Edge tile: Base size: " << tw << "x" << th
-	     << ": This tile: " << ttt->width << "x" << ttt->height
-	     << endl;
+    log << "TileManager :: Edge tile: Base size: " << tw << "x" << th
+	<< ": This tile: " << ttt->width << "x" << ttt->height
+	<< endl;
   }
 
   // Create a new buffer, fill it with the old data, then copy
@@ -173,23 +276,31 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
     {
 
     case JPEG:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getTile( image->getCachePath(), resolution, tile,
 					  xangle, yangle, JPEG, compressor->getQuality() )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getTile( image->getCachePath(), resolution, tile,
 					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
       break;
 
 
     case PNG:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getTile( image->getCachePath(), resolution, tile,
 					 xangle, yangle, PNG, compressor->getQuality() )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getTile( image->getCachePath(), resolution, tile,
+					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      break;
+
+
+    case WEBP:
+      if( (rawtile = tileCache->getTile( image->getCachePath(), resolution, tile,
+					 xangle, yangle, WEBP, compressor->getQuality() )) ) break;
+      if( (rawtile = tileCache->getTile( image->getCachePath(), resolution, tile,
 					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
       break;
 
 
     case UNCOMPRESSED:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getTile( image->getCachePath(), resolution, tile,
 					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
       break;
 
@@ -206,6 +317,7 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
     switch( ctype ){
       case JPEG: compName = "JPEG"; break;
       case PNG: compName = "PNG"; break;
+      case WEBP: compName = "WEBP"; break;
       case DEFLATE: compName = "DEFLATE"; break;
       case UNCOMPRESSED: compName = "UNCOMPRESSED"; break;
       default: break;
@@ -251,17 +363,16 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
   // Check whether the compression used for out tile matches our requested compression type. If not, we must convert
   // Perform JPEG compression iff we have an 8 bit per channel image and either 1 or 3 bands
-  // PNG compression can have 8 or 16 bits and alpha channels
-  if( (rawtile->compressionType == UNCOMPRESSED) &&
-      ( ( ctype==JPEG && rawtile->bpc==8 && (rawtile->channels==1 || rawtile->channels==3) ) || ctype==PNG ) ){
+  // PNG compression can have 8 or 16 bits and alpha channels. WebP can have 8 bits and alpha channels
+  if( (rawtile->compressionType == UNCOMPRESSED) && encodable( *rawtile, ctype ) ){
 
     // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
     RawTile ttt( *rawtile );
 
     // Crop if this is an edge tile
     if( ( (ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight()) ) && ttt.padded ){
-      if( loglevel >= 5 ) * logfile << "TileManager :: Cropping tile" << endl;
-      this->crop( &ttt );
+      if( loglevel >= 5 ) *logfile << "TileManager :: Cropping edge tile: " << ttt.width << "x" << ttt.height << endl;
+      this->crop( &ttt, image, *logfile );
     }
 
     if( loglevel >=2 ) compression_timer.start();
@@ -293,7 +404,179 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 }
 
 
-RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers, unsigned int x, unsigned int y, unsigned int width, unsigned int height ){
+vector<RawTile> TileManager::getTiles( const vector<TileRequest>& requests, int xangle, int yangle, int layers ){
+
+  int ntiles = requests.size();
+  vector<RawTile> tiles( ntiles );
+
+  if( loglevel >= 3 ) tile_timer.start();
+
+
+  // Resolve all cache hits first. Tiles only found uncompressed in the cache still need to be encoded
+  vector<int> work;              // tiles to be decoded and/or encoded in parallel
+  vector<int> serial;            // tiles handled serially through getTile
+  vector<char> decode( ntiles, 0 );
+  unsigned int hits = 0;
+
+  for( int n=0; n<ntiles; n++ ){
+
+    const TileRequest& r = requests[n];
+    IIPImage* im = r.image;
+    RawTile* cached = NULL;
+
+    if( r.compression != UNCOMPRESSED ){
+      cached = tileCache->getTile( im->getCachePath(), r.resolution, r.tile, xangle, yangle, r.compression, compressor->getQuality() );
+    }
+    if( !cached || cached->timestamp < im->timestamp ){
+      cached = tileCache->getTile( im->getCachePath(), r.resolution, r.tile, xangle, yangle, UNCOMPRESSED, 0 );
+    }
+
+    if( cached && cached->timestamp >= im->timestamp ){
+      tiles[n] = *cached;
+      hits++;
+      if( tiles[n].compressionType == UNCOMPRESSED && encodable( tiles[n], r.compression ) ){
+	if( ( (tiles[n].width != im->getTileWidth()) || (tiles[n].height != im->getTileHeight()) ) && tiles[n].padded ){
+	  this->crop( &tiles[n], im, *logfile );
+	}
+	work.push_back( n );
+      }
+    }
+    // Composed virtual resolutions are built up through the cache
+    else if( im->composedResolution( r.resolution ) ) serial.push_back( n );
+    else{
+      decode[n] = 1;
+      work.push_back( n );
+    }
+  }
+
+
+  // Number of threads with which to decode and encode our remaining tiles
+  int nwork = work.size();
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = (threads == 0) ? omp_get_max_threads() : threads;
+  if( nthreads > nwork ) nthreads = nwork;
+  if( nthreads < 1 ) nthreads = 1;
+#endif
+
+  // Each thread needs its own compressor if any tiles are to be encoded. The first thread uses ours.
+  // Any library state kept by our compressors between images is held per thread, so duplicates can
+  // encode concurrently. If our compressor cannot be duplicated, work serially
+  bool encoding = false;
+  for( int k=0; k<nwork; k++ ) if( requests[work[k]].compression != UNCOMPRESSED ) encoding = true;
+
+  vector<Compressor*> compressors( 1, compressor );
+  for( int t=1; t<nthreads; t++ ){
+    Compressor* c = encoding ? compressor->duplicate() : NULL;
+    if( encoding && !c ) break;
+    compressors.push_back( c );
+  }
+  nthreads = compressors.size();
+
+  // Each thread also needs its own decoder handle for each image, which are created as needed. The first
+  // thread uses our original image objects. Tiles from images that cannot be duplicated are deferred
+  vector< map<IIPImage*,IIPImage*> > decoders( nthreads );
+  vector<char> deferred( ntiles, 0 );
+  exception_ptr error;
+
+  // Our logfile cannot be shared between threads, so diagnostics for each tile are
+  // gathered here and written out once all threads have finished
+  vector<string> logs( (loglevel >= 4) ? ntiles : 0 );
+
+
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+  for( int k=0; k<nwork; k++ ){
+
+    int n = work[k];
+    const TileRequest& r = requests[n];
+#ifdef _OPENMP
+    int t = omp_get_thread_num();
+#else
+    int t = 0;
+#endif
+
+    bool failed;
+#pragma omp critical(tilecache)
+    failed = (bool) error;
+    if( failed ) continue;
+
+    try{
+      if( decode[n] ){
+	IIPImage* decoder = r.image;
+	if( t > 0 ){
+	  map<IIPImage*,IIPImage*>::iterator it = decoders[t].find( r.image );
+	  if( it != decoders[t].end() ) decoder = it->second;
+	  else decoder = decoders[t][r.image] = r.image->duplicate();
+	}
+	if( !decoder ){
+	  deferred[n] = 1;
+	  continue;
+	}
+	ostringstream log;
+	tiles[n] = this->decodeTile( decoder, r.resolution, r.tile, xangle, yangle, layers, log );
+	if( loglevel >= 4 ) logs[n] = log.str();
+      }
+
+      bool encoded = encodable( tiles[n], r.compression );
+      if( encoded ) compressors[t]->Compress( tiles[n] );
+
+      // As in getTile, add newly decoded tiles and the results of any encoding to our cache
+      if( decode[n] || encoded ){
+#pragma omp critical(tilecache)
+	tileCache->insert( tiles[n] );
+      }
+    }
+    catch( ... ){
+#pragma omp critical(tilecache)
+      if( !error ) error = current_exception();
+    }
+  }
+
+
+  // Clean up our additional compressors and decoder handles
+  for( unsigned int t=1; t<compressors.size(); t++ ) delete compressors[t];
+  for( unsigned int t=1; t<decoders.size(); t++ ){
+    for( map<IIPImage*,IIPImage*>::iterator it = decoders[t].begin(); it != decoders[t].end(); it++ ) delete it->second;
+  }
+
+  for( unsigned int n=0; n<logs.size(); n++ ) *logfile << logs[n];
+
+  // Pass on any error thrown within our threads
+  if( error ) rethrow_exception( error );
+
+
+  // Finally handle our composed and deferred tiles one at a time using the original image objects
+  for( int n=0; n<ntiles; n++ ) if( deferred[n] ) serial.push_back( n );
+  for( unsigned int k=0; k<serial.size(); k++ ){
+    const TileRequest& r = requests[serial[k]];
+    TileManager tilemanager( tileCache, r.image, watermark, compressor, logfile, loglevel );
+    tilemanager.setThreads( threads );
+    tiles[serial[k]] = tilemanager.getTile( r.resolution, r.tile, xangle, yangle, layers, r.compression );
+  }
+
+
+  if( loglevel >= 3 ){
+    *logfile << "TileManager getTiles :: " << ntiles << " tiles requested: " << hits << " from cache, "
+	     << ntiles-hits << " decoded using " << nthreads << " thread" << ((nthreads>1)?"s":"")
+	     << " in " << tile_timer.getTime() << " microseconds" << endl;
+  }
+
+  return tiles;
+
+}
+
+
+
+RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers, unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+				unsigned int ow, unsigned int oh ){
+
+  // If our image type can scale the region to our output size while decoding, let it do so
+  if( ow > 0 && oh > 0 && image->scaledRegionDecoding() ){
+    if( loglevel >= 3 ){
+      *logfile << "TileManager getRegion :: requesting region scaled to " << ow << "x" << oh << " directly from image" << endl;
+    }
+    return image->getScaledRegion( seq, ang, res, layers, x, y, width, height, ow, oh );
+  }
 
   // If our image type can directly handle region compositing, simply return that
   if( image->regionDecoding() ){
@@ -304,55 +587,91 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   }
 
   // Otherwise do the compositing ourselves
+  return this->compositeRegion( res, seq, ang, layers, x, y, width, height );
+
+}
 
-  // The tile size of the source tile
-  unsigned int src_tile_width = image->getTileWidth();
-  unsigned int src_tile_height = image->getTileHeight();
 
-  // The tile size of the destination tile
-  unsigned int dst_tile_width = src_tile_width;
-  unsigned int dst_tile_height = src_tile_height;
 
-  // The basic tile size ie. not the current tile
-  unsigned int basic_tile_width = src_tile_width;
-  unsigned int basic_tile_height = src_tile_height;
+RawTile TileManager::getRetiledTile( int resolution, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+				     int xangle, int yangle, int layers, CompressionType ctype ){
 
   int num_res = image->getNumResolutions();
-  unsigned int im_width = image->image_widths[num_res-res-1];
-  unsigned int im_height = image->image_heights[num_res-res-1];
+  if( resolution < 0 || resolution >= num_res || w == 0 || h == 0 ||
+      x + w > image->image_widths[num_res-resolution-1] || y + h > image->image_heights[num_res-resolution-1] ){
+    ostringstream error;
+    error << "TileManager :: Asked for non-existent tile area: " << x << "," << y << "," << w << "," << h
+	  << " at resolution " << resolution;
+    throw file_error( error.str() );
+  }
 
-  unsigned int rem_x = im_width % src_tile_width;
-  unsigned int rem_y = im_height % src_tile_height;
+  if( loglevel >= 3 ) tile_timer.start();
 
-  // The number of tiles in each direction
-  unsigned int ntlx = (im_width / src_tile_width) + (rem_x == 0 ? 0 : 1);
-  unsigned int ntly = (im_height / src_tile_height) + (rem_y == 0 ? 0 : 1);
+  // Composed tiles are cached under their own key made up of our image cache path and their position and size
+  ostringstream key;
+  key << image->getCachePath() << ":" << x << "," << y << "," << w << "x" << h;
+
+  // Uncompressed composed tiles would only duplicate the source tiles already in our cache
+  if( ctype != UNCOMPRESSED ){
+    RawTile* rawtile = tileCache->getTile( key.str(), resolution, 0, xangle, yangle, ctype, compressor->getQuality() );
+    if( rawtile && rawtile->timestamp >= image->timestamp ){
+      if( loglevel >= 3 ) *logfile << "TileManager :: Cache Hit for composed tile " << key.str()
+				   << " at resolution " << resolution << " in " << tile_timer.getTime() << " microseconds" << endl;
+      return RawTile( *rawtile );
+    }
+  }
 
-  // Start and end tiles and pixel offsets
-  unsigned int startx, endx, starty, endy, xoffset, yoffset;
+  // Assemble our tile from uncompressed source tiles, which are themselves taken from or added to our cache
+  RawTile ttt = this->compositeRegion( resolution, xangle, yangle, layers, x, y, w, h );
+  ttt.filename = key.str();
+  ttt.tileNum = 0;
+  ttt.timestamp = image->timestamp;
+  ttt.padded = false;
+
+  if( ctype != UNCOMPRESSED ){
+    this->compress( ttt, ctype );
+    if( ttt.compressionType == ctype ){
+      if( loglevel >= 4 ) insert_timer.start();
+      tileCache->insert( ttt );
+      if( loglevel >= 4 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
+				   << " microseconds" << endl;
+    }
+  }
 
+  if( loglevel >= 3 ) *logfile << "TileManager :: Composed tile " << key.str() << " at resolution " << resolution
+			       << " in " << tile_timer.getTime() << " microseconds" << endl;
 
-  if( ! ( x==0 && y==0 && width==im_width && height==im_height ) ){
-    // Calculate the start tiles
-    startx = (unsigned int) ( x / src_tile_width );
-    starty = (unsigned int) ( y / src_tile_height );
-    xoffset = x % src_tile_width;
-    yoffset = y % src_tile_height;
+  return ttt;
 
-    endx = (unsigned int) ceil( (float)(width + x) / (float)src_tile_width );
-    endy = (unsigned int) ceil( (float)(height + y) / (float)src_tile_height );
+}
 
-    if( loglevel >= 3 ){
-      *logfile << "TileManager getRegion :: Total tiles in image: " << ntlx << "x" << ntly << " tiles" << endl
-	       << "TileManager getRegion :: Tile start: " << startx << "," << starty << " with offset: "
-	       << xoffset << "," << yoffset << endl
-	       << "TileManager getRegion :: Tile end: " << endx-1 << "," << endy-1 << endl;
-    }
-  }
-  else{
-    startx = starty = xoffset = yoffset = 0;
-    endx = ntlx;
-    endy = ntly;
+
+
+RawTile TileManager::compositeRegion( unsigned int res, int seq, int ang, int layers, unsigned int x, unsigned int y, unsigned int width, unsigned int height ){
+
+  // The basic tile size of the source image
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+
+  int num_res = image->getNumResolutions();
+  unsigned int im_width = image->image_widths[num_res-res-1];
+  unsigned int im_height = image->image_heights[num_res-res-1];
+
+  // The number of tiles in each direction
+  unsigned int ntlx = (im_width / tw) + (im_width % tw == 0 ? 0 : 1);
+  unsigned int ntly = (im_height / th) + (im_height % th == 0 ? 0 : 1);
+
+  // Start and end tiles
+  unsigned int startx = x / tw;
+  unsigned int starty = y / th;
+  unsigned int endx = (unsigned int) ceil( (float)(width + x) / (float)tw );
+  unsigned int endy = (unsigned int) ceil( (float)(height + y) / (float)th );
+
+  if( loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: Total tiles in image: " << ntlx << "x" << ntly << " tiles" << endl
+	     << "TileManager getRegion :: Tile start: " << startx << "," << starty << " with offset: "
+	     << x % tw << "," << y % th << endl
+	     << "TileManager getRegion :: Tile end: " << endx-1 << "," << endy-1 << endl;
   }
 
 
@@ -374,123 +693,147 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   else if( bpc == 32 && sampleType == FIXEDPOINT ) region.data = new int[width*height*channels];
   else if( bpc == 32 && sampleType == FLOATINGPOINT ) region.data = new float[width*height*channels];
 
-  unsigned int current_height = 0;
 
-  // Decode the image strip by strip
-  for( unsigned int i=starty; i<endy; i++ ){
+  // Number of tiles we need and the number of threads with which to decode them. Composed
+  // virtual resolutions are built up through the cache, so these are handled serially
+  int ntiles = (endx-startx) * (endy-starty);
+  bool composed = image->composedResolution( res );
+  int nthreads = 1;
+#ifdef _OPENMP
+  if( !composed ){
+    nthreads = (threads == 0) ? omp_get_max_threads() : threads;
+    if( nthreads > ntiles ) nthreads = ntiles;
+  }
+#endif
+
+  // Each thread needs its own decoder handle as image handles cannot be shared between threads.
+  // The first thread uses our main image object. If the image type cannot be duplicated, decode serially
+  vector<IIPImage*> decoders( 1, image );
+  for( int n=1; n<nthreads; n++ ){
+    IIPImage* decoder = image->duplicate();
+    if( !decoder ) break;
+    decoders.push_back( decoder );
+  }
+  nthreads = decoders.size();
 
-    unsigned int buffer_index = 0;
+  if( loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: Decoding " << ntiles << " tiles using " << nthreads
+	     << " thread" << ((nthreads>1)?"s":"") << endl;
+    tile_timer.start();
+  }
 
-    // Keep track of the current pixel boundary horizontally. ie. only up
-    //  to the beginning of the current tile boundary.
-    unsigned int current_width = 0;
 
-    for( unsigned int j=startx; j<endx; j++ ){
+  const string path = image->getCachePath();
+  const unsigned int bytes = channels * (bpc/8);
+  unsigned int hits = 0;
+  exception_ptr error;
 
-      // Time the tile retrieval
-      if( loglevel >= 3 ) tile_timer.start();
+  // Our logfile cannot be shared between threads, so diagnostics for each tile are
+  // gathered here and written out once all threads have finished
+  vector<string> logs( (loglevel >= 4) ? ntiles : 0 );
 
-      // Get an uncompressed tile
-      RawTile rawtile = this->getTile( res, (i*ntlx) + j, seq, ang, layers, UNCOMPRESSED );
 
-      if( loglevel >= 5 ){
-	*logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
-		 << (i*ntlx) + j << " at resolution " << res << endl;
-      }
+  // Tiles are fetched from the cache or decoded and then copied directly into their
+  // position in the region. The cache is not thread-safe, so all access is serialized
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic) reduction(+:hits)
+  for( int n=0; n<ntiles; n++ ){
 
+    unsigned int i = starty + n / (endx-startx);
+    unsigned int j = startx + n % (endx-startx);
+    unsigned int tile = (i*ntlx) + j;
 
-      // Only print this out once per image
-      if( (loglevel >= 5) && (i==starty) && (j==starty) ){
-	*logfile << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
-		 << rawtile.bpc << " bits per channel" << endl;
-      }
+    RawTile rawtile;
+    bool found = false;
+    bool failed = false;
 
-      // Set the tile width and height to be that of the source tile - Use the rawtile data
-      // because if we take a tile from cache the image pointer will not necessarily be pointing
-      // to the the current tile
-      src_tile_width = rawtile.width;
-      src_tile_height = rawtile.height;
-      dst_tile_width = src_tile_width;
-      dst_tile_height = src_tile_height;
-
-      // Variables for the pixel offset within the current tile
-      unsigned int xf = 0;
-      unsigned int yf = 0;
-
-      // If our viewport has been set, we need to modify our start
-      // and end points on the source image
-      if( !( x==0 && y==0 && width==im_width && height==im_height ) ){
-
-	unsigned int remainder;  // Remaining pixels in the final row or column
-
-	if( j == startx ){
-	  // Calculate the width used in the current tile
-	  // If there is only 1 tile, the width is just the view width
-	  if( j < endx - 1 ) dst_tile_width = src_tile_width - xoffset;
-	  else dst_tile_width = width;
-	  xf = xoffset;
-	}
-	else if( j == endx-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (width+x) % basic_tile_width;
-	  if( remainder != 0 ) dst_tile_width = remainder;
-	}
+    // Time the tile retrieval
+    Timer access_timer;
+    if( loglevel >= 5 ) access_timer.start();
+    ostringstream log;
 
-	if( i == starty ){
-	  // Calculate the height used in the current row of tiles
-	  // If there is only 1 row the height is just the view height
-	  if( i < endy - 1 ) dst_tile_height = src_tile_height - yoffset;
-	  else dst_tile_height = height;
-	  yf = yoffset;
-	}
-	else if( i == endy-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (height+y) % basic_tile_height;
-	  if( remainder != 0 ) dst_tile_height = remainder;
+#pragma omp critical(tilecache)
+    {
+      if( error ) failed = true;
+      else{
+	RawTile* cached = tileCache->getTile( path, res, tile, seq, ang, UNCOMPRESSED, 0 );
+	if( cached && cached->timestamp >= image->timestamp ){
+	  rawtile = *cached;
+	  found = true;
 	}
+      }
+    }
 
-	if( loglevel >= 5 ){
-	  *logfile << "TileManager getRegion :: destination tile width: " << dst_tile_width
-		   << ", tile height: " << dst_tile_height << endl;
+    if( failed ) continue;
+
+    if( found ) hits++;
+    else{
+      try{
+	if( composed ) rawtile = this->getTile( res, tile, seq, ang, layers, UNCOMPRESSED );
+	else{
+#ifdef _OPENMP
+	  IIPImage* decoder = decoders[omp_get_thread_num()];
+#else
+	  IIPImage* decoder = image;
+#endif
+	  rawtile = this->decodeTile( decoder, res, tile, seq, ang, layers, log );
+#pragma omp critical(tilecache)
+	  tileCache->insert( rawtile );
 	}
       }
+      catch( ... ){
+#pragma omp critical(tilecache)
+	if( !error ) error = current_exception();
+	continue;
+      }
+    }
 
+    // Pixel offset of the region within this tile
+    unsigned int xf = (x > j*tw) ? x - j*tw : 0;
+    unsigned int yf = (y > i*th) ? y - i*th : 0;
+
+    // Position of this tile within our region and the size of the area we copy
+    unsigned int dst_x = j*tw + xf - x;
+    unsigned int dst_y = i*th + yf - y;
+    unsigned int dst_tile_width = ( ((j+1)*tw < x+width) ? (j+1)*tw : x+width ) - (j*tw + xf);
+    unsigned int dst_tile_height = ( ((i+1)*th < y+height) ? (i+1)*th : y+height ) - (i*th + yf);
+
+    if( loglevel >= 5 ){
+      log << "TileManager getRegion :: Tile access time " << access_timer.getTime() << " microseconds for tile "
+	  << tile << " at resolution " << res << endl;
+      // Only print this out once per region
+      if( n == 0 ){
+	log << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
+	    << rawtile.bpc << " bits per channel" << endl;
+      }
+      log << "TileManager getRegion :: destination tile width: " << dst_tile_width
+	  << ", tile height: " << dst_tile_height << endl;
+    }
 
-      // Copy our tile data into the appropriate part of the strip memory
-      // one whole tile width at a time
-      for( unsigned int k=0; k<dst_tile_height; k++ ){
+    // Copy our tile data into the appropriate part of the region one line at a time. Use the
+    // rawtile width as tiles from the cache are not necessarily the same size as the basic tile
+    unsigned char* ptr = (unsigned char*) rawtile.data;
+    unsigned char* buf = (unsigned char*) region.data;
+    for( unsigned int k=0; k<dst_tile_height; k++ ){
+      size_t buffer_index = ( (size_t)(dst_y+k)*width + dst_x ) * bytes;
+      size_t inx = ( (size_t)(k+yf)*rawtile.width + xf ) * bytes;
+      memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*bytes );
+    }
 
-	buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
-	unsigned int inx = ((k+yf)*rawtile.width*channels) + (xf*channels);
+    if( loglevel >= 4 ) logs[n] = log.str();
+  }
 
-	// Simply copy the line of data across
-	if( bpc == 8 ){
-	  unsigned char* ptr = (unsigned char*) rawtile.data;
-	  unsigned char* buf = (unsigned char*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
-	}
-	else if( bpc ==  16 ){
-	  unsigned short* ptr = (unsigned short*) rawtile.data;
-	  unsigned short* buf = (unsigned short*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
-	}
-	else if( bpc == 32 && sampleType == FIXEDPOINT ){
-	  unsigned int* ptr = (unsigned int*) rawtile.data;
-	  unsigned int* buf = (unsigned int*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-	else if( bpc == 32 && sampleType == FLOATINGPOINT ){
-	  float* ptr = (float*) rawtile.data;
-	  float* buf = (float*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-      }
 
-      current_width += dst_tile_width;
-    }
+  // Clean up our additional decoder handles
+  for( unsigned int n=1; n<decoders.size(); n++ ) delete decoders[n];
 
-    current_height += dst_tile_height;
+  for( unsigned int n=0; n<logs.size(); n++ ) *logfile << logs[n];
 
+  // Pass on any error thrown within our decoding threads
+  if( error ) rethrow_exception( error );
+
+  if( loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: " << hits << " tiles from cache, " << ntiles-hits
+	     << " decoded in " << tile_timer.getTime() << " microseconds" << endl;
   }
 
   return region;
@@ -32,6 +32,17 @@
 #include "Timer.h"
 #include "Watermark.h"
 #include "Logger.h"
+#include <vector>
+
+
+/// A single tile within a batch of tile requests
+struct TileRequest {
+  IIPImage* image;                 ///< image from which the tile is taken
+  int resolution;                  ///< resolution number
+  int tile;                        ///< tile number
+  CompressionType compression;     ///< requested compression type
+};
+
 
 
 /// Class to manage access to the tile cache and tile cropping
@@ -47,8 +58,34 @@ class TileManager{
   Watermark* watermark;
   Logger* logfile;
   int loglevel;
+  unsigned int threads;
   Timer compression_timer, tile_timer, insert_timer;
 
+  /// Decode a tile from an image and apply any watermark and edge cropping
+  /** Does not access the cache and writes any diagnostics to the given stream rather than
+   *  our logfile, so can be called concurrently for different image objects
+   *  @param im image object to decode from
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param log stream to which diagnostics are written
+   *  @return RawTile
+   */
+  RawTile decodeTile( IIPImage* im, int resolution, int tile, int xangle, int yangle, int layers, std::ostream& log );
+
+  /// Compose a tile at a virtual resolution from the 2x2 block of tiles at the next resolution up
+  /** The source tiles are fetched through the cache and the result downsampled by area averaging
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @return RawTile
+   */
+  RawTile composeTile( int resolution, int tile, int xangle, int yangle, int layers );
+
   /// Get a new tile from the image file
   /**
    *  If the encoded tile already exists in the cache, use that, otherwise check for
@@ -65,10 +102,44 @@ class TileManager{
   RawTile getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
 
 
+  /// Assemble a region from uncompressed tiles taken from the cache or decoded in parallel
+  /** Tiles not found in the cache are inserted into it once decoded
+   *  @param res resolution number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param x left offset at this resolution
+   *  @param y top offset at this resolution
+   *  @param w width of region
+   *  @param h height of region
+   *  @return RawTile
+   */
+  RawTile compositeRegion( unsigned int res, int xangle, int yangle, int layers, unsigned int x, unsigned int y, unsigned int w, unsigned int h );
+
+
+  /// Encode a tile if the requested compression type supports its bit depth and number of channels
+  /** @param t tile to encode
+      @param c CompressionType
+   */
+  void compress( RawTile& t, CompressionType c );
+
+
+  /// Check whether a tile can be encoded with a particular compression type
+  /** JPEG requires 8 bit images with 1 or 3 channels and WebP 8 bit images with up to 4 channels.
+      PNG can handle 8 or 16 bits and alpha channels
+      @param t uncompressed tile
+      @param c CompressionType
+      @return whether the tile can be encoded
+   */
+  static bool encodable( const RawTile& t, CompressionType c );
+
+
   /// Crop a tile to remove padding
   /** @param t pointer to tile to crop
+      @param im image from which the tile was taken
+      @param log stream to which diagnostics are written
    */
-  void crop( RawTile* t );
+  void crop( RawTile* t, IIPImage* im, std::ostream& log );
 
 
  public:
@@ -90,9 +161,15 @@ class TileManager{
     compressor = c;
     logfile = s ;
     loglevel = l;
+    threads = 0;
   };
 
 
+  /// Set the maximum number of threads used to decode tiles within getRegion and getTiles
+  /** @param t number of threads: 0 to use the OpenMP default, 1 for serial decoding */
+  void setThreads( unsigned int t ){ threads = t; };
+
+
 
   /// Get a tile from the cache
   /**
@@ -111,10 +188,49 @@ class TileManager{
 
 
 
+  /// Get a batch of tiles, which may come from several images
+  /**
+   *  All cache lookups are carried out first. The remaining tiles are then decoded and encoded
+   *  in parallel, with each thread using its own decoder handle for each image and its own
+   *  compressor. Image types that cannot be duplicated and composed virtual resolutions are handled
+   *  serially as for getTile. All tiles are encoded with the quality, physical resolution and ICC
+   *  profile of our compressor, so a batch should only contain tiles that share these settings
+   *  @param requests tiles to fetch
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @return tiles in the same order as our requests
+   */
+  std::vector<RawTile> getTiles( const std::vector<TileRequest>& requests, int xangle, int yangle, int layers );
+
+
+
+  /// Get a tile of arbitrary size and position at one of our resolutions
+  /**
+   *  Allows clients to use tile sizes that differ from the native tiling of our image. The tile is
+   *  composed from our own tiles, which are taken from or added to the cache even for image types that
+   *  can decode regions directly. The encoded result is cached under a key of its own
+   *  @param resolution resolution number
+   *  @param x left offset at this resolution
+   *  @param y top offset at this resolution
+   *  @param w tile width
+   *  @param h tile height
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param c CompressionType
+   *  @return RawTile
+   */
+  RawTile getRetiledTile( int resolution, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+			  int xangle, int yangle, int layers, CompressionType c );
+
+
+
   /// Generate a complete region
   /**
-   *  Build up an arbitrary region by extracting tiles from the cache by using getTile function.
-   *  Data returned as uncompressed data.
+   *  Build up an arbitrary region by extracting tiles from the cache or decoding them.
+   *  Tiles not found in the cache are decoded in parallel where the image supports
+   *  independent decoder handles. Data returned as uncompressed data.
    *  @param res resolution number
    *  @param xangle horizontal sequence number
    *  @param yangle vertical sequence number
@@ -123,9 +239,12 @@ class TileManager{
    *  @param y top offset with respect to full image
    *  @param w width of region requested
    *  @param h height of region requested
+   *  @param ow output width if the image can scale the region while decoding: 0 for no scaling
+   *  @param oh output height if the image can scale the region while decoding: 0 for no scaling
    *  @return RawTile
    */
-    RawTile getRegion( unsigned int res, int xangle, int yangle, int layers, unsigned int x, unsigned int y, unsigned int w, unsigned int h );
+    RawTile getRegion( unsigned int res, int xangle, int yangle, int layers, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+		       unsigned int ow = 0, unsigned int oh = 0 );
 
 };
 
@@ -486,37 +486,38 @@ void Transform::inv( RawTile& in ){
 
 
 // Resize image using nearest neighbour interpolation
-void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resampled_width, unsigned int resampled_height ){
+void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resampled_width, unsigned int resampled_height,
+					      unsigned int source_height, unsigned int source_top,
+					      unsigned int first_row, unsigned int rows ){
 
   // Pointer to input buffer
   unsigned char *input = (unsigned char*) in.data;
 
   int channels = in.channels;
   unsigned int width = in.width;
-  unsigned int height = in.height;
 
   // Pointer to output buffer
   unsigned char *output;
 
   // Create new buffer if size is larger than input size
   bool new_buffer = false;
-  if( resampled_width*resampled_height > in.width*in.height ){
+  if( resampled_width*rows > in.width*in.height ){
     new_buffer = true;
-    output = new unsigned char[(unsigned long long)resampled_width*resampled_height*in.channels];
+    output = new unsigned char[(unsigned long long)resampled_width*rows*in.channels];
   }
   else output = (unsigned char*) in.data;
 
   // Calculate our scale
   float xscale = (float)width / (float)resampled_width;
-  float yscale = (float)height / (float)resampled_height;
+  float yscale = (float)source_height / (float)resampled_height;
 
-  for( unsigned int j=0; j<resampled_height; j++ ){
+  for( unsigned int j=0; j<rows; j++ ){
     for( unsigned int i=0; i<resampled_width; i++ ){
 
       // Indexes in the current pyramid resolution and resampled spaces
       // Make sure to limit our input index to the image surface
       unsigned long ii = (unsigned int) floorf(i*xscale);
-      unsigned long jj = (unsigned int) floorf(j*yscale);
+      unsigned long jj = (unsigned int) floorf((j+first_row)*yscale) - source_top;
       unsigned long pyramid_index = (unsigned int) channels * ( ii + jj*width );
 
       unsigned long long resampled_index = (unsigned long long)(i + j*resampled_width)*channels;
@@ -531,8 +532,8 @@ void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resample
 
   // Correctly set our Rawtile info
   in.width = resampled_width;
-  in.height = resampled_height;
-  in.dataLength = resampled_width * resampled_height * channels * (in.bpc/8);
+  in.height = rows;
+  in.dataLength = resampled_width * rows * channels * (in.bpc/8);
   in.data = output;
 }
 
@@ -540,7 +541,9 @@ void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resample
 
 // Resize image using bilinear interpolation
 //  - Floating point implementation which benchmarks about 2.5x slower than nearest neighbour
-void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width, unsigned int resampled_height ){
+void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width, unsigned int resampled_height,
+				      unsigned int source_height, unsigned int source_top,
+				      unsigned int first_row, unsigned int rows ){
 
   // Pointer to input buffer
   unsigned char *input = (unsigned char*) in.data;
@@ -553,29 +556,32 @@ void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width,
   unsigned long max = ( (width*height) - 1 ) * channels;
 
   // Create new buffer and pointer for our output - make sure we have enough digits via unsigned long long
-  unsigned char *output = new unsigned char[(unsigned long long)resampled_width*resampled_height*channels];
+  unsigned char *output = new unsigned char[(unsigned long long)resampled_width*rows*channels];
 
   // Calculate our scale
   float xscale = (float)(width) / (float)resampled_width;
-  float yscale = (float)(height) / (float)resampled_height;
+  float yscale = (float)(source_height) / (float)resampled_height;
 
 
   // Do not parallelize for small images (256x256 pixels) as this can be slower that single threaded
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
 #elif defined(_OPENMP)
-#pragma omp parallel for if( resampled_width*resampled_height > PARALLEL_THRESHOLD )
+#pragma omp parallel for if( resampled_width*rows > PARALLEL_THRESHOLD )
 #endif
-  for( unsigned int j=0; j<resampled_height; j++ ){
+  for( unsigned int j=0; j<rows; j++ ){
 
     // Index to the current pyramid resolution's top left pixel
-    int jj = (int) floor( j*yscale );
+    int jj = (int) floor( (j+first_row)*yscale );
 
     // Calculate some weights - do this in the highest loop possible
-    float jscale = j*yscale;
+    float jscale = (j+first_row)*yscale;
     float c = (float)(jj+1) - jscale;
     float d = jscale - (float)jj;
 
+    // Position within our band
+    jj -= source_top;
+
     for( unsigned int i=0; i<resampled_width; i++ ){
 
       // Index to the current pyramid resolution's top left pixel
@@ -617,8 +623,8 @@ void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width,
 
   // Correctly set our Rawtile info
   in.width = resampled_width;
-  in.height = resampled_height;
-  in.dataLength = resampled_width * resampled_height * channels * (in.bpc/8);
+  in.height = rows;
+  in.dataLength = resampled_width * rows * channels * (in.bpc/8);
   in.data = output;
 }
 
@@ -1070,3 +1076,85 @@ void Transform::equalize( RawTile& in, vector<unsigned int>& histogram ){
   // Free our dynamically allocated array
   delete[] cdf;
 }
+
+
+
+// Area average blocks of factor x factor pixels. Blocks at the right and bottom edges
+// may be partial and are averaged over the pixels available
+template <typename T> static void downsample_area( const T* input, T* output, unsigned int width, unsigned int height,
+						  unsigned int channels, unsigned int factor, bool integer ){
+
+  unsigned int resampled_width = (width + factor - 1) / factor;
+  unsigned int resampled_height = (height + factor - 1) / factor;
+
+#if defined(_OPENMP)
+#pragma omp parallel for if( resampled_width*resampled_height > PARALLEL_THRESHOLD )
+#endif
+  for( unsigned int j=0; j<resampled_height; j++ ){
+
+    unsigned int y0 = j*factor;
+    unsigned int y1 = (y0+factor < height) ? y0+factor : height;
+    vector<double> sum( channels );
+
+    for( unsigned int i=0; i<resampled_width; i++ ){
+
+      unsigned int x0 = i*factor;
+      unsigned int x1 = (x0+factor < width) ? x0+factor : width;
+      std::fill( sum.begin(), sum.end(), 0.0 );
+
+      for( unsigned int y=y0; y<y1; y++ ){
+	const T* ptr = &input[((unsigned long)y*width + x0)*channels];
+	for( unsigned int x=x0; x<x1; x++ ){
+	  for( unsigned int k=0; k<channels; k++ ) sum[k] += *ptr++;
+	}
+      }
+
+      double n = (double) (x1-x0) * (y1-y0);
+      unsigned long index = ((unsigned long)j*resampled_width + i) * channels;
+      for( unsigned int k=0; k<channels; k++ ){
+	output[index+k] = integer ? (T) ( sum[k]/n + 0.5 ) : (T) ( sum[k]/n );
+      }
+    }
+  }
+}
+
+
+
+// Downsample by an integer factor using area averaging
+void Transform::downsample( RawTile& in, unsigned int factor ){
+
+  if( factor <= 1 ) return;
+
+  unsigned int resampled_width = (in.width + factor - 1) / factor;
+  unsigned int resampled_height = (in.height + factor - 1) / factor;
+  unsigned long np = (unsigned long) resampled_width * resampled_height * in.channels;
+
+  void *output = NULL;
+  if( in.bpc == 16 ){
+    output = new unsigned short[np];
+    downsample_area( (unsigned short*) in.data, (unsigned short*) output, in.width, in.height, in.channels, factor, true );
+    delete[] (unsigned short*) in.data;
+  }
+  else if( in.bpc == 32 && in.sampleType == FIXEDPOINT ){
+    output = new unsigned int[np];
+    downsample_area( (unsigned int*) in.data, (unsigned int*) output, in.width, in.height, in.channels, factor, true );
+    delete[] (unsigned int*) in.data;
+  }
+  else if( in.bpc == 32 && in.sampleType == FLOATINGPOINT ){
+    output = new float[np];
+    downsample_area( (float*) in.data, (float*) output, in.width, in.height, in.channels, factor, false );
+    delete[] (float*) in.data;
+  }
+  else{
+    output = new unsigned char[np];
+    downsample_area( (unsigned char*) in.data, (unsigned char*) output, in.width, in.height, in.channels, factor, true );
+    delete[] (unsigned char*) in.data;
+  }
+
+  // Correctly set our Rawtile info
+  in.width = resampled_width;
+  in.height = resampled_height;
+  in.dataLength = np * (in.bpc/8);
+  in.data = output;
+  in.memoryManaged = 1;
+}
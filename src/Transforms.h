@@ -113,7 +113,22 @@ struct Transform {
       @param w target width
       @param h target height
   */
-  void interpolate_nearestneighbour( RawTile& in, unsigned int w, unsigned int h );
+  void interpolate_nearestneighbour( RawTile& in, unsigned int w, unsigned int h ){
+    interpolate_nearestneighbour( in, w, h, in.height, 0, 0, h );
+  };
+
+
+  /// Resize a horizontal band of an image using nearest neighbour interpolation
+  /** @param in band of input data
+      @param w target width of the whole image
+      @param h target height of the whole image
+      @param source_height height of the whole input image
+      @param source_top row of the whole input image at which our band starts
+      @param first_row first output row to produce
+      @param rows number of output rows to produce
+  */
+  void interpolate_nearestneighbour( RawTile& in, unsigned int w, unsigned int h, unsigned int source_height,
+				     unsigned int source_top, unsigned int first_row, unsigned int rows );
 
 
   /// Resize image using bilinear interpolation
@@ -121,7 +136,31 @@ struct Transform {
       @param w target width
       @param h target height
   */
-  void interpolate_bilinear( RawTile& in, unsigned int w, unsigned int h );
+  void interpolate_bilinear( RawTile& in, unsigned int w, unsigned int h ){
+    interpolate_bilinear( in, w, h, in.height, 0, 0, h );
+  };
+
+
+  /// Resize a horizontal band of an image using bilinear interpolation
+  /** Unless it reaches the end of the image, the band must contain the two input rows below
+      the last row used by the output rows requested
+      @param in band of input data
+      @param w target width of the whole image
+      @param h target height of the whole image
+      @param source_height height of the whole input image
+      @param source_top row of the whole input image at which our band starts
+      @param first_row first output row to produce
+      @param rows number of output rows to produce
+  */
+  void interpolate_bilinear( RawTile& in, unsigned int w, unsigned int h, unsigned int source_height,
+			     unsigned int source_top, unsigned int first_row, unsigned int rows );
+
+
+  /// Downsample image by an integer factor using area averaging
+  /** @param in tile input data - must be memory managed
+      @param factor integer downsampling factor: output size is rounded up
+  */
+  void downsample( RawTile& in, unsigned int factor );
 
 
   /// Rotate image - currently only by 90, 180 or 270 degrees, other values will do nothing
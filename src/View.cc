@@ -271,3 +271,39 @@ int View::getLayers(){
 
   return layers;
 }
+
+
+
+/// Return the image channels required to produce our output
+std::vector<bool> View::getChannelSubset( unsigned int channels ){
+
+  std::vector<bool> subset;
+
+  // Hill-shading requires all of our channels
+  if( shaded || channels < 2 ) return subset;
+
+  if( ctw.size() ){
+    // Only channels with a non-zero weight within our colour twist matrix contribute
+    subset.assign( channels, false );
+    for( unsigned int i=0; i<ctw.size() && i<channels; i++ ){
+      for( unsigned int j=0; j<ctw[i].size() && j<channels; j++ ){
+	if( ctw[i][j] != 0.0 ) subset[j] = true;
+      }
+    }
+  }
+  else{
+    // Otherwise multi-band images are flattened to the first 1 or 3 bands for JPEG, PNG, WebP or TIFF output
+    unsigned int bands = channels;
+    if( (output_format == JPEG && (channels == 2 || channels > 3)) ||
+	((output_format == PNG || output_format == WEBP || output_format == BIGTIFF) && channels > 4) ) bands = (channels == 2) ? 1 : 3;
+    subset.assign( channels, false );
+    for( unsigned int i=0; i<bands; i++ ) subset[i] = true;
+  }
+
+  // Return an empty subset if every channel is required
+  for( unsigned int i=0; i<channels; i++ ){
+    if( !subset[i] ) return subset;
+  }
+  subset.clear();
+  return subset;
+}
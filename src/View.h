@@ -269,6 +269,13 @@ class View{
     else return false;
   }
 
+  /// Return the image channels required to produce our output
+  /** Channels that are discarded by a colour twist or by flattening to 1 or 3 bands need not be decoded
+      @param channels number of channels in the image
+      @return flag for each channel - empty if all channels are required
+   */
+  std::vector<bool> getChannelSubset( unsigned int channels );
+
 };
 
 
@@ -0,0 +1,234 @@
+/*  WebP class wrapper to libwebp library
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "WebPCompressor.h"
+#include <vector>
+#include <cstring>
+
+using namespace std;
+
+
+// Encoding effort: 0 (fastest) to 6 (smallest). Tiles are encoded on demand, so favour speed
+#define WEBP_METHOD 2
+
+// VP8X feature flags
+#define VP8X_ICC   0x20
+#define VP8X_ALPHA 0x10
+#define VP8X_XMP   0x04
+
+
+
+// WebP writer callback appending to a string
+static int webp_write_data( const uint8_t* data, size_t length, const WebPPicture* picture )
+{
+  string* output = (string*) picture->custom_ptr;
+  output->append( (const char*) data, length );
+  return 1;
+}
+
+
+
+// Little endian helpers for RIFF chunks
+static void put_le( string& s, unsigned int value, unsigned int bytes )
+{
+  for( unsigned int i = 0; i < bytes; i++ ) s += (char) ((value >> (8*i)) & 0xFF);
+}
+
+static unsigned int get_le( const unsigned char* p, unsigned int bytes )
+{
+  unsigned int value = 0;
+  for( unsigned int i = 0; i < bytes; i++ ) value |= (unsigned int) p[i] << (8*i);
+  return value;
+}
+
+
+
+// Append a RIFF chunk with padding to an even size
+static void append_chunk( string& s, const char* fourcc, const char* data, size_t length )
+{
+  s.append( fourcc, 4 );
+  put_le( s, length, 4 );
+  s.append( data, length );
+  if( length & 1 ) s += (char) 0;
+}
+
+
+
+void WebPCompressor::encode( const RawTile& rawtile, string& output )
+{
+  // Make sure we only try to compress 8 bit images with 1 to 4 channels
+  if( rawtile.bpc != 8 ) throw string( "WebPCompressor :: WebP can only handle 8 bit images" );
+  if( rawtile.channels < 1 || rawtile.channels > 4 ){
+    throw string( "WebPCompressor :: WebP can only handle images with 1 to 4 channels" );
+  }
+
+  unsigned int width = rawtile.width;
+  unsigned int height = rawtile.height;
+  unsigned int channels = rawtile.channels;
+  const unsigned char* data = (const unsigned char*) rawtile.data;
+  bool alpha = (channels == 2 || channels == 4);
+
+  // libwebp only accepts RGB or RGBA input, so expand greyscale images
+  vector<unsigned char> expanded;
+  if( channels < 3 ){
+    size_t np = (size_t) width * height;
+    expanded.resize( np * (channels+2) );
+    unsigned char* out = &expanded[0];
+    for( size_t i = 0; i < np; i++ ){
+      unsigned char v = data[i*channels];
+      *out++ = v; *out++ = v; *out++ = v;
+      if( alpha ) *out++ = data[i*channels+1];
+    }
+    data = &expanded[0];
+    channels += 2;
+  }
+
+  WebPConfig config;
+  if( !WebPConfigInit( &config ) ) throw string( "WebPCompressor :: Incompatible libwebp version" );
+  config.quality = (float) Q;
+  config.method = WEBP_METHOD;
+
+  WebPPicture picture;
+  if( !WebPPictureInit( &picture ) ) throw string( "WebPCompressor :: Incompatible libwebp version" );
+  picture.width = width;
+  picture.height = height;
+
+  int imported = alpha ?
+    WebPPictureImportRGBA( &picture, data, width*channels ) :
+    WebPPictureImportRGB( &picture, data, width*channels );
+  if( !imported ){
+    WebPPictureFree( &picture );
+    throw string( "WebPCompressor :: Unable to allocate memory for image" );
+  }
+
+  string encoded;
+  encoded.reserve( (size_t) width * height / 4 );
+  picture.writer = webp_write_data;
+  picture.custom_ptr = &encoded;
+
+  int ok = WebPEncode( &config, &picture );
+  WebPPictureFree( &picture );
+  if( !ok || encoded.size() < 20 ){
+    throw string( "WebPCompressor :: Encoding failed" );
+  }
+
+
+  // Without metadata, the simple file format produced by libwebp can be used directly
+  bool has_icc = icc.size() > 0;
+  bool has_xmp = xmp.size() > 0;
+  if( !has_icc && !has_xmp ){
+    output.swap( encoded );
+    return;
+  }
+
+
+  // Otherwise rebuild the file in the extended format with a VP8X chunk declaring our metadata.
+  // Chunks follow the 12 byte RIFF header and consist of a fourcc, little endian size and even padded data
+  const unsigned char* p = (const unsigned char*) encoded.data();
+  size_t offset = 12;
+  unsigned char flags = 0;
+  string chunks;
+
+  while( offset + 8 <= encoded.size() ){
+    size_t length = get_le( p + offset + 4, 4 );
+    size_t padded = length + (length & 1);
+    if( offset + 8 + length > encoded.size() ) throw string( "WebPCompressor :: Invalid WebP chunk" );
+
+    // Keep any existing feature flags, but replace the VP8X chunk itself. libwebp drops the alpha
+    // channel of opaque images, so only flag alpha if an alpha chunk or lossless alpha is present
+    if( memcmp( p + offset, "VP8X", 4 ) == 0 ) flags |= p[offset+8];
+    else if( memcmp( p + offset, "ALPH", 4 ) == 0 ) flags |= VP8X_ALPHA;
+    else if( memcmp( p + offset, "VP8L", 4 ) == 0 && length >= 5 && (get_le( p + offset + 9, 4 ) & (1 << 28)) ){
+      flags |= VP8X_ALPHA;
+    }
+
+    if( memcmp( p + offset, "VP8X", 4 ) != 0 ){
+      chunks.append( (const char*) p + offset, 8 + length );
+      if( length & 1 ) chunks += (char) 0;
+    }
+
+    offset += 8 + padded;
+  }
+
+  if( has_icc ) flags |= VP8X_ICC;
+  if( has_xmp ) flags |= VP8X_XMP;
+
+  // VP8X chunk: flags, 3 reserved bytes and the 24 bit canvas width and height minus one
+  string vp8x;
+  vp8x += (char) flags;
+  put_le( vp8x, 0, 3 );
+  put_le( vp8x, width - 1, 3 );
+  put_le( vp8x, height - 1, 3 );
+
+  string body( "WEBP" );
+  append_chunk( body, "VP8X", vp8x.data(), vp8x.size() );
+  if( has_icc ) append_chunk( body, "ICCP", icc.data(), icc.size() );
+  body += chunks;
+  if( has_xmp ) append_chunk( body, "XMP ", xmp.data(), xmp.size() );
+
+  output.assign( "RIFF" );
+  put_le( output, body.size(), 4 );
+  output += body;
+}
+
+
+
+void WebPCompressor::InitCompression( const RawTile& rawtile, unsigned int strip_height )
+{
+  string output;
+  encode( rawtile, output );
+
+  delete[] header;
+  header = new unsigned char[output.size()];
+  memcpy( header, output.data(), output.size() );
+  header_size = output.size();
+}
+
+
+
+unsigned int WebPCompressor::Finish( unsigned char* output )
+{
+  delete[] header;
+  header = NULL;
+  header_size = 0;
+  return 0;
+}
+
+
+
+unsigned int WebPCompressor::Compress( RawTile& rawtile )
+{
+  string output;
+  encode( rawtile, output );
+
+  // Make sure we have enough memory in our tile for the encoded data
+  unsigned long dataLength = output.size();
+  if( dataLength > rawtile.dataLength ){
+    if( rawtile.memoryManaged ) delete[] (unsigned char*) rawtile.data;
+    rawtile.data = new unsigned char[dataLength];
+    rawtile.memoryManaged = 1;
+  }
+  memcpy( rawtile.data, output.data(), dataLength );
+
+  // Set the tile compression parameters
+  rawtile.dataLength = dataLength;
+  rawtile.compressionType = WEBP;
+  rawtile.quality = Q;
+
+  return dataLength;
+}
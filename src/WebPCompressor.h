@@ -0,0 +1,121 @@
+/*  IIP WebP Compressor Class:
+    Handles 8 bit greyscale, RGB and alpha channels, ICC profiles and XMP metadata
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _WEBPCOMPRESSOR_H
+#define _WEBPCOMPRESSOR_H
+
+
+#include "Compressor.h"
+#include <webp/encode.h>
+
+
+
+/// Wrapper class to the WebP library: Handles 8 bit images with 1 to 4 channels
+class WebPCompressor : public Compressor {
+
+ private:
+
+  /// Encode an image to WebP, adding our ICC profile and XMP metadata
+  /** @param rawtile tile containing the image to be compressed
+      @param output string to which the WebP file is written
+   */
+  void encode( const RawTile& rawtile, std::string& output );
+
+
+ public:
+
+  /// Constructor
+  /** @param quality WebP quality factor (0-100) */
+  WebPCompressor( int quality ){
+    Q = quality;
+    header = NULL;
+    header_size = 0;
+  };
+
+
+  /// Destructor
+  ~WebPCompressor(){ delete[] header; };
+
+
+  /// Initialize strip based compression
+  /** WebP cannot be encoded incrementally, so the whole image is encoded here and
+      returned as our header. CompressStrip and Finish produce no further output
+      @param rawtile tile containing the image to be compressed
+      @param strip_height pixel height of the strips to be compressed
+   */
+  void InitCompression( const RawTile& rawtile, unsigned int strip_height );
+
+  /// Compress a strip of image data: the image has already been encoded by InitCompression
+  /** @param s source image data
+      @param o output buffer
+      @param tile_height pixel height of the tile we are compressing
+      @return 0
+   */
+  unsigned int CompressStrip( unsigned char* s, unsigned char* o, unsigned int tile_height ){ return 0; };
+
+  /// Finish the strip based compression and free our encoded image
+  /** @param output output buffer
+      @return 0
+   */
+  unsigned int Finish( unsigned char* output );
+
+  /// Compress an entire buffer of image data at once in one command
+  /** @param t tile of image data
+      @return size of compressed data
+   */
+  unsigned int Compress( RawTile& t );
+
+  /// Return the header size
+  inline unsigned int getHeaderSize() { return header_size; }
+
+  /// Return a pointer to the header itself
+  inline unsigned char* getHeader() { return header; }
+
+  /// Return the WebP mime type
+  inline const char* getMimeType(){ return "image/webp"; }
+
+  /// Return the image filename suffix
+  inline const char* getSuffix(){ return "webp"; }
+
+  /// Get compression type
+  inline CompressionType getCompressionType(){ return WEBP; };
+
+  /// Create an independent compressor with the same settings
+  /** @return new compressor to be deleted by the caller */
+  Compressor* duplicate() {
+    WebPCompressor* c = new WebPCompressor( Q );
+    copySettings( c );
+    return c;
+  };
+
+  /// Get the current quality level
+  inline int getQuality(){ return Q; }
+
+  /// Set the compression quality
+  /** @param factor quality factor (0-100) */
+  inline void setQuality( int factor ){
+    if( factor < 0 ) Q = 0;
+    else if( factor > 100 ) Q = 100;
+    else Q = factor;
+  };
+
+};
+
+
+#endif
@@ -58,6 +58,9 @@ void Zoomify::run( Session* session, const std::string& argument ){
   FIF fif;
   fif.run( session, prefix );
 
+  // The client's copy is still valid: our 304 reply is sent by the main request loop
+  if( session->response->notModified() ) return;
+
 
   // Get the full image size and the total number of resolutions available
   unsigned int width = (*session->image)->getImageWidth();
@@ -80,7 +83,7 @@ void Zoomify::run( Session* session, const std::string& argument ){
   for( n=0; n<numResolutions; n++ ){
     int width = (*session->image)->image_widths[n];
     int height = (*session->image)->image_heights[n];
-    if( width < tw && height < tw ){
+    if( width <= tw && height <= tw ){
       discard++;
     } else {
       ntiles += (int) ceil( (double)width/tw ) * (int) ceil( (double)height/tw );
@@ -107,14 +110,17 @@ void Zoomify::run( Session* session, const std::string& argument ){
 			  << ", image height: " << height << endl;
     }
 
+    // Send our pre-serialised response if we have one
+    this->session = session;
+    string key = "zoomify:" + (*session->image)->getImagePath();
+    if( sendCachedResponse( key, "xml" ) ) return;
+
     // Format our output
-    stringstream header;
-    header << session->response->createHTTPHeader( "xml", (*session->image)->getTimestamp() )
-	   << "<IMAGE_PROPERTIES WIDTH=\"" << width << "\" HEIGHT=\"" << height << "\" "
-	   << "NUMTILES=\"" << ntiles << "\" NUMIMAGES=\"1\" VERSION=\"1.8\" TILESIZE=\"" << tw << "\"/>";
+    stringstream body;
+    body << "<IMAGE_PROPERTIES WIDTH=\"" << width << "\" HEIGHT=\"" << height << "\" "
+	 << "NUMTILES=\"" << ntiles << "\" NUMIMAGES=\"1\" VERSION=\"1.8\" TILESIZE=\"" << tw << "\"/>";
 
-    session->out->putStr( (const char*) header.str().c_str(), header.tellp() );
-    session->response->setImageSent();
+    sendResponse( key, "xml", body.str() );
 
     return;
   }